@@ -19,8 +19,12 @@ CREATE SCHEMA rustica;
 CREATE TABLE rustica.modules(
     name text PRIMARY KEY,
     byte_code bytea NOT NULL,
-    bin_code bytea NOT NULL,
-    heap_types int[] NOT NULL
+    bin_code bytea,  -- NULL to interpret byte_code until it is compiled
+    heap_types int[] NOT NULL,
+    request_timeout int CHECK (request_timeout > 0),  -- ms, overrides the GUC
+    target_cpu text,  -- what bin_code is tuned for, NULL if generic
+    cpu_features text,
+    generic_bin_code bytea  -- fallback for CPUs without cpu_features
 );
 
 CREATE TABLE rustica.queries(
@@ -45,7 +49,10 @@ CREATE TABLE rustica.queries(
 CREATE TYPE rustica.compile_result AS (
     bin_code bytea,
     heap_types int[],
-    queries rustica.queries[]
+    queries rustica.queries[],
+    target_cpu text,
+    cpu_features text,
+    generic_bin_code bytea
 );
 
 CREATE TYPE rustica.tid_oid AS (
@@ -53,13 +60,46 @@ CREATE TYPE rustica.tid_oid AS (
     oid oid
 );
 
-CREATE FUNCTION rustica.compile_wasm(bytea, rustica.tid_oid[])
+-- AOT binaries by the SHA-256 of the WASM module and of the compile options,
+-- so that compile_wasm() of an unchanged module skips LLVM
+CREATE TABLE rustica.aot_cache(
+    wasm_sha256 bytea NOT NULL,
+    options_hash bytea NOT NULL,
+    bin_code bytea NOT NULL,
+    generic_bin_code bytea,
+    created_at timestamptz NOT NULL DEFAULT now(),
+    PRIMARY KEY (wasm_sha256, options_hash)
+);
+
+-- The optional profile is an indexed LLVM profile to guide the compile, like
+-- the one rustica.merge_profiles() returns
+CREATE FUNCTION rustica.compile_wasm(bytea,
+                                     rustica.tid_oid[],
+                                     profile bytea DEFAULT NULL)
     RETURNS rustica.compile_result
     AS 'MODULE_PATHNAME'
+    LANGUAGE C;
+
+-- Like compile_wasm() but without the AOT compile, so bin_code is NULL and
+-- the module is interpreted
+CREATE FUNCTION rustica.prepare_wasm(bytea, rustica.tid_oid[])
+    RETURNS rustica.compile_result
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT;
+
+-- Zero the rustica.stat_queries of a module whose queries are replaced
+CREATE FUNCTION rustica.forget_stat_queries(module text)
+    RETURNS void
+    AS 'MODULE_PATHNAME', 'forget_stat_queries'
     LANGUAGE C STRICT;
 
+REVOKE EXECUTE ON FUNCTION rustica.forget_stat_queries(text) FROM PUBLIC;
+
 CREATE OR REPLACE FUNCTION rustica.invalidate_module_cache() RETURNS TRIGGER AS $$
     BEGIN
+        IF TG_OP <> 'INSERT' THEN
+            PERFORM rustica.forget_stat_queries(OLD.name);
+        END IF;
         IF TG_OP = 'DELETE' THEN
             PERFORM pg_notify('rustica_module_cache_invalidation', OLD.name);
         ELSE
@@ -67,8 +107,250 @@ CREATE OR REPLACE FUNCTION rustica.invalidate_module_cache() RETURNS TRIGGER AS
         END IF;
         RETURN NULL;
     END;
-$$ LANGUAGE plpgsql;
+$$ LANGUAGE plpgsql SECURITY DEFINER SET search_path = pg_catalog;
 
 CREATE TRIGGER module_change
     AFTER INSERT OR UPDATE OR DELETE ON rustica.modules
     FOR EACH ROW EXECUTE FUNCTION rustica.invalidate_module_cache();
+
+-- Raw LLVM profiles of modules compiled with rustica.pgo_instrument, one per
+-- worker and module load, with counters adding up since loaded_at
+CREATE TABLE rustica.aot_profiles(
+    module text NOT NULL REFERENCES rustica.modules(name) ON DELETE CASCADE,
+    worker_pid int NOT NULL,
+    loaded_at timestamptz NOT NULL,
+    raw_profile bytea NOT NULL,
+    updated_at timestamptz NOT NULL DEFAULT now(),
+    PRIMARY KEY (module, worker_pid, loaded_at)
+);
+
+CREATE OR REPLACE FUNCTION rustica.clear_aot_profiles() RETURNS TRIGGER AS $$
+    BEGIN
+        DELETE FROM rustica.aot_profiles WHERE module = OLD.name;
+        RETURN NULL;
+    END;
+$$ LANGUAGE plpgsql;
+
+-- Profiles only match the byte_code they were collected with
+CREATE TRIGGER module_byte_code_change
+    AFTER UPDATE OF byte_code ON rustica.modules
+    FOR EACH ROW
+    WHEN (OLD.byte_code IS DISTINCT FROM NEW.byte_code)
+    EXECUTE FUNCTION rustica.clear_aot_profiles();
+
+-- Merge the profiles of a module with rustica.llvm_profdata. It runs a
+-- program on the server, so only the owner and roles granted it may call it.
+CREATE FUNCTION rustica.merge_profiles(module text)
+    RETURNS bytea
+    AS 'MODULE_PATHNAME', 'merge_profiles'
+    LANGUAGE C STRICT;
+
+REVOKE EXECUTE ON FUNCTION rustica.merge_profiles(text) FROM PUBLIC;
+
+CREATE FUNCTION rustica.stat_io(
+    OUT requests bigint,
+    OUT recv_calls bigint,
+    OUT recv_eagain bigint,
+    OUT send_calls bigint,
+    OUT send_eagain bigint,
+    OUT waits bigint,
+    OUT wait_modifies bigint,
+    OUT sockopt_calls bigint,
+    OUT bytes_received bigint,
+    OUT bytes_sent bigint,
+    OUT disconnects bigint,
+    OUT timeouts bigint
+)
+    RETURNS record
+    AS 'MODULE_PATHNAME', 'stat_io'
+    LANGUAGE C STRICT;
+
+CREATE VIEW rustica.stat_io AS
+    SELECT *,
+           (recv_calls + send_calls + waits + wait_modifies + sockopt_calls)::float8
+               / NULLIF(requests, 0) AS syscalls_per_request
+    FROM rustica.stat_io();
+
+-- Latency histograms per module and request phase, in milliseconds. The
+-- percentiles are accurate to 1/8 of their power of two.
+CREATE FUNCTION rustica.stat_phases(
+    OUT module text,
+    OUT phase text,
+    OUT count bigint,
+    OUT mean_ms float8,
+    OUT p50_ms float8,
+    OUT p99_ms float8,
+    OUT p999_ms float8,
+    OUT max_ms float8
+)
+    RETURNS SETOF record
+    AS 'MODULE_PATHNAME', 'stat_phases'
+    LANGUAGE C STRICT;
+
+CREATE VIEW rustica.stat_phases AS
+    SELECT * FROM rustica.stat_phases();
+
+-- From accepting the connection, or from the arrival of a later request on a
+-- keep-alive connection, until the request is done
+CREATE VIEW rustica.stat_requests AS
+    SELECT module, count AS requests, mean_ms, p50_ms, p99_ms, p999_ms, max_ms
+    FROM rustica.stat_phases()
+    WHERE phase = 'request';
+
+-- Cumulative times of each query in milliseconds: args_ms converts the wasm
+-- arguments to datums, exec_ms runs the plan, results_ms converts the rows back
+CREATE FUNCTION rustica.stat_queries(
+    OUT module text,
+    OUT index int,
+    OUT calls bigint,
+    OUT rows bigint,
+    OUT total_ms float8,
+    OUT max_ms float8,
+    OUT args_ms float8,
+    OUT exec_ms float8,
+    OUT results_ms float8
+)
+    RETURNS SETOF record
+    AS 'MODULE_PATHNAME', 'stat_queries'
+    LANGUAGE C STRICT;
+
+CREATE VIEW rustica.stat_queries AS
+    SELECT s.*, s.total_ms / NULLIF(s.calls, 0) AS mean_ms, q.sql
+    FROM rustica.stat_queries() s
+    LEFT JOIN rustica.queries q USING (module, index);
+
+-- Zero rustica.stat_phases and rustica.stat_queries of one module, or of all
+-- modules if module is NULL
+CREATE FUNCTION rustica.stat_reset(module text DEFAULT NULL)
+    RETURNS void
+    AS 'MODULE_PATHNAME', 'stat_reset'
+    LANGUAGE C;
+
+REVOKE EXECUTE ON FUNCTION rustica.stat_reset(text) FROM PUBLIC;
+
+CREATE TABLE rustica.static_assets(
+    path text PRIMARY KEY CHECK (path LIKE '/%' AND length(path) < 1024),
+    content_type text NOT NULL,
+    etag text NOT NULL,
+    body bytea NOT NULL
+);
+
+CREATE OR REPLACE FUNCTION rustica.invalidate_static_asset() RETURNS TRIGGER AS $$
+    BEGIN
+        IF TG_OP = 'DELETE' THEN
+            PERFORM pg_notify('rustica_static_asset_invalidation', OLD.path);
+        ELSE
+            IF TG_OP = 'UPDATE' AND OLD.path <> NEW.path THEN
+                PERFORM pg_notify('rustica_static_asset_invalidation', OLD.path);
+            END IF;
+            PERFORM pg_notify('rustica_static_asset_invalidation', NEW.path);
+        END IF;
+        RETURN NULL;
+    END;
+$$ LANGUAGE plpgsql;
+
+CREATE TRIGGER static_asset_change
+    AFTER INSERT OR UPDATE OR DELETE ON rustica.static_assets
+    FOR EACH ROW EXECUTE FUNCTION rustica.invalidate_static_asset();
+
+CREATE FUNCTION rustica.purge(tag text)
+    RETURNS integer
+    AS 'MODULE_PATHNAME', 'purge'
+    LANGUAGE C STRICT;
+
+REVOKE EXECUTE ON FUNCTION rustica.purge(text) FROM PUBLIC;
+
+CREATE TABLE rustica.compile_queue(
+    id bigserial PRIMARY KEY,
+    name text NOT NULL,
+    byte_code bytea NOT NULL,
+    tid_oids rustica.tid_oid[] NOT NULL DEFAULT '{}',
+    request_timeout int CHECK (request_timeout > 0),
+    tiered boolean NOT NULL DEFAULT false,  -- interpret while compiling
+    profile bytea,  -- indexed LLVM profile to compile with
+    status text NOT NULL DEFAULT 'pending'
+        CHECK (status IN ('pending', 'compiling', 'interpreting', 'done',
+                          'failed')),
+    error text,
+    attempts int NOT NULL DEFAULT 0,  -- claims so far, see COMPILE_MAX_ATTEMPTS
+    worker_pid int,
+    submitted_at timestamptz NOT NULL DEFAULT now(),
+    started_at timestamptz,
+    finished_at timestamptz
+);
+
+CREATE INDEX ON rustica.compile_queue(id)
+    WHERE status IN ('pending', 'compiling', 'interpreting');
+
+CREATE OR REPLACE FUNCTION rustica.notify_compile_queue() RETURNS TRIGGER AS $$
+    BEGIN
+        IF TG_OP = 'INSERT' THEN
+            PERFORM pg_notify('rustica_compile_queue', NEW.id::text);
+        ELSIF NEW.status IN ('interpreting', 'done', 'failed') THEN
+            PERFORM pg_notify('rustica_compile_done',
+                              NEW.id || ' ' || NEW.name || ' ' || NEW.status);
+        END IF;
+        RETURN NULL;
+    END;
+$$ LANGUAGE plpgsql;
+
+CREATE TRIGGER compile_queue_change
+    AFTER INSERT OR UPDATE OF status ON rustica.compile_queue
+    FOR EACH ROW EXECUTE FUNCTION rustica.notify_compile_queue();
+
+-- Queue a module for compilation by the compile workers; LISTEN on
+-- rustica_compile_done to learn when it is deployed. A tiered module is
+-- deployed for the interpreter first ("interpreting"), and workers switch to
+-- the AOT build once it is "done".
+CREATE FUNCTION rustica.submit_wasm(
+    name text,
+    byte_code bytea,
+    tid_oids rustica.tid_oid[] DEFAULT '{}',
+    request_timeout int DEFAULT NULL,
+    tiered boolean DEFAULT false
+)
+    RETURNS bigint
+    AS $$
+        INSERT INTO rustica.compile_queue(name, byte_code, tid_oids,
+                                          request_timeout, tiered)
+        VALUES (name, byte_code, tid_oids, request_timeout, tiered)
+        RETURNING id;
+    $$ LANGUAGE sql;
+
+-- Queue a recompile of a deployed module guided by the profiles collected so
+-- far, with the tid_oids of its last submission
+CREATE FUNCTION rustica.recompile_with_profile(module text)
+    RETURNS bigint
+    AS $$
+        INSERT INTO rustica.compile_queue(name, byte_code, tid_oids,
+                                          request_timeout, profile)
+        SELECT m.name,
+               m.byte_code,
+               coalesce((SELECT q.tid_oids
+                         FROM rustica.compile_queue q
+                         WHERE q.name = m.name
+                         ORDER BY q.id DESC
+                         LIMIT 1),
+                        '{}'),
+               m.request_timeout,
+               rustica.merge_profiles(m.name)
+        FROM rustica.modules m
+        WHERE m.name = module
+        RETURNING id;
+    $$ LANGUAGE sql;
+
+CREATE VIEW rustica.compile_status AS
+    SELECT id,
+           name,
+           status,
+           tiered,
+           error,
+           attempts,
+           worker_pid,
+           length(byte_code) AS byte_code_size,
+           submitted_at,
+           started_at,
+           finished_at,
+           coalesce(started_at, now()) - submitted_at AS queued_for,
+           coalesce(finished_at, now()) - started_at AS compiling_for
+    FROM rustica.compile_queue;
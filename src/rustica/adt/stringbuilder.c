@@ -18,9 +18,16 @@
 #include "varatt.h"
 #include "catalog/pg_type_d.h"
 #include "mb/pg_wchar.h"
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
 
 #include "wasm_runtime_common.h"
 #include "rustica/datatypes.h"
+#include "rustica/http.h"
 #include "rustica/module.h"
 
 static wasm_externref_obj_t
@@ -123,6 +130,95 @@ sb_to_bytes(wasm_exec_env_t exec_env, wasm_obj_t refobj) {
     return cstring_into_varatt_obj(exec_env, sb->data, sb->len, BYTEAOID);
 }
 
+#ifdef HAVE_LIBZ
+static bytea *
+sb_deflate(StringInfo sb, bool gzip, int32_t level) {
+    z_stream zs = { 0 };
+    int rv = deflateInit2(&zs,
+                          level > 0 ? Min(level, 9) : Z_DEFAULT_COMPRESSION,
+                          Z_DEFLATED,
+                          gzip ? MAX_WBITS + 16 : MAX_WBITS,
+                          8,
+                          Z_DEFAULT_STRATEGY);
+    if (rv != Z_OK)
+        ereport(ERROR, errmsg("sb_compress: deflateInit2 failed: %d", rv));
+    uLong bound = deflateBound(&zs, sb->len);
+    if (bound > VARATT_MAX - VARHDRSZ) {
+        deflateEnd(&zs);
+        ereport(ERROR, errmsg("sb_compress: input too long"));
+    }
+    bytea *out = (bytea *)palloc(VARHDRSZ + bound);
+    zs.next_in = (Bytef *)sb->data;
+    zs.avail_in = sb->len;
+    zs.next_out = (Bytef *)VARDATA(out);
+    zs.avail_out = bound;
+    rv = deflate(&zs, Z_FINISH);
+    deflateEnd(&zs);
+    if (rv != Z_STREAM_END)
+        ereport(ERROR, errmsg("sb_compress: deflate failed: %d", rv));
+    SET_VARSIZE(out, VARHDRSZ + zs.total_out);
+    return out;
+}
+#endif
+
+#ifdef USE_ZSTD
+static bytea *
+sb_zstd(StringInfo sb, int32_t level) {
+    size_t bound = ZSTD_compressBound(sb->len);
+    if (bound > VARATT_MAX - VARHDRSZ)
+        ereport(ERROR, errmsg("sb_compress: input too long"));
+    bytea *out = (bytea *)palloc(VARHDRSZ + bound);
+    size_t rv = ZSTD_compress(VARDATA(out),
+                              bound,
+                              sb->data,
+                              sb->len,
+                              level > 0 ? Min(level, ZSTD_maxCLevel())
+                                        : ZSTD_CLEVEL_DEFAULT);
+    if (ZSTD_isError(rv))
+        ereport(ERROR, errmsg("sb_compress: %s", ZSTD_getErrorName(rv)));
+    SET_VARSIZE(out, VARHDRSZ + rv);
+    return out;
+}
+#endif
+
+// Compress the content of a StringBuilder into a new bytes object, ready to be
+// sent with the matching Content-Encoding. The algorithm is one of the values
+// returned by req_accept_encoding(); a level <= 0 means the default level.
+static wasm_externref_obj_t
+sb_compress(wasm_exec_env_t exec_env,
+            wasm_obj_t refobj,
+            int32_t algo,
+            int32_t level) {
+    StringInfo sb = sb_ensure_string_info(refobj);
+    bytea *rv;
+
+    switch (algo) {
+        case RST_HTTP_ENCODING_IDENTITY:
+            return cstring_into_varatt_obj(exec_env,
+                                           sb->data,
+                                           sb->len,
+                                           BYTEAOID);
+#ifdef HAVE_LIBZ
+        case RST_HTTP_ENCODING_GZIP:
+        case RST_HTTP_ENCODING_DEFLATE:
+            rv = sb_deflate(sb, algo == RST_HTTP_ENCODING_GZIP, level);
+            break;
+#endif
+#ifdef USE_ZSTD
+        case RST_HTTP_ENCODING_ZSTD:
+            rv = sb_zstd(sb, level);
+            break;
+#endif
+        default:
+            ereport(ERROR,
+                    errmsg("sb_compress: unsupported content encoding %d",
+                           algo));
+    }
+    return rst_externref_of_owned_datum(exec_env,
+                                        PointerGetDatum(rv),
+                                        BYTEAOID);
+}
+
 static NativeSymbol sb_symbols[] = {
     { "sb_new", sb_new, "(i)r" },
     { "sb_mblength", sb_mblength, "(r)i" },
@@ -133,6 +229,7 @@ static NativeSymbol sb_symbols[] = {
     { "sb_write_byte", sb_write_byte, "(ri)i" },
     { "sb_to_string", sb_to_string, "(r)r" },
     { "sb_to_bytes", sb_to_bytes, "(r)r" },
+    { "sb_compress", sb_compress, "(rii)r" },
 };
 
 void
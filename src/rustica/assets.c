@@ -0,0 +1,570 @@
+/*
+ * Copyright (c) 2026-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "postgres.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "access/xact.h"
+#include "catalog/pg_type_d.h"
+#include "commands/async.h"
+#include "common/hashfn.h"
+#include "executor/spi.h"
+#include "libpq/libpq.h"
+#include "libpq/pqformat.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/procsignal.h"
+#include "tcop/tcopprot.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/snapmgr.h"
+
+#include "rustica/assets.h"
+#include "rustica/gucs.h"
+
+// Each asset is one file named after the hash of its path, holding this text
+// header followed by the body. Files are replaced atomically with rename().
+#define ASSET_MAGIC "RUSTICA-ASSET 1\n"
+#define ASSET_HEADER_MAX 4096
+#define ASSET_FIELD_MAX 256
+
+// Resync everything now and then, in case a notification was missed
+#define ASSETS_POLL_MS 60000
+
+typedef struct AssetHeader {
+    int len; // body offset
+    char *path;
+    char *etag;
+    char *content_type;
+} AssetHeader;
+
+static inline uint64
+asset_hash(const char *path, int len) {
+    return hash_bytes_extended((const unsigned char *)path, len, 0);
+}
+
+static inline void
+asset_file_name(char *buf, const char *path, int len) {
+    snprintf(buf,
+             MAXPGPATH,
+             RST_ASSETS_DIR "/%016llx",
+             (unsigned long long)asset_hash(path, len));
+}
+
+// Read the header of an asset file into buf; false if it's not an asset
+static bool
+read_header(int fd, char *buf, AssetHeader *header) {
+    ssize_t n = pread(fd, buf, ASSET_HEADER_MAX - 1, 0);
+    char *fields[3];
+    char *p = buf;
+
+    if (n < (ssize_t)strlen(ASSET_MAGIC))
+        return false;
+    buf[n] = '\0';
+    if (strncmp(buf, ASSET_MAGIC, strlen(ASSET_MAGIC)) != 0)
+        return false;
+    p += strlen(ASSET_MAGIC);
+    for (int i = 0; i < 3; i++) {
+        char *nl = memchr(p, '\n', buf + n - p);
+        if (!nl)
+            return false;
+        *nl = '\0';
+        fields[i] = p;
+        p = nl + 1;
+    }
+    header->len = (int)(p - buf);
+    header->path = fields[0];
+    header->etag = fields[1];
+    header->content_type = fields[2];
+    return true;
+}
+
+// Strip the weak prefix and quotes of an entity tag
+static void
+normalize_etag(const char **tag, int *len) {
+    const char *p = *tag, *end = *tag + *len;
+    if (end - p >= 2 && p[0] == 'W' && p[1] == '/')
+        p += 2;
+    if (end - p >= 2 && *p == '"' && end[-1] == '"') {
+        p++;
+        end--;
+    }
+    *tag = p;
+    *len = (int)(end - p);
+}
+
+static bool
+etag_matches(const char *if_none_match, int len, const char *etag) {
+    const char *p = if_none_match, *end = if_none_match + len;
+    int etag_len = (int)strlen(etag);
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        const char *tag = p;
+        while (p < end && *p != ',')
+            p++;
+        int tag_len = (int)(p - tag);
+        while (tag_len > 0
+               && (tag[tag_len - 1] == ' ' || tag[tag_len - 1] == '\t'))
+            tag_len--;
+        if (tag_len == 1 && *tag == '*')
+            return true;
+        normalize_etag(&tag, &tag_len);
+        if (tag_len == etag_len && memcmp(tag, etag, etag_len) == 0)
+            return true;
+    }
+    return false;
+}
+
+// Runs in the master, or in a worker for later requests: answer a complete GET
+// or HEAD request head from the file cache. Returns false if the request has
+// to go to the guest.
+bool
+rst_assets_lookup(const char *req, int len, StaticResponse *resp) {
+    const char *end = memmem(req, len, "\r\n\r\n", 4);
+    const char *p, *path;
+    const char *if_none_match = NULL;
+    int if_none_match_len = 0;
+    bool head_only;
+    char file_name[MAXPGPATH];
+    char buf[ASSET_HEADER_MAX];
+    AssetHeader header;
+    struct stat st;
+
+    if (!end)
+        return false;
+    if (end - req > 4 && memcmp(req, "GET ", 4) == 0) {
+        head_only = false;
+        p = req + 4;
+    }
+    else if (end - req > 5 && memcmp(req, "HEAD ", 5) == 0) {
+        head_only = true;
+        p = req + 5;
+    }
+    else
+        return false;
+
+    path = p;
+    while (p < end && *p != ' ' && *p != '?')
+        p++;
+    int path_len = (int)(p - path);
+    if (path_len == 0 || path_len >= RST_ASSETS_MAX_PATH || *path != '/')
+        return false;
+
+    // Only If-None-Match matters among the request headers
+    p = memchr(req, '\n', end - req);
+    while (p && ++p < end) {
+        const char *eol = memchr(p, '\r', end + 1 - p);
+        if (eol - p > 14 && pg_strncasecmp(p, "If-None-Match:", 14) == 0) {
+            if_none_match = p + 14;
+            if_none_match_len = (int)(eol - if_none_match);
+            break;
+        }
+        p = memchr(p, '\n', end + 2 - p);
+    }
+
+    asset_file_name(file_name, path, path_len);
+    int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) < 0 || !read_header(fd, buf, &header)
+        || strlen(header.path) != path_len
+        || memcmp(header.path, path, path_len) != 0) {
+        close(fd);
+        return false;
+    }
+
+    resp->consumed = (int)(end + 4 - req);
+    resp->offset = header.len;
+    resp->remaining = st.st_size - header.len;
+    if (if_none_match
+        && etag_matches(if_none_match, if_none_match_len, header.etag)) {
+        resp->head_len = snprintf(resp->head,
+                                  sizeof(resp->head),
+                                  "HTTP/1.1 304 Not Modified\r\n"
+                                  "ETag: \"%s\"\r\n"
+                                  "Connection: close\r\n\r\n",
+                                  header.etag);
+        head_only = true;
+    }
+    else
+        resp->head_len = snprintf(resp->head,
+                                  sizeof(resp->head),
+                                  "HTTP/1.1 200 OK\r\n"
+                                  "Content-Type: %s\r\n"
+                                  "Content-Length: %lld\r\n"
+                                  "ETag: \"%s\"\r\n"
+                                  "Connection: close\r\n\r\n",
+                                  header.content_type,
+                                  (long long)resp->remaining,
+                                  header.etag);
+    if (head_only) {
+        close(fd);
+        resp->file = -1;
+        resp->remaining = 0;
+    }
+    else
+        resp->file = fd;
+    return true;
+}
+
+static bool
+valid_field(const char *value, int len) {
+    return len <= ASSET_FIELD_MAX && !memchr(value, '\n', len)
+           && !memchr(value, '\r', len);
+}
+
+static void
+write_asset(text *path, text *content_type, text *etag, bytea *body) {
+    char file_name[MAXPGPATH], tmp_name[MAXPGPATH];
+    const char *tag = VARDATA_ANY(etag);
+    int tag_len = VARSIZE_ANY_EXHDR(etag);
+    int path_len = VARSIZE_ANY_EXHDR(path);
+    StringInfoData header;
+
+    normalize_etag(&tag, &tag_len);
+    if (path_len >= RST_ASSETS_MAX_PATH
+        || memchr(VARDATA_ANY(path), '\n', path_len)
+        || !valid_field(VARDATA_ANY(content_type),
+                        VARSIZE_ANY_EXHDR(content_type))
+        || !valid_field(tag, tag_len) || memchr(tag, '"', tag_len)) {
+        ereport(WARNING,
+                errmsg("skipping static asset \"%.*s\" with invalid metadata",
+                       path_len,
+                       VARDATA_ANY(path)));
+        return;
+    }
+
+    initStringInfo(&header);
+    appendStringInfoString(&header, ASSET_MAGIC);
+    appendBinaryStringInfo(&header, VARDATA_ANY(path), path_len);
+    appendStringInfoChar(&header, '\n');
+    appendBinaryStringInfo(&header, tag, tag_len);
+    appendStringInfoChar(&header, '\n');
+    appendBinaryStringInfo(&header,
+                           VARDATA_ANY(content_type),
+                           VARSIZE_ANY_EXHDR(content_type));
+    appendStringInfoChar(&header, '\n');
+
+    if (MakePGDirectory(RST_ASSETS_DIR) < 0 && errno != EEXIST)
+        ereport(ERROR,
+                errcode_for_file_access(),
+                errmsg("could not create directory \"%s\": %m",
+                       RST_ASSETS_DIR));
+    asset_file_name(file_name, VARDATA_ANY(path), path_len);
+    snprintf(tmp_name, MAXPGPATH, "%s.tmp.%d", file_name, MyProcPid);
+    int fd = OpenTransientFile(tmp_name, O_WRONLY | O_CREAT | O_TRUNC);
+    if (fd < 0)
+        ereport(ERROR,
+                errcode_for_file_access(),
+                errmsg("could not create file \"%s\": %m", tmp_name));
+    if (write(fd, header.data, header.len) != header.len
+        || write(fd, VARDATA_ANY(body), VARSIZE_ANY_EXHDR(body))
+               != VARSIZE_ANY_EXHDR(body)) {
+        CloseTransientFile(fd);
+        unlink(tmp_name);
+        ereport(ERROR,
+                errcode_for_file_access(),
+                errmsg("could not write file \"%s\": %m", tmp_name));
+    }
+    CloseTransientFile(fd);
+    if (rename(tmp_name, file_name) < 0) {
+        unlink(tmp_name);
+        ereport(ERROR,
+                errcode_for_file_access(),
+                errmsg("could not rename file \"%s\": %m", tmp_name));
+    }
+    pfree(header.data);
+}
+
+// Compare the cached entity tag of an asset, so that unchanged files are not
+// rewritten by every worker.
+static bool
+cached_etag_equals(const char *path, int path_len, text *etag) {
+    char file_name[MAXPGPATH];
+    char buf[ASSET_HEADER_MAX];
+    AssetHeader header;
+    const char *tag = VARDATA_ANY(etag);
+    int tag_len = VARSIZE_ANY_EXHDR(etag);
+    bool rv = false;
+
+    normalize_etag(&tag, &tag_len);
+    asset_file_name(file_name, path, path_len);
+    int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    if (read_header(fd, buf, &header))
+        rv = strlen(header.path) == path_len
+             && memcmp(header.path, path, path_len) == 0
+             && strlen(header.etag) == tag_len
+             && memcmp(header.etag, tag, tag_len) == 0;
+    close(fd);
+    return rv;
+}
+
+static void
+remove_asset(const char *path, int path_len) {
+    char file_name[MAXPGPATH];
+    char buf[ASSET_HEADER_MAX];
+    AssetHeader header;
+
+    asset_file_name(file_name, path, path_len);
+    int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    bool owned = read_header(fd, buf, &header)
+                 && strlen(header.path) == path_len
+                 && memcmp(header.path, path, path_len) == 0;
+    close(fd);
+    if (owned)
+        unlink(file_name);
+}
+
+// Runs with SPI connected: bring the cached file of one asset up to date with
+// rustica.static_assets.
+void
+rst_assets_refresh(const char *path) {
+    Datum arg = CStringGetTextDatum(path);
+    bool isnull;
+
+    SPI_execute_with_args(
+        "SELECT etag FROM rustica.static_assets WHERE path = $1",
+        1,
+        (Oid[1]){ TEXTOID },
+        &arg,
+        NULL,
+        true,
+        1);
+    if (SPI_processed == 0) {
+        remove_asset(path, (int)strlen(path));
+        return;
+    }
+    text *etag = DatumGetTextPP(SPI_getbinval(SPI_tuptable->vals[0],
+                                              SPI_tuptable->tupdesc,
+                                              1,
+                                              &isnull));
+    if (cached_etag_equals(path, (int)strlen(path), etag))
+        return;
+
+    SPI_execute_with_args("SELECT path, content_type, etag, body "
+                          "FROM rustica.static_assets WHERE path = $1",
+                          1,
+                          (Oid[1]){ TEXTOID },
+                          &arg,
+                          NULL,
+                          true,
+                          1);
+    if (SPI_processed == 0)
+        return;
+    HeapTuple tup = SPI_tuptable->vals[0];
+    TupleDesc desc = SPI_tuptable->tupdesc;
+    write_asset(DatumGetTextPP(SPI_getbinval(tup, desc, 1, &isnull)),
+                DatumGetTextPP(SPI_getbinval(tup, desc, 2, &isnull)),
+                DatumGetTextPP(SPI_getbinval(tup, desc, 3, &isnull)),
+                DatumGetByteaPP(SPI_getbinval(tup, desc, 4, &isnull)));
+}
+
+static int
+uint64_cmp(const void *a, const void *b) {
+    uint64 x = *(const uint64 *)a, y = *(const uint64 *)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Runs with SPI connected: refresh all changed assets and remove files of
+// assets that no longer exist.
+void
+rst_assets_sync_all() {
+    bool isnull;
+
+    SPI_execute("SELECT path, etag FROM rustica.static_assets", true, 0);
+    SPITupleTable *tuptable = SPI_tuptable;
+    uint64 n = SPI_processed;
+    uint64 *hashes = palloc(sizeof(uint64) * Max(n, 1));
+    for (uint64 i = 0; i < n; i++) {
+        HeapTuple tup = tuptable->vals[i];
+        text *path =
+            DatumGetTextPP(SPI_getbinval(tup, tuptable->tupdesc, 1, &isnull));
+        text *etag =
+            DatumGetTextPP(SPI_getbinval(tup, tuptable->tupdesc, 2, &isnull));
+        hashes[i] = asset_hash(VARDATA_ANY(path), VARSIZE_ANY_EXHDR(path));
+        if (!cached_etag_equals(VARDATA_ANY(path),
+                                VARSIZE_ANY_EXHDR(path),
+                                etag))
+            rst_assets_refresh(text_to_cstring(path));
+    }
+    qsort(hashes, n, sizeof(uint64), uint64_cmp);
+
+    DIR *dir = AllocateDir(RST_ASSETS_DIR);
+    struct dirent *de;
+    if (dir == NULL && errno == ENOENT) {
+        pfree(hashes);
+        return;
+    }
+    while ((de = ReadDir(dir, RST_ASSETS_DIR)) != NULL) {
+        char *endptr;
+        char file_name[MAXPGPATH];
+        if (strlen(de->d_name) != 16)
+            continue;
+        uint64 hash = strtoull(de->d_name, &endptr, 16);
+        if (*endptr != '\0'
+            || bsearch(&hash, hashes, n, sizeof(uint64), uint64_cmp))
+            continue;
+        snprintf(file_name, MAXPGPATH, RST_ASSETS_DIR "/%s", de->d_name);
+        unlink(file_name);
+    }
+    FreeDir(dir);
+    pfree(hashes);
+}
+
+static List *pending_assets = NIL;
+static bool shutdown_requested = false;
+
+BackgroundWorkerHandle *
+rst_assets_register() {
+    BackgroundWorker worker = { .bgw_flags =
+                                    BGWORKER_SHMEM_ACCESS
+                                    | BGWORKER_BACKEND_DATABASE_CONNECTION,
+                                .bgw_start_time = BgWorkerStart_ConsistentState,
+                                .bgw_restart_time = 10,
+                                .bgw_notify_pid = 0 };
+    BackgroundWorkerHandle *handle = NULL;
+
+    snprintf(worker.bgw_name, BGW_MAXLEN, "rustica assets");
+    snprintf(worker.bgw_type, BGW_MAXLEN, "rustica assets");
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, "rustica-engine");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "rustica_assets");
+    if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+        ereport(WARNING, errmsg("could not register rustica assets process"));
+    return handle;
+}
+
+static int
+mock_comm_putmessage(char msgtype, const char *s, size_t len) {
+    StringInfoData msg = { .data = (char *)s,
+                           .len = (int)len,
+                           .maxlen = (int)len,
+                           .cursor = 0 };
+    if (msgtype == 'A') {
+        // Refreshed in a transaction after all notifications are read
+        pq_getmsgint(&msg, 4); // pid
+        pq_getmsgstring(&msg); // channel
+        const char *payload = pq_getmsgstring(&msg);
+        MemoryContext old = MemoryContextSwitchTo(TopMemoryContext);
+        pending_assets = lappend(pending_assets, pstrdup(payload));
+        MemoryContextSwitchTo(old);
+    }
+    return 0;
+}
+
+static const PQcommMethods mock_comm_methods = {
+    NULL, NULL, NULL, NULL, mock_comm_putmessage, NULL,
+};
+
+static void
+on_notification_received() {
+    const PQcommMethods *old_methods = PqCommMethods;
+    PqCommMethods = &mock_comm_methods;
+    whereToSendOutput = DestRemote;
+    ProcessNotifyInterrupt(false);
+    whereToSendOutput = DestNone;
+    PqCommMethods = old_methods;
+}
+
+// Refresh the notified assets, or all of them
+static void
+sync_assets(bool all) {
+    ListCell *lc;
+
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    PG_TRY();
+    {
+        SPI_connect();
+        PushActiveSnapshot(GetTransactionSnapshot());
+        pgstat_report_activity(STATE_RUNNING, "refreshing static assets");
+        if (all)
+            rst_assets_sync_all();
+        else
+            foreach (lc, pending_assets)
+                rst_assets_refresh(lfirst(lc));
+        PopActiveSnapshot();
+        SPI_finish();
+        CommitTransactionCommand();
+    }
+    PG_CATCH();
+    {
+        EmitErrorReport();
+        FlushErrorState();
+        AbortCurrentTransaction();
+    }
+    PG_END_TRY();
+    pgstat_report_activity(STATE_IDLE, NULL);
+    list_free_deep(pending_assets);
+    pending_assets = NIL;
+}
+
+static void
+on_sigterm(SIGNAL_ARGS) {
+    shutdown_requested = true;
+    SetLatch(MyLatch);
+}
+
+static void
+on_sigusr1(SIGNAL_ARGS) {
+    procsignal_sigusr1_handler(postgres_signal_arg);
+    SetLatch(MyLatch);
+}
+
+// The master serves the files without a database connection, so this process
+// keeps them in sync with rustica.static_assets, whether workers run or not.
+PGDLLEXPORT void
+rustica_assets(Datum arg) {
+    int rc;
+
+    pqsignal(SIGTERM, on_sigterm);
+    pqsignal(SIGUSR1, on_sigusr1);
+    BackgroundWorkerUnblockSignals();
+
+    if (rst_database == NULL)
+        ereport(FATAL, errmsg("rustica.database is never configured"));
+    BackgroundWorkerInitializeConnection(rst_database, NULL, 0);
+
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    Async_Listen(RST_ASSETS_CHANNEL);
+    CommitTransactionCommand();
+    sync_assets(true);
+
+    while (!shutdown_requested) {
+        rc = WaitLatch(MyLatch,
+                       WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                       ASSETS_POLL_MS,
+                       PG_WAIT_EXTENSION);
+        ResetLatch(MyLatch);
+        CHECK_FOR_INTERRUPTS();
+        if (notifyInterruptPending)
+            on_notification_received();
+        if (pending_assets != NIL)
+            sync_assets(false);
+        else if (rc & WL_TIMEOUT)
+            sync_assets(true);
+    }
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2026-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#ifndef RUSTICA_ASSETS_H
+#define RUSTICA_ASSETS_H
+
+#include "postgres.h"
+#include "postmaster/bgworker.h"
+
+#define RST_ASSETS_DIR "rustica_static"
+#define RST_ASSETS_CHANNEL "rustica_static_asset_invalidation"
+#define RST_ASSETS_MAX_PATH 1024
+#define RST_ASSETS_PEEK_SIZE 8192
+
+// A static asset response prepared by the master
+typedef struct StaticResponse {
+    int consumed;    // length of the request head to be read off the socket
+    int file;        // asset file positioned at the body, or -1 for no body
+    off_t offset;    // body offset in the file
+    off_t remaining; // body bytes left to send
+    int head_len;
+    char head[1024];
+} StaticResponse;
+
+bool
+rst_assets_lookup(const char *req, int len, StaticResponse *resp);
+
+void
+rst_assets_refresh(const char *path);
+
+void
+rst_assets_sync_all();
+
+BackgroundWorkerHandle *
+rst_assets_register();
+
+#endif /* RUSTICA_ASSETS_H */
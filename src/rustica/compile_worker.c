@@ -0,0 +1,419 @@
+/*
+ * Copyright (c) 2026-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#include "postgres.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "access/xact.h"
+#include "catalog/pg_type_d.h"
+#include "commands/async.h"
+#include "executor/spi.h"
+#include "libpq/libpq.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/procsignal.h"
+#include "tcop/tcopprot.h"
+#include "utils/memutils.h"
+#include "utils/snapmgr.h"
+
+#include "rustica/compile_worker.h"
+#include "rustica/gucs.h"
+#include "rustica/module.h"
+
+// Poll the queue now and then, in case a notification was missed
+#define COMPILE_POLL_MS 60000
+
+// A job whose compile worker died this many times, e.g. because LLVM crashed
+// on it, is failed instead of being claimed again
+#define COMPILE_MAX_ATTEMPTS 3
+
+BackgroundWorkerHandle *
+rst_compile_worker_register(int id) {
+    BackgroundWorker worker = { .bgw_flags =
+                                    BGWORKER_SHMEM_ACCESS
+                                    | BGWORKER_BACKEND_DATABASE_CONNECTION,
+                                .bgw_start_time = BgWorkerStart_ConsistentState,
+                                .bgw_restart_time = 10,
+                                .bgw_notify_pid = 0,
+                                .bgw_main_arg = Int32GetDatum(id) };
+    BackgroundWorkerHandle *handle = NULL;
+
+    snprintf(worker.bgw_name, BGW_MAXLEN, "rustica compile worker %d", id);
+    snprintf(worker.bgw_type, BGW_MAXLEN, "rustica compile worker");
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, "rustica-engine");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "rustica_compile_worker");
+    if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+        ereport(WARNING,
+                errmsg("could not register rustica compile worker %d", id));
+    return handle;
+}
+
+// Claim the oldest pending job, or one left behind by a compile worker that
+// died. The claim is committed right away, so that other compile workers skip
+// it and rustica.compile_status shows the progress. A job left behind
+// COMPILE_MAX_ATTEMPTS times is failed rather than taking down yet another
+// compile worker.
+static int64
+claim_job(bool *tiered) {
+    int64 id = 0;
+    bool isnull;
+
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    SPI_connect();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    pgstat_report_activity(STATE_RUNNING, "claiming compile job");
+
+    SPI_execute(psprintf("UPDATE rustica.compile_queue q "
+                         "SET status = 'failed', "
+                         "    error = 'compile worker exited ' || attempts "
+                         "            || ' times while compiling', "
+                         "    finished_at = clock_timestamp() "
+                         "WHERE status IN ('compiling', 'interpreting') "
+                         "  AND attempts >= %d "
+                         "  AND NOT EXISTS ("
+                         "      SELECT FROM pg_stat_activity a "
+                         "      WHERE a.pid = q.worker_pid)",
+                         COMPILE_MAX_ATTEMPTS),
+                false,
+                0);
+    SPI_execute("UPDATE rustica.compile_queue "
+                "SET status = 'compiling', error = NULL, "
+                "    attempts = attempts + 1, "
+                "    worker_pid = pg_backend_pid(), "
+                "    started_at = clock_timestamp() "
+                "WHERE id = ("
+                "    SELECT id FROM rustica.compile_queue q "
+                "    WHERE status = 'pending' "
+                "       OR (status IN ('compiling', 'interpreting') "
+                "           AND NOT EXISTS ("
+                "           SELECT FROM pg_stat_activity a "
+                "           WHERE a.pid = q.worker_pid)) "
+                "    ORDER BY id "
+                "    LIMIT 1 "
+                "    FOR UPDATE SKIP LOCKED) "
+                "RETURNING id, tiered",
+                false,
+                1);
+    if (SPI_processed > 0) {
+        id = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0],
+                                         SPI_tuptable->tupdesc,
+                                         1,
+                                         &isnull));
+        *tiered = DatumGetBool(SPI_getbinval(SPI_tuptable->vals[0],
+                                             SPI_tuptable->tupdesc,
+                                             2,
+                                             &isnull));
+    }
+
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+    pgstat_report_activity(STATE_IDLE, NULL);
+    return id;
+}
+
+// Compile the job and deploy the result in one transaction, so that workers
+// see the new module, its queries and the "done" status all at once. Without
+// aot, the module is deployed for the interpreter and stays "interpreting".
+static void
+compile_job(int64 id, bool aot) {
+    Oid argtypes[9] = { INT8OID };
+    Datum values[9] = { Int64GetDatum(id) };
+    char nulls[9] = { ' ' };
+    TupleDesc tupdesc;
+    bool isnull;
+
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    SPI_connect();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    pgstat_report_activity(STATE_RUNNING,
+                           aot ? "compiling WASM module"
+                               : "preparing WASM module");
+
+    SPI_execute_with_args(
+        psprintf("SELECT j.name, j.byte_code, j.request_timeout, "
+                 "       c.bin_code, c.heap_types, c.queries, "
+                 "       c.target_cpu, c.cpu_features, c.generic_bin_code "
+                 "FROM rustica.compile_queue j, "
+                 "     rustica.%s c "
+                 "WHERE j.id = $1",
+                 aot ? "compile_wasm(j.byte_code, j.tid_oids, j.profile)"
+                     : "prepare_wasm(j.byte_code, j.tid_oids)"),
+        1,
+        argtypes,
+        values,
+        NULL,
+        false,
+        1);
+    if (SPI_processed != 1)
+        ereport(ERROR, errmsg("compile job %lld is gone", (long long)id));
+
+    // $1 name, $2 byte_code, $3 request_timeout, $4 bin_code, $5 heap_types,
+    // $6 queries, $7 target_cpu, $8 cpu_features, $9 generic_bin_code,
+    // straight from the compiled row
+    tupdesc = SPI_tuptable->tupdesc;
+    for (int i = 0; i < 9; i++) {
+        argtypes[i] = SPI_gettypeid(tupdesc, i + 1);
+        values[i] =
+            SPI_getbinval(SPI_tuptable->vals[0], tupdesc, i + 1, &isnull);
+        nulls[i] = isnull ? 'n' : ' ';
+    }
+
+    pgstat_report_activity(STATE_RUNNING, "deploying WASM module");
+    SPI_execute_with_args("DELETE FROM rustica.queries WHERE module = $1",
+                          1,
+                          argtypes,
+                          values,
+                          nulls,
+                          false,
+                          0);
+    SPI_execute_with_args(
+        "INSERT INTO rustica.modules "
+        "    (name, byte_code, bin_code, heap_types, request_timeout, "
+        "     target_cpu, cpu_features, generic_bin_code) "
+        "VALUES ($1, $2, $4, $5, $3, $7, $8, $9) "
+        "ON CONFLICT (name) DO UPDATE SET "
+        "    byte_code = EXCLUDED.byte_code, "
+        "    bin_code = EXCLUDED.bin_code, "
+        "    heap_types = EXCLUDED.heap_types, "
+        "    request_timeout = EXCLUDED.request_timeout, "
+        "    target_cpu = EXCLUDED.target_cpu, "
+        "    cpu_features = EXCLUDED.cpu_features, "
+        "    generic_bin_code = EXCLUDED.generic_bin_code",
+        9,
+        argtypes,
+        values,
+        nulls,
+        false,
+        0);
+    if (nulls[5] != 'n')
+        SPI_execute_with_args(
+            "INSERT INTO rustica.queries "
+            "SELECT $1, q.index, q.sql, q.arg_type, q.arg_oids, "
+            "       q.arg_field_types, q.arg_field_fn, q.ret_type, "
+            "       q.ret_oids, q.ret_field_types, q.ret_field_fn "
+            "FROM unnest($6) q",
+            6,
+            argtypes,
+            values,
+            nulls,
+            false,
+            0);
+
+    argtypes[0] = INT8OID;
+    values[0] = Int64GetDatum(id);
+    nulls[0] = ' ';
+    SPI_execute_with_args(aot ? "UPDATE rustica.compile_queue "
+                                "SET status = 'done', "
+                                "    finished_at = clock_timestamp() "
+                                "WHERE id = $1"
+                              : "UPDATE rustica.compile_queue "
+                                "SET status = 'interpreting' "
+                                "WHERE id = $1",
+                          1,
+                          argtypes,
+                          values,
+                          nulls,
+                          false,
+                          0);
+
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+    pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+static void
+fail_job(int64 id, const char *message) {
+    Oid argtypes[2] = { INT8OID, TEXTOID };
+    Datum values[2] = { Int64GetDatum(id), CStringGetTextDatum(message) };
+
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    SPI_connect();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    SPI_execute_with_args("UPDATE rustica.compile_queue "
+                          "SET status = 'failed', error = $2, "
+                          "    finished_at = clock_timestamp() "
+                          "WHERE id = $1",
+                          2,
+                          argtypes,
+                          values,
+                          NULL,
+                          false,
+                          0);
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+}
+
+// A tiered job is first deployed for the interpreter, which takes no LLVM
+// time, and then compiled like any other job. If the compile fails, the
+// module keeps being interpreted.
+static void
+run_job(int64 id, bool tiered) {
+    MemoryContext mctx = CurrentMemoryContext;
+    TimestampTz start = GetCurrentTimestamp();
+    ErrorData *edata = NULL;
+
+    ereport(LOG,
+            errmsg("rustica compile worker: compiling job %lld",
+                   (long long)id));
+    PG_TRY();
+    {
+        if (tiered) {
+            compile_job(id, false);
+            CHECK_FOR_INTERRUPTS();
+            ereport(LOG,
+                    errmsg("rustica compile worker: job %lld interpreted in "
+                           "%ld ms",
+                           (long long)id,
+                           TimestampDifferenceMilliseconds(
+                               start,
+                               GetCurrentTimestamp())));
+        }
+        compile_job(id, true);
+    }
+    PG_CATCH();
+    {
+        MemoryContextSwitchTo(mctx);
+        edata = CopyErrorData();
+        FlushErrorState();
+        AbortCurrentTransaction();
+    }
+    PG_END_TRY();
+
+    if (edata != NULL) {
+        ereport(LOG,
+                errmsg("rustica compile worker: job %lld failed: %s",
+                       (long long)id,
+                       edata->message));
+        fail_job(id, edata->message);
+        FreeErrorData(edata);
+    }
+    else {
+        ereport(LOG,
+                errmsg("rustica compile worker: job %lld done in %ld ms",
+                       (long long)id,
+                       TimestampDifferenceMilliseconds(start,
+                                                       GetCurrentTimestamp())));
+    }
+}
+
+// A deployed job replaces a binary, whose XIP file is then unused. Failing to
+// sweep is not worth losing the compile worker.
+static void
+sweep_xip_files() {
+    MemoryContext mctx = CurrentMemoryContext;
+    ErrorData *edata;
+
+    PG_TRY();
+    {
+        SetCurrentStatementStartTimestamp();
+        StartTransactionCommand();
+        SPI_connect();
+        PushActiveSnapshot(GetTransactionSnapshot());
+        pgstat_report_activity(STATE_RUNNING, "removing unused XIP files");
+        rst_module_sweep_xip();
+        SPI_finish();
+        PopActiveSnapshot();
+        CommitTransactionCommand();
+    }
+    PG_CATCH();
+    {
+        MemoryContextSwitchTo(mctx);
+        edata = CopyErrorData();
+        FlushErrorState();
+        AbortCurrentTransaction();
+        ereport(LOG,
+                errmsg("rustica compile worker: could not remove unused XIP "
+                       "files: %s",
+                       edata->message));
+        FreeErrorData(edata);
+    }
+    PG_END_TRY();
+    pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+static int
+mock_comm_putmessage(char msgtype, const char *s, size_t len) {
+    // Notifications only wake us up, the queue table has the details
+    return 0;
+}
+
+static const PQcommMethods mock_comm_methods = {
+    NULL, NULL, NULL, NULL, mock_comm_putmessage, NULL,
+};
+
+static void
+on_notification_received() {
+    const PQcommMethods *old_methods = PqCommMethods;
+    PqCommMethods = &mock_comm_methods;
+    whereToSendOutput = DestRemote;
+    ProcessNotifyInterrupt(false);
+    whereToSendOutput = DestNone;
+    PqCommMethods = old_methods;
+}
+
+static void
+on_sigusr1(SIGNAL_ARGS) {
+    procsignal_sigusr1_handler(postgres_signal_arg);
+    SetLatch(MyLatch);
+}
+
+PGDLLEXPORT void
+rustica_compile_worker(Datum arg) {
+    int64 id;
+    bool tiered;
+
+    // die() makes the next CHECK_FOR_INTERRUPTS() exit, also in the middle of
+    // a compile, so that a fast shutdown does not wait for LLVM
+    pqsignal(SIGTERM, die);
+    pqsignal(SIGUSR1, on_sigusr1);
+    BackgroundWorkerUnblockSignals();
+
+    if (rst_database == NULL)
+        ereport(FATAL, errmsg("rustica.database is never configured"));
+    BackgroundWorkerInitializeConnection(rst_database, NULL, 0);
+
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    Async_Listen("rustica_compile_queue");
+    CommitTransactionCommand();
+    ereport(LOG,
+            errmsg("rustica compile worker %d started", DatumGetInt32(arg)));
+
+    for (;;) {
+        CHECK_FOR_INTERRUPTS();
+        if (notifyInterruptPending)
+            on_notification_received();
+        while ((id = claim_job(&tiered)) != 0) {
+            run_job(id, tiered);
+            CHECK_FOR_INTERRUPTS();
+            sweep_xip_files();
+        }
+
+        (void)WaitLatch(MyLatch,
+                        WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                        COMPILE_POLL_MS,
+                        PG_WAIT_EXTENSION);
+        ResetLatch(MyLatch);
+        CHECK_FOR_INTERRUPTS();
+    }
+}
@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2026-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#ifndef RUSTICA_COMPILE_WORKER_H
+#define RUSTICA_COMPILE_WORKER_H
+
+#include "postgres.h"
+#include "postmaster/bgworker.h"
+
+BackgroundWorkerHandle *
+rst_compile_worker_register(int id);
+
+#endif /* RUSTICA_COMPILE_WORKER_H */
@@ -14,19 +14,30 @@
  * See the Mulan PSL v2 for more details.
  */
 
+#include <unistd.h>
+
 #include "postgres.h"
 #include "funcapi.h"
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "common/cryptohash.h"
+#include "common/sha2.h"
+#include "executor/spi.h"
 #include "nodes/nodeFuncs.h"
 #include "parser/parser.h"
 #include "tcop/tcopprot.h"
 #include "tcop/pquery.h"
 #include "utils/array.h"
+#include "utils/builtins.h"
 #include "utils/lsyscache.h"
+#include "utils/memutils.h"
 #include "utils/typcache.h"
 #include "varatt.h"
 
 #include "wasm_runtime_common.h"
 #include "aot_export.h"
+#include "llvm-c/TargetMachine.h"
+#include "version.h"
 
 #if WASM_ENABLE_DEBUG_AOT != 0
 #include "storage/fd.h"
@@ -35,6 +46,8 @@
 
 #include "rustica/compiler.h"
 #include "rustica/datatypes.h"
+#include "rustica/gucs.h"
+#include "rustica/pgo.h"
 #include "rustica/utils.h"
 #include "rustica/wamr.h"
 
@@ -65,7 +78,9 @@ compile_aot(
 #if WASM_ENABLE_DEBUG_AOT != 0
     bytea *wasm,
 #endif
-    wasm_module_t module);
+    wasm_module_t module,
+    char *target_cpu,
+    char *cpu_features);
 
 static void
 run_and_compile(wasm_module_t module,
@@ -113,22 +128,232 @@ validate_moonbit_array(wasm_ref_type_t ref_type,
 static List *
 describe_query_results(char *sql, Oid *argtypes, int nargs);
 
+static char *host_cpu = NULL;
+static char *host_features = NULL;
+
+// The profile a compile_wasm() call is guided by, if any
+static char *profile_file = NULL;
+static char *profile_digest = NULL;
+
+static void
+detect_host() {
+    char *str;
+
+    if (host_cpu != NULL)
+        return;
+    str = LLVMGetHostCPUName();
+    host_cpu = MemoryContextStrdup(TopMemoryContext, str);
+    LLVMDisposeMessage(str);
+    str = LLVMGetHostCPUFeatures();
+    host_features = MemoryContextStrdup(TopMemoryContext, str);
+    LLVMDisposeMessage(str);
+}
+
+// Whether code generated for the CPU and features (as stored with a module)
+// can run here. Features are checked one by one; a CPU without features can
+// only be trusted if it is the CPU we are running on.
+bool
+rst_compile_target_supported(const char *cpu, const char *features) {
+    if (cpu == NULL && features == NULL)
+        return true;
+    detect_host();
+    if (features == NULL || features[0] == '\0')
+        return cpu == NULL || strcmp(cpu, host_cpu) == 0;
+    for (const char *p = features; *p;) {
+        const char *end = strchr(p, ',');
+        int len = end ? (int)(end - p) : (int)strlen(p);
+        if (len > 1 && p[0] == '+') {
+            const char *h = host_features;
+            bool found = false;
+            while (h && *h) {
+                const char *hend = strchr(h, ',');
+                int hlen = hend ? (int)(hend - h) : (int)strlen(h);
+                if (hlen == len && strncmp(h, p, len) == 0) {
+                    found = true;
+                    break;
+                }
+                h = hend ? hend + 1 : NULL;
+            }
+            if (!found)
+                return false;
+        }
+        if (!end)
+            break;
+        p = end + 1;
+    }
+    return true;
+}
+
+// Resolve rustica.compile_target_cpu and rustica.compile_cpu_features into
+// what LLVM takes; NULL for both means the generic x86-64 baseline.
+static void
+resolve_target(char **cpu, char **features) {
+    *cpu = NULL;
+    *features = NULL;
+    if (rst_compile_target_cpu == NULL || rst_compile_target_cpu[0] == '\0')
+        return;
+    if (strcmp(rst_compile_target_cpu, "native") == 0) {
+        detect_host();
+        *cpu = pstrdup(host_cpu);
+        *features = pstrdup(host_features);
+    }
+    else {
+        *cpu = pstrdup(rst_compile_target_cpu);
+    }
+    if (rst_compile_cpu_features != NULL && rst_compile_cpu_features[0])
+        *features = pstrdup(rst_compile_cpu_features);
+}
+
+// Linear memory accesses are not checked by the code by default: the runtime
+// is built with hardware bound checks, reserving 8GB of address space with
+// guard pages per memory and trapping out-of-bounds accesses on SIGSEGV.
+// rustica.software_bounds_checks emits explicit checks instead. Native stack
+// checks follow the same choice (stack_bounds_checks = 2).
+static void
+init_options(AOTCompOption *option, char *target_cpu, char *cpu_features) {
+    AOTCompOption defaults = { .opt_level = 3,
+                               .size_level = 3,
+                               .output_format = AOT_FORMAT_FILE,
+                               .bounds_checks =
+                                   rst_software_bounds_checks ? 1 : 0,
+                               .stack_bounds_checks = 2,
+                               .enable_simd = true,
+                               .enable_bulk_memory = true,
+                               .enable_aux_stack_frame = true,
+                               .enable_gc = true,
+                               .target_arch = "x86_64",
+                               .target_cpu = target_cpu,
+                               .cpu_features = cpu_features,
+                               // XIP, as in wamrc --xip
+                               .is_indirect_mode = rst_xip,
+                               .disable_llvm_intrinsics = rst_xip,
+                               // as in wamrc --enable-llvm-pgo/--use-prof-file
+                               .enable_llvm_pgo =
+                                   rst_pgo_instrument && !profile_file,
+                               .use_prof_file = profile_file };
+    *option = defaults;
+}
+
+// Everything that makes a difference to the AOT binaries compile_wasm() emits
+// for the target, to key rustica.aot_cache with.
+static void
+describe_options(StringInfo buf, char *target_cpu, char *cpu_features) {
+    AOTCompOption option;
+
+    init_options(&option, target_cpu, cpu_features);
+    appendStringInfo(buf,
+                     "wamr=%d.%d.%d debug=%d opt=%u size=%u bounds=%u "
+                     "stack_bounds=%u simd=%d bulk=%d frame=%d gc=%d xip=%d "
+                     "pgo=%d profile=%s arch=%s cpu=%s features=%s\n",
+                     WAMR_VERSION_MAJOR,
+                     WAMR_VERSION_MINOR,
+                     WAMR_VERSION_PATCH,
+                     WASM_ENABLE_DEBUG_AOT,
+                     option.opt_level,
+                     option.size_level,
+                     option.bounds_checks,
+                     option.stack_bounds_checks,
+                     option.enable_simd,
+                     option.enable_bulk_memory,
+                     option.enable_aux_stack_frame,
+                     option.enable_gc,
+                     option.is_indirect_mode,
+                     option.enable_llvm_pgo,
+                     profile_digest ? profile_digest : "",
+                     option.target_arch,
+                     target_cpu ? target_cpu : "",
+                     cpu_features ? cpu_features : "");
+}
+
+static bytea *
+sha256(const char *data, int len) {
+    bytea *rv = (bytea *)palloc(PG_SHA256_DIGEST_LENGTH + VARHDRSZ);
+    pg_cryptohash_ctx *ctx = pg_cryptohash_create(PG_SHA256);
+
+    SET_VARSIZE(rv, PG_SHA256_DIGEST_LENGTH + VARHDRSZ);
+    if (pg_cryptohash_init(ctx) < 0
+        || pg_cryptohash_update(ctx, (const uint8 *)data, len) < 0
+        || pg_cryptohash_final(ctx,
+                               (uint8 *)VARDATA(rv),
+                               PG_SHA256_DIGEST_LENGTH)
+               < 0)
+        ereport(ERROR,
+                errmsg("could not compute %s hash: %s",
+                       "SHA256",
+                       pg_cryptohash_error(ctx)));
+    pg_cryptohash_free(ctx);
+    return rv;
+}
+
+// Look up the AOT binaries of an identical compile. On a hit, bin_code and
+// generic_bin_code (if the entry has one) are set in the caller's context.
+static bool
+aot_cache_lookup(Datum *key, Datum *bin_code, Datum *generic_bin_code) {
+    bool found = false, isnull;
+
+    SPI_connect();
+    SPI_execute_with_args("SELECT bin_code, generic_bin_code "
+                          "FROM rustica.aot_cache "
+                          "WHERE wasm_sha256 = $1 AND options_hash = $2",
+                          2,
+                          (Oid[2]){ BYTEAOID, BYTEAOID },
+                          key,
+                          NULL,
+                          true,
+                          1);
+    if (SPI_processed > 0) {
+        HeapTuple tup = SPI_tuptable->vals[0];
+        TupleDesc desc = SPI_tuptable->tupdesc;
+        *bin_code = SPI_datumTransfer(SPI_getbinval(tup, desc, 1, &isnull),
+                                      false,
+                                      -1);
+        Datum generic = SPI_getbinval(tup, desc, 2, &isnull);
+        if (!isnull)
+            *generic_bin_code = SPI_datumTransfer(generic, false, -1);
+        found = true;
+    }
+    SPI_finish();
+    return found;
+}
+
+static void
+aot_cache_store(Datum *key, Datum bin_code, Datum generic_bin_code) {
+    Datum values[4] = { key[0], key[1], bin_code, generic_bin_code };
+    char nulls[4] = { ' ', ' ', ' ', generic_bin_code ? ' ' : 'n' };
+
+    // Compiling is fine on a standby or in a read-only transaction, caching
+    // is not
+    if (RecoveryInProgress() || XactReadOnly)
+        return;
+    SPI_connect();
+    SPI_execute_with_args("INSERT INTO rustica.aot_cache "
+                          "    (wasm_sha256, options_hash, bin_code, "
+                          "     generic_bin_code) "
+                          "VALUES ($1, $2, $3, $4) "
+                          "ON CONFLICT DO NOTHING",
+                          4,
+                          (Oid[4]){ BYTEAOID, BYTEAOID, BYTEAOID, BYTEAOID },
+                          values,
+                          nulls,
+                          false,
+                          0);
+    SPI_finish();
+}
+
 static Datum
 compile_aot(
 #if WASM_ENABLE_DEBUG_AOT != 0
     bytea *wasm,
 #endif
-    wasm_module_t module) {
-    AOTCompOption option = { .opt_level = 3,
-                             .size_level = 3,
-                             .output_format = AOT_FORMAT_FILE,
-                             .bounds_checks = 2,
-                             .stack_bounds_checks = 2,
-                             .enable_simd = true,
-                             .enable_bulk_memory = true,
-                             .enable_aux_stack_frame = true,
-                             .enable_gc = true,
-                             .target_arch = "x86_64" };
+    wasm_module_t module,
+    char *target_cpu,
+    char *cpu_features) {
+    // WAMR only compiles on several threads in JIT mode (LLJIT), the AOT path
+    // emits the whole module from one LLVM context on this thread. The WAMR
+    // allocator is palloc() too, so compile in parallel across modules with
+    // rustica.compile_workers rather than inside one module.
+    AOTCompOption option;
+    init_options(&option, target_cpu, cpu_features);
     aot_comp_data_t comp_data =
         aot_create_comp_data(module, option.target_arch, option.enable_gc);
     if (!comp_data)
@@ -184,11 +409,19 @@ compile_aot(
         ereport(ERROR,
                 errmsg("Failed to emit aot file: %s", aot_get_last_error()));
     aot_obj_data_destroy(obj_data);
+    aot_destroy_comp_context(comp_ctx);
+    aot_destroy_comp_data(comp_data);
     PG_RETURN_POINTER(rv);
 }
 
+// Without aot, only the heap types and queries are compiled and bin_code is
+// NULL, for modules served by the interpreter until their AOT build is ready.
+// compile_wasm() takes an optional indexed LLVM profile as the 3rd argument.
 Datum
-rst_compile(PG_FUNCTION_ARGS) {
+rst_compile(FunctionCallInfo fcinfo, bool aot) {
+    if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+        PG_RETURN_NULL();
+
     // Load the input WASM module
     DECLARE_ERROR_BUF(128);
     bytea *wasm = PG_GETARG_BYTEA_P(0);
@@ -219,7 +452,11 @@ rst_compile(PG_FUNCTION_ARGS) {
     }
 
     TupleDesc rv_tupdesc;
-    Datum rv[3] = { 0 };
+    Datum rv[6] = { 0 };
+    bool isnull[6] = { 0 };
+    char *target_cpu = NULL, *cpu_features = NULL;
+    Datum cache_key[2];
+    bool cached = false;
     wasm_module_t module = NULL;
 
     // The backdoor API may create nested WAMR runtime, so stash the parent env
@@ -240,7 +477,7 @@ rst_compile(PG_FUNCTION_ARGS) {
 #endif
             get_call_result_type(fcinfo, NULL, &rv_tupdesc);
         Assert(rv_cls == TYPEFUNC_COMPOSITE);
-        Assert(rv_tupdesc->natts == 3);
+        Assert(rv_tupdesc->natts == 6);
         Assert(TupleDescAttr(rv_tupdesc, 0)->atttypid == BYTEAOID);
         Assert(get_element_type(TupleDescAttr(rv_tupdesc, 1)->atttypid)
                == INT4OID);
@@ -248,13 +485,65 @@ rst_compile(PG_FUNCTION_ARGS) {
             get_element_type(TupleDescAttr(rv_tupdesc, 2)->atttypid);
         Assert(query_oid != InvalidOid);
 
-        // Compile AOT binary and query plans
-        rv[0] = compile_aot(
+        // LLVM reads the profile from a file
+        if (aot && PG_NARGS() > 2 && !PG_ARGISNULL(2)) {
+            bytea *profile = PG_GETARG_BYTEA_PP(2);
+            bytea *digest = sha256(VARDATA_ANY(profile),
+                                   VARSIZE_ANY_EXHDR(profile));
+            profile_digest = palloc(PG_SHA256_DIGEST_LENGTH * 2 + 1);
+            profile_digest[hex_encode(VARDATA(digest),
+                                      PG_SHA256_DIGEST_LENGTH,
+                                      profile_digest)] = '\0';
+            profile_file =
+                rst_pgo_write_temp_file("compile.profdata",
+                                        VARDATA_ANY(profile),
+                                        VARSIZE_ANY_EXHDR(profile));
+        }
+#if WASM_ENABLE_AOT_PGO == 0
+        else if (aot && rst_pgo_instrument)
+            ereport(ERROR,
+                    errmsg("rustica.pgo_instrument requires a build with "
+                           "AOT_PGO=1"));
+#endif
+
+        // Compile AOT binary and query plans. Code tuned for a CPU comes with
+        // a generic build, for workers on hosts without those features. The
+        // AOT binaries of an identical compile are reused from the cache;
+        // the queries are cheap and depend on the database, so they are
+        // always compiled again.
+        if (aot)
+            resolve_target(&target_cpu, &cpu_features);
+        if (aot && rst_aot_cache) {
+            StringInfoData options;
+            initStringInfo(&options);
+            describe_options(&options, target_cpu, cpu_features);
+            if (target_cpu != NULL || cpu_features != NULL)
+                describe_options(&options, NULL, NULL);
+            cache_key[0] =
+                PointerGetDatum(sha256(VARDATA_ANY(wasm), wasm_size));
+            cache_key[1] = PointerGetDatum(sha256(options.data, options.len));
+            pfree(options.data);
+            cached = aot_cache_lookup(cache_key, &rv[0], &rv[5]);
+        }
+        if (aot && !cached)
+            rv[0] = compile_aot(
 #if WASM_ENABLE_DEBUG_AOT != 0
-            wasm,
+                wasm,
 #endif
-            module);
+                module,
+                target_cpu,
+                cpu_features);
         run_and_compile(module, query_oid, &rv[1], &rv[2]);
+        if (aot && !cached && (target_cpu != NULL || cpu_features != NULL))
+            rv[5] = compile_aot(
+#if WASM_ENABLE_DEBUG_AOT != 0
+                wasm,
+#endif
+                module,
+                NULL,
+                NULL);
+        if (aot && rst_aot_cache && !cached)
+            aot_cache_store(cache_key, rv[0], rv[5]);
     }
     PG_FINALLY();
     {
@@ -263,14 +552,25 @@ rst_compile(PG_FUNCTION_ARGS) {
         pfree(tid_map);
         tid_map = NULL;
         tid_map_len = 0;
+        if (profile_file != NULL)
+            unlink(profile_file);
+        profile_file = NULL;
+        profile_digest = NULL;
         wasm_runtime_set_exec_env_tls(prev_exec_env);
     }
     PG_END_TRY();
 
-    bool isnull[3] = { 0 };
     // If no queries are found, mark the 3rd field (queries) as NULL
+    isnull[0] = !rv[0];
     if (!rv[2])
         isnull[2] = 1;
+    isnull[3] = target_cpu == NULL;
+    if (target_cpu)
+        rv[3] = CStringGetTextDatum(target_cpu);
+    isnull[4] = cpu_features == NULL;
+    if (cpu_features)
+        rv[4] = CStringGetTextDatum(cpu_features);
+    isnull[5] = !rv[5];
     PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(rv_tupdesc, rv, isnull)));
 }
 
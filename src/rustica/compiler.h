@@ -20,6 +20,10 @@
 #include "postgres.h"
 #include "fmgr.h"
 
-Datum rst_compile(PG_FUNCTION_ARGS);
+Datum
+rst_compile(FunctionCallInfo fcinfo, bool aot);
+
+bool
+rst_compile_target_supported(const char *cpu, const char *features);
 
 #endif /* RUSTICA_COMPILER_H */
@@ -23,6 +23,34 @@ char *rst_listen_addresses = NULL;
 int rst_port = 8080;
 int rst_worker_idle_timeout = 60;
 char *rst_database = NULL;
+bool rst_singleflight = false;
+int rst_singleflight_slots = 64;
+int rst_singleflight_max_response = 64;
+int rst_singleflight_timeout = 1000;
+int rst_max_requests_per_connection = 1;
+int rst_keepalive_timeout = 5000;
+char *rst_hub_channels = NULL;
+int rst_hub_max_subscribers = 10000;
+bool rst_static_cache = false;
+int rst_response_cache_slots = 0;
+int rst_response_cache_max_response = 64;
+int rst_client_check_interval = 1000;
+int rst_request_timeout = 0;
+int rst_abort_grace_period = 5000;
+int rst_worker_max_connections = 1;
+bool rst_io_uring = false;
+int rst_compile_workers = 1;
+char *rst_compile_target_cpu = NULL;
+char *rst_compile_cpu_features = NULL;
+bool rst_aot_cache = true;
+bool rst_software_bounds_checks = false;
+bool rst_xip = false;
+bool rst_pgo_instrument = false;
+int rst_pgo_flush_requests = 1000;
+char *rst_llvm_profdata = NULL;
+bool rst_perf_map = false;
+int rst_stat_max_modules = 100;
+int rst_stat_max_queries = 5000;
 
 void
 rst_init_gucs() {
@@ -71,4 +99,362 @@ rst_init_gucs() {
                                NULL,
                                NULL,
                                NULL);
+    DefineCustomBoolVariable("rustica.singleflight",
+                             "Coalesces identical concurrent GET requests.",
+                             "Default is off. Its shared memory is only "
+                             "reserved when it is on at server start.",
+                             &rst_singleflight,
+                             false,
+                             PGC_USERSET,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+    DefineCustomIntVariable(
+        "rustica.singleflight_slots",
+        "Sets the maximum number of distinct requests coalesced at once.",
+        "Default is 64; further requests run by themselves.",
+        &rst_singleflight_slots,
+        64,
+        1,
+        INT_MAX / 2,
+        PGC_POSTMASTER,
+        0,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomIntVariable(
+        "rustica.singleflight_max_response",
+        "Sets the maximum response size that can be shared by singleflight.",
+        "Default is 64kB; larger responses are not shared.",
+        &rst_singleflight_max_response,
+        64,
+        1,
+        1024 * 1024,
+        PGC_POSTMASTER,
+        GUC_UNIT_KB,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomIntVariable(
+        "rustica.singleflight_timeout",
+        "Sets how long a request waits for an identical one in flight.",
+        "Default is 1s; the request runs by itself after that. The worker "
+        "serves none of its other connections while waiting.",
+        &rst_singleflight_timeout,
+        1000,
+        0,
+        INT_MAX,
+        PGC_USERSET,
+        GUC_UNIT_MS,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomIntVariable(
+        "rustica.max_requests_per_connection",
+        "Sets the maximum number of requests served on one connection.",
+        "Default is 1, which closes the connection after each response.",
+        &rst_max_requests_per_connection,
+        1,
+        1,
+        INT_MAX,
+        PGC_USERSET,
+        0,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomIntVariable(
+        "rustica.keepalive_timeout",
+        "Sets how long an idle keep-alive connection is kept open.",
+        "Default is 5s.",
+        &rst_keepalive_timeout,
+        5000,
+        0,
+        INT_MAX,
+        PGC_USERSET,
+        GUC_UNIT_MS,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomStringVariable(
+        "rustica.hub_channels",
+        "Sets the NOTIFY channels fanned out to server-sent event streams.",
+        "Default is empty, which disables the hub process.",
+        &rst_hub_channels,
+        "",
+        PGC_USERSET,
+        0,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomIntVariable(
+        "rustica.hub_max_subscribers",
+        "Sets the maximum number of connections held by the hub process.",
+        "Default is 10000.",
+        &rst_hub_max_subscribers,
+        10000,
+        1,
+        1000000,
+        PGC_USERSET,
+        0,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomBoolVariable(
+        "rustica.static_cache",
+        "Sets whether rustica.static_assets are served without the guest.",
+        "Default is off. The master answers them on accept when it can, "
+        "workers otherwise.",
+        &rst_static_cache,
+        false,
+        PGC_USERSET,
+        0,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomIntVariable(
+        "rustica.response_cache_slots",
+        "Sets the number of responses kept in the shared response cache.",
+        "Default is 0, which disables the response cache.",
+        &rst_response_cache_slots,
+        0,
+        0,
+        1024 * 1024,
+        PGC_POSTMASTER,
+        0,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomIntVariable(
+        "rustica.response_cache_max_response",
+        "Sets the maximum size of a response in the shared response cache.",
+        "Default is 64kB; larger responses are not cached.",
+        &rst_response_cache_max_response,
+        64,
+        1,
+        1024 * 1024,
+        PGC_POSTMASTER,
+        GUC_UNIT_KB,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomIntVariable(
+        "rustica.client_check_interval",
+        "Sets how often a running request checks if its client went away.",
+        "Default is 1s; 0 disables the check.",
+        &rst_client_check_interval,
+        1000,
+        0,
+        INT_MAX,
+        PGC_USERSET,
+        GUC_UNIT_MS,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomIntVariable(
+        "rustica.request_timeout",
+        "Sets the maximum time a request may run, including its SQL.",
+        "Default is 0, which means no limit. rustica.modules.request_timeout "
+        "overrides it per module.",
+        &rst_request_timeout,
+        0,
+        0,
+        INT_MAX,
+        PGC_USERSET,
+        GUC_UNIT_MS,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomIntVariable(
+        "rustica.worker_max_connections",
+        "Sets the maximum number of connections a worker holds at once.",
+        "Default is 1. Requests are only run once they have arrived, so more "
+        "connections let a worker wait for slow clients in parallel.",
+        &rst_worker_max_connections,
+        1,
+        1,
+        1024,
+        PGC_USERSET,
+        0,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomBoolVariable(
+        "rustica.io_uring",
+        "Sets whether the master accepts and dispatches with io_uring.",
+        "Default is off. Needs a build with IO_URING=1; falls back to epoll "
+        "if the kernel does not support it.",
+        &rst_io_uring,
+        false,
+        PGC_POSTMASTER,
+        0,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomIntVariable(
+        "rustica.compile_workers",
+        "Sets the number of workers compiling modules from "
+        "rustica.compile_queue.",
+        "Default is 1; 0 disables the compile queue.",
+        &rst_compile_workers,
+        1,
+        0,
+        64,
+        PGC_POSTMASTER,
+        0,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomStringVariable(
+        "rustica.compile_target_cpu",
+        "Sets the CPU that compiled modules are tuned for.",
+        "Default is empty for the generic x86-64 baseline; 'native' is the "
+        "CPU of this server. Tuned modules also carry a generic build.",
+        &rst_compile_target_cpu,
+        "",
+        PGC_USERSET,
+        0,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomStringVariable(
+        "rustica.compile_cpu_features",
+        "Sets the CPU features that compiled modules may use.",
+        "Default is empty for the features of rustica.compile_target_cpu. "
+        "Uses the LLVM syntax, like '+avx2,+bmi2'.",
+        &rst_compile_cpu_features,
+        "",
+        PGC_USERSET,
+        0,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomBoolVariable(
+        "rustica.aot_cache",
+        "Sets whether compile_wasm() reuses AOT binaries from "
+        "rustica.aot_cache.",
+        "Default is on. Entries are keyed by the SHA-256 of the WASM module "
+        "and of the compile options.",
+        &rst_aot_cache,
+        true,
+        PGC_USERSET,
+        0,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomBoolVariable(
+        "rustica.software_bounds_checks",
+        "Sets whether compiled modules check memory accesses in code.",
+        "Default is off, which relies on guard pages and the hardware to trap "
+        "out-of-bounds accesses.",
+        &rst_software_bounds_checks,
+        false,
+        PGC_USERSET,
+        0,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomBoolVariable(
+        "rustica.xip",
+        "Sets whether modules are compiled for execute-in-place.",
+        "Default is off. XIP binaries need no relocation and are mapped from "
+        "files shared by all workers.",
+        &rst_xip,
+        false,
+        PGC_USERSET,
+        0,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomBoolVariable(
+        "rustica.pgo_instrument",
+        "Sets whether modules are compiled with profile counters.",
+        "Default is off. Workers save the counters of such modules to "
+        "rustica.aot_profiles for rustica.recompile_with_profile().",
+        &rst_pgo_instrument,
+        false,
+        PGC_USERSET,
+        0,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomIntVariable(
+        "rustica.pgo_flush_requests",
+        "Sets how many requests a worker serves between saving profile "
+        "counters.",
+        "Default is 1000.",
+        &rst_pgo_flush_requests,
+        1000,
+        1,
+        INT_MAX,
+        PGC_USERSET,
+        0,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomStringVariable(
+        "rustica.llvm_profdata",
+        "Sets the llvm-profdata command that merges profiles.",
+        "Default is 'llvm-profdata', found in PATH.",
+        &rst_llvm_profdata,
+        "llvm-profdata",
+        PGC_SUSET,
+        0,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomBoolVariable(
+        "rustica.perf_map",
+        "Sets whether workers write /tmp/perf-<pid>.map for loaded modules.",
+        "Default is off. perf then names the guest functions of AoT code, "
+        "using the name section of the module.",
+        &rst_perf_map,
+        false,
+        PGC_USERSET,
+        0,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomIntVariable(
+        "rustica.stat_max_modules",
+        "Sets the maximum number of modules timed in rustica.stat_phases.",
+        "Default is 100. 0 disables the timing.",
+        &rst_stat_max_modules,
+        100,
+        0,
+        INT_MAX / 16,
+        PGC_POSTMASTER,
+        0,
+        NULL,
+        NULL,
+        NULL);
+
+    DefineCustomIntVariable(
+        "rustica.stat_max_queries",
+        "Sets the maximum number of queries tracked in rustica.stat_queries.",
+        "Default is 5000. 0 disables the tracking.",
+        &rst_stat_max_queries,
+        5000,
+        0,
+        INT_MAX / 2,
+        PGC_POSTMASTER,
+        0,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomIntVariable(
+        "rustica.abort_grace_period",
+        "Sets how long an aborted request may keep running before its worker "
+        "exits.",
+        "Default is 5s; 0 never ends the worker. A guest spinning without "
+        "host calls only stops this way.",
+        &rst_abort_grace_period,
+        5000,
+        0,
+        INT_MAX,
+        PGC_USERSET,
+        GUC_UNIT_MS,
+        NULL,
+        NULL,
+        NULL);
 }
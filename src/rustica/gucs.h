@@ -21,6 +21,34 @@ extern char *rst_listen_addresses;
 extern int rst_port;
 extern int rst_worker_idle_timeout;
 extern char *rst_database;
+extern bool rst_singleflight;
+extern int rst_singleflight_slots;
+extern int rst_singleflight_max_response;
+extern int rst_singleflight_timeout;
+extern int rst_max_requests_per_connection;
+extern int rst_keepalive_timeout;
+extern char *rst_hub_channels;
+extern int rst_hub_max_subscribers;
+extern bool rst_static_cache;
+extern int rst_response_cache_slots;
+extern int rst_response_cache_max_response;
+extern int rst_client_check_interval;
+extern int rst_request_timeout;
+extern int rst_abort_grace_period;
+extern int rst_worker_max_connections;
+extern bool rst_io_uring;
+extern int rst_compile_workers;
+extern char *rst_compile_target_cpu;
+extern char *rst_compile_cpu_features;
+extern bool rst_aot_cache;
+extern bool rst_software_bounds_checks;
+extern bool rst_xip;
+extern bool rst_pgo_instrument;
+extern int rst_pgo_flush_requests;
+extern char *rst_llvm_profdata;
+extern bool rst_perf_map;
+extern int rst_stat_max_modules;
+extern int rst_stat_max_queries;
 
 void
 rst_init_gucs();
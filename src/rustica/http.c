@@ -0,0 +1,701 @@
+/*
+ * Copyright (c) 2026-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "catalog/pg_type_d.h"
+
+#include "rustica/datatypes.h"
+#include "rustica/http.h"
+#include "rustica/io.h"
+#include "rustica/query.h"
+
+// Spans are returned to the guest as an i64 of (start << 32 | len)
+#define PACK_SPAN(span) (((int64_t)(span).start << 32) | (uint32_t)(span).len)
+
+void
+rst_http_head_reset(HttpRequestHead *head) {
+    head->last_kind = -1;
+    head->url.start = 0;
+    head->url.len = 0;
+    head->nheaders = 0;
+}
+
+const char *
+rst_http_head_data(HttpRequestHead *head) {
+    if (!head->buf_ref_pushed)
+        return NULL;
+    Datum bytes = wasm_externref_obj_get_datum(head->buf_ref.val, BYTEAOID);
+    return VARDATA_ANY(DatumGetPointer(bytes));
+}
+
+const char *
+rst_http_head_append(wasm_exec_env_t exec_env,
+                     HttpRequestHead *head,
+                     wasm_obj_t buf,
+                     int kind,
+                     const char *at,
+                     size_t length) {
+    // Pin the receive buffer until the instance is gone, because all spans are
+    // offsets into it.
+    if (!head->buf_ref_pushed) {
+        wasm_runtime_push_local_obj_ref(exec_env, &head->buf_ref);
+        head->buf_ref.val = buf;
+        head->buf_ref_pushed = true;
+    }
+    else if (head->buf_ref.val != buf) {
+        if (head->last_kind != -1)
+            return "request head must be received in one buffer";
+        head->buf_ref.val = buf;
+    }
+
+    HttpSpan *span;
+    switch (kind) {
+        case RST_HTTP_URL:
+            span = &head->url;
+            break;
+
+        case RST_HTTP_HEADER_FIELD:
+            if (head->last_kind != RST_HTTP_HEADER_FIELD) {
+                if (head->nheaders == RST_HTTP_MAX_HEADERS)
+                    return "too many request headers";
+                memset(&head->headers[head->nheaders], 0, sizeof(HttpHeader));
+                head->nheaders++;
+            }
+            span = &head->headers[head->nheaders - 1].name;
+            break;
+
+        case RST_HTTP_HEADER_VALUE:
+            Assert(head->nheaders > 0);
+            span = &head->headers[head->nheaders - 1].value;
+            break;
+
+        default:
+            pg_unreachable();
+    }
+
+    // llhttp may deliver one token in several pieces, which are contiguous as
+    // long as the guest keeps receiving into the same buffer.
+    int32_t start = (int32_t)(at - rst_http_head_data(head));
+    if (span->len == 0)
+        span->start = start;
+    else if (span->start + span->len != start)
+        return "request head must be received in one buffer";
+    span->len += (int32_t)length;
+    head->last_kind = kind;
+    return NULL;
+}
+
+void
+rst_http_head_end_header(HttpRequestHead *head) {
+    // Empty header values have no data callback, so mark the end explicitly
+    head->last_kind = RST_HTTP_HEADER_VALUE;
+}
+
+int
+rst_http_find_header(HttpRequestHead *head, const char *name, int len) {
+    const char *data = rst_http_head_data(head);
+    for (int i = 0; i < head->nheaders; i++) {
+        HttpSpan *span = &head->headers[i].name;
+        if (span->len == len
+            && pg_strncasecmp(data + span->start, name, len) == 0)
+            return i;
+    }
+    return -1;
+}
+
+typedef struct ContentEncoding {
+    const char *name;
+    int len;
+    int code;
+} ContentEncoding;
+
+// Supported encodings in order of preference when equally acceptable
+static const ContentEncoding encodings[] = {
+#ifdef USE_ZSTD
+    { "zstd", 4, RST_HTTP_ENCODING_ZSTD },
+#endif
+#ifdef HAVE_LIBZ
+    { "gzip", 4, RST_HTTP_ENCODING_GZIP },
+    { "deflate", 7, RST_HTTP_ENCODING_DEFLATE },
+#endif
+    { "identity", 8, RST_HTTP_ENCODING_IDENTITY },
+};
+
+// Parse a qvalue ("0", "0.5", "1.000") into thousandths
+static int
+parse_qvalue(const char *p, const char *end) {
+    int q, scale = 100;
+    if (p == end || (*p != '0' && *p != '1'))
+        return 0;
+    q = (*p++ - '0') * 1000;
+    if (p < end && *p == '.') {
+        for (p++; p < end && scale > 0 && *p >= '0' && *p <= '9'; p++) {
+            q += (*p - '0') * scale;
+            scale /= 10;
+        }
+    }
+    return Min(q, 1000);
+}
+
+// Choose the content encoding for an Accept-Encoding header value
+int
+rst_http_choose_encoding(const char *value, int len) {
+    const char *p = value, *end = value + len;
+    int q[lengthof(encodings)];
+    int q_any = -1;
+
+    for (int i = 0; i < lengthof(encodings); i++)
+        q[i] = -1;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        const char *token = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+            p++;
+        int token_len = (int)(p - token);
+        int qvalue = 1000;
+        while (p < end && *p != ',') {
+            if (*p++ != ';')
+                continue;
+            while (p < end && (*p == ' ' || *p == '\t'))
+                p++;
+            if (end - p >= 2 && (*p == 'q' || *p == 'Q') && p[1] == '=')
+                qvalue = parse_qvalue(p + 2, end);
+        }
+        if (token_len == 1 && *token == '*')
+            q_any = qvalue;
+        for (int i = 0; i < lengthof(encodings); i++)
+            if (token_len == encodings[i].len
+                && pg_strncasecmp(token, encodings[i].name, token_len) == 0)
+                q[i] = qvalue;
+    }
+
+    int best = RST_HTTP_ENCODING_IDENTITY, best_q = 0;
+    for (int i = 0; i < lengthof(encodings); i++) {
+        int qi = q[i] >= 0 ? q[i] : Max(q_any, 0);
+        if (qi > best_q) {
+            best = encodings[i].code;
+            best_q = qi;
+        }
+    }
+    return best;
+}
+
+// Iterate over the comma-separated directives of a header value, like
+// "public, max-age=60". arg is empty for directives without an argument.
+bool
+rst_http_next_directive(const char **p,
+                        const char *end,
+                        const char **name,
+                        int *name_len,
+                        const char **arg,
+                        int *arg_len) {
+    const char *s = *p;
+    while (s < end && (*s == ' ' || *s == '\t' || *s == ','))
+        s++;
+    if (s >= end)
+        return false;
+    const char *e = s;
+    while (e < end && *e != ',')
+        e++;
+    *p = e;
+    while (e > s && (e[-1] == ' ' || e[-1] == '\t'))
+        e--;
+    const char *eq = memchr(s, '=', e - s);
+    *name = s;
+    *name_len = (int)((eq ? eq : e) - s);
+    while (*name_len > 0
+           && (s[*name_len - 1] == ' ' || s[*name_len - 1] == '\t'))
+        (*name_len)--;
+    *arg = eq ? eq + 1 : e;
+    *arg_len = (int)(e - *arg);
+    return true;
+}
+
+bool
+rst_http_has_directive(const char *value, int len, const char *directive) {
+    const char *p = value, *name, *arg;
+    int name_len, arg_len;
+    while (rst_http_next_directive(&p,
+                                   value + len,
+                                   &name,
+                                   &name_len,
+                                   &arg,
+                                   &arg_len))
+        if (name_len == (int)strlen(directive)
+            && pg_strncasecmp(name, directive, name_len) == 0)
+            return true;
+    return false;
+}
+
+#define NAME_IS(name, len, lit) \
+    ((len) == sizeof(lit) - 1 && pg_strncasecmp(name, lit, len) == 0)
+
+// Take in one line of the response head, without its line break
+static void
+scan_sent_line(HttpSentHead *sent) {
+    const char *line = sent->line, *colon, *value, *end;
+    int len = sent->line_len;
+
+    if (len > 0 && line[len - 1] == '\r')
+        len--;
+
+    // The status line
+    if (sent->status == 0) {
+        if (len < 12 || memcmp(line, "HTTP/1.", 7) != 0 || line[8] != ' ') {
+            sent->close = true;
+            sent->complete = true;
+            return;
+        }
+        sent->status = atoi(line + 9);
+        return;
+    }
+
+    // The blank line ends the head, except for interim responses that are
+    // followed by another one
+    if (len == 0) {
+        if (sent->status >= 100 && sent->status < 200 && sent->status != 101) {
+            sent->status = 0;
+            sent->framed = false;
+            sent->keep_alive = false;
+        }
+        else
+            sent->complete = true;
+        return;
+    }
+
+    colon = memchr(line, ':', len);
+    if (!colon)
+        return;
+    value = colon + 1;
+    end = line + len;
+    while (value < end && (*value == ' ' || *value == '\t'))
+        value++;
+    if (NAME_IS(line, colon - line, "Content-Length"))
+        sent->framed = true;
+    else if (NAME_IS(line, colon - line, "Transfer-Encoding"))
+        sent->framed =
+            rst_http_has_directive(value, (int)(end - value), "chunked");
+    else if (NAME_IS(line, colon - line, "Connection")) {
+        // Don't guess from a value that didn't fit
+        if (sent->line_truncated
+            || rst_http_has_directive(value, (int)(end - value), "close"))
+            sent->close = true;
+        else if (rst_http_has_directive(value,
+                                        (int)(end - value),
+                                        "keep-alive"))
+            sent->keep_alive = true;
+    }
+}
+
+// Follow the response head as it is sent to the client, whether it comes from
+// the resp_*() natives, env_send() or a shared response. Only the lines that
+// decide whether the connection can be reused are looked at, so long lines are
+// truncated instead of buffered.
+void
+rst_http_sent_scan(HttpSentHead *sent, const char *data, int len) {
+    for (int i = 0; i < len && !sent->complete; i++) {
+        if (data[i] == '\n') {
+            scan_sent_line(sent);
+            sent->line_len = 0;
+            sent->line_truncated = false;
+        }
+        else if (sent->line_len < (int)sizeof(sent->line))
+            sent->line[sent->line_len++] = data[i];
+        else
+            sent->line_truncated = true;
+    }
+}
+
+// Tell whether the client can find the end of the response without the
+// connection being closed, and expects the connection to stay open
+bool
+rst_http_sent_reusable(HttpSentHead *sent, bool head_request, bool http10) {
+    if (!sent->complete || sent->close || sent->status == 101)
+        return false;
+    if (!sent->framed && !head_request && sent->status != 204
+        && sent->status != 304)
+        return false;
+    return !http10 || sent->keep_alive;
+}
+
+static inline HttpRequestHead *
+get_request_head(wasm_exec_env_t exec_env) {
+    Context *ctx = (Context *)wasm_runtime_get_user_data(exec_env);
+    if (!ctx || !ctx->on_request)
+        ereport(ERROR, errmsg("request head is only available in on_request"));
+    return &ctx->request;
+}
+
+static inline HttpHeader *
+get_header(wasm_exec_env_t exec_env, int32_t idx) {
+    HttpRequestHead *head = get_request_head(exec_env);
+    if (idx < 0 || idx >= head->nheaders)
+        ereport(ERROR, errmsg("no such request header: #%d", idx));
+    return &head->headers[idx];
+}
+
+static int32_t
+req_header_count(wasm_exec_env_t exec_env) {
+    return get_request_head(exec_env)->nheaders;
+}
+
+static int64_t
+req_url(wasm_exec_env_t exec_env) {
+    return PACK_SPAN(get_request_head(exec_env)->url);
+}
+
+static int64_t
+req_header_name(wasm_exec_env_t exec_env, int32_t idx) {
+    return PACK_SPAN(get_header(exec_env, idx)->name);
+}
+
+static int64_t
+req_header_value(wasm_exec_env_t exec_env, int32_t idx) {
+    return PACK_SPAN(get_header(exec_env, idx)->value);
+}
+
+static int32_t
+req_find_header(wasm_exec_env_t exec_env,
+                wasm_obj_t name,
+                int32_t start,
+                int32_t len) {
+    HttpRequestHead *head = get_request_head(exec_env);
+    bytea *b = DatumGetByteaPP(wasm_externref_obj_get_datum(name, BYTEAOID));
+    if (start < 0 || len < 0 || start + len > VARSIZE_ANY_EXHDR(b))
+        ereport(ERROR, errmsg("req_find_header: index out of bound"));
+    return rst_http_find_header(head, VARDATA_ANY(b) + start, len);
+}
+
+static const char *
+reason_phrase(int status) {
+    switch (status) {
+        case 100:
+            return "Continue";
+        case 101:
+            return "Switching Protocols";
+        case 200:
+            return "OK";
+        case 201:
+            return "Created";
+        case 202:
+            return "Accepted";
+        case 204:
+            return "No Content";
+        case 206:
+            return "Partial Content";
+        case 301:
+            return "Moved Permanently";
+        case 302:
+            return "Found";
+        case 303:
+            return "See Other";
+        case 304:
+            return "Not Modified";
+        case 307:
+            return "Temporary Redirect";
+        case 308:
+            return "Permanent Redirect";
+        case 400:
+            return "Bad Request";
+        case 401:
+            return "Unauthorized";
+        case 403:
+            return "Forbidden";
+        case 404:
+            return "Not Found";
+        case 405:
+            return "Method Not Allowed";
+        case 409:
+            return "Conflict";
+        case 412:
+            return "Precondition Failed";
+        case 413:
+            return "Content Too Large";
+        case 415:
+            return "Unsupported Media Type";
+        case 422:
+            return "Unprocessable Content";
+        case 429:
+            return "Too Many Requests";
+        case 500:
+            return "Internal Server Error";
+        case 501:
+            return "Not Implemented";
+        case 502:
+            return "Bad Gateway";
+        case 503:
+            return "Service Unavailable";
+        case 504:
+            return "Gateway Timeout";
+    }
+    // The reason phrase is optional in HTTP/1.1
+    return "";
+}
+
+static inline HttpResponse *
+get_response(wasm_exec_env_t exec_env, bool started) {
+    Context *ctx = (Context *)wasm_runtime_get_user_data(exec_env);
+    if (!ctx)
+        ereport(ERROR, errmsg("no HTTP connection in this context"));
+    if (ctx->response.started != started)
+        ereport(ERROR,
+                errmsg(started ? "resp_status() must be called first"
+                               : "response already started"));
+    return &ctx->response;
+}
+
+static inline void
+check_header_token(const char *data, int len, bool is_name) {
+    if (is_name && len == 0)
+        ereport(ERROR, errmsg("resp_header: empty header name"));
+    for (int i = 0; i < len; i++) {
+        if (data[i] == '\r' || data[i] == '\n' || data[i] == '\0'
+            || (is_name && data[i] == ':'))
+            ereport(ERROR,
+                    errmsg("resp_header: invalid character in header %s",
+                           is_name ? "name" : "value"));
+    }
+}
+
+static int32_t
+resp_status(wasm_exec_env_t exec_env, int32_t status) {
+    HttpResponse *resp = get_response(exec_env, false);
+    if (status < 100 || status > 999)
+        ereport(ERROR, errmsg("resp_status: invalid status code %d", status));
+    if (resp->head.data == NULL)
+        initStringInfo(&resp->head);
+    else
+        resetStringInfo(&resp->head);
+    appendStringInfo(&resp->head,
+                     "HTTP/1.1 %d %s\r\n",
+                     status,
+                     reason_phrase(status));
+    resp->started = true;
+    resp->has_content_length = false;
+    resp->has_connection = false;
+    resp->status = status;
+    resp->body_len = 0;
+    resp->nparts = 0;
+    return 0;
+}
+
+static int32_t
+resp_header(wasm_exec_env_t exec_env, wasm_obj_t name, wasm_obj_t value) {
+    HttpResponse *resp = get_response(exec_env, true);
+    if (resp->streaming)
+        ereport(ERROR, errmsg("resp_header: response head already sent"));
+    text *n = DatumGetTextPP(wasm_externref_obj_get_datum(name, TEXTOID));
+    text *v = DatumGetTextPP(wasm_externref_obj_get_datum(value, TEXTOID));
+    int nlen = VARSIZE_ANY_EXHDR(n);
+    int vlen = VARSIZE_ANY_EXHDR(v);
+    check_header_token(VARDATA_ANY(n), nlen, true);
+    check_header_token(VARDATA_ANY(v), vlen, false);
+    if (nlen == 14 && pg_strncasecmp(VARDATA_ANY(n), "Content-Length", 14) == 0)
+        resp->has_content_length = true;
+    else if (nlen == 10
+             && pg_strncasecmp(VARDATA_ANY(n), "Connection", 10) == 0)
+        resp->has_connection = true;
+    appendBinaryStringInfo(&resp->head, VARDATA_ANY(n), nlen);
+    appendBinaryStringInfo(&resp->head, ": ", 2);
+    appendBinaryStringInfo(&resp->head, VARDATA_ANY(v), vlen);
+    appendBinaryStringInfo(&resp->head, "\r\n", 2);
+    return 0;
+}
+
+static int32_t
+resp_body(wasm_exec_env_t exec_env,
+          wasm_obj_t refobj,
+          int32_t start,
+          int32_t len) {
+    HttpResponse *resp = get_response(exec_env, true);
+    bytea *b = DatumGetByteaPP(wasm_externref_obj_get_datum(refobj, BYTEAOID));
+    if (start < 0 || len < 0 || start + len > VARSIZE_ANY_EXHDR(b))
+        ereport(ERROR, errmsg("resp_body: index out of bound"));
+    if (resp->streaming)
+        ereport(ERROR, errmsg("resp_body: use resp_chunk() after streaming"));
+    if (len == 0)
+        return 0;
+    if (resp->nparts == RST_HTTP_MAX_BODY_PARTS)
+        ereport(ERROR,
+                errmsg("resp_body: too many body parts, at most %d",
+                       RST_HTTP_MAX_BODY_PARTS));
+
+    // The bytes are written out only at resp_finish(), so keep the object
+    // alive until then. Pushed refs stay on the exec_env and are reused.
+    int i = resp->nparts++;
+    if (i == resp->nrefs_pushed) {
+        wasm_runtime_push_local_obj_ref(exec_env, &resp->part_refs[i]);
+        resp->nrefs_pushed++;
+    }
+    resp->part_refs[i].val = refobj;
+    resp->parts[i].iov_base = VARDATA_ANY(b) + start;
+    resp->parts[i].iov_len = len;
+    resp->body_len += len;
+    return 0;
+}
+
+// The response to a HEAD request has the head of the GET response only; any
+// body bytes would be read as the next response on the connection.
+static inline bool
+is_head_request(Context *ctx) {
+    return llhttp_get_method(&ctx->http_parser) == HTTP_HEAD;
+}
+
+static inline void
+reset_response(HttpResponse *resp) {
+    for (int i = 0; i < resp->nparts; i++)
+        resp->part_refs[i].val = NULL;
+    resp->nparts = 0;
+    resp->body_len = 0;
+    resp->started = false;
+    resp->streaming = false;
+}
+
+// Send the head now and stream the body with resp_chunk(), so that the size
+// needn't be known up front. HTTP/1.0 clients don't understand chunked
+// encoding; they get the raw body and the connection is closed at the end.
+static int32_t
+resp_begin_chunked(wasm_exec_env_t exec_env) {
+    Context *ctx = (Context *)wasm_runtime_get_user_data(exec_env);
+    HttpResponse *resp = get_response(exec_env, true);
+    if (resp->streaming)
+        ereport(ERROR, errmsg("resp_begin_chunked: already streaming"));
+    if (resp->nparts > 0 || resp->has_content_length)
+        ereport(ERROR,
+                errmsg("resp_begin_chunked: response has a fixed-size body"));
+
+    if (ctx->http_parser.http_major == 1 && ctx->http_parser.http_minor == 0) {
+        resp->close_delimited = true;
+        appendStringInfoString(&resp->head, "Connection: close\r\n\r\n");
+    }
+    else
+        appendStringInfoString(&resp->head,
+                               "Transfer-Encoding: chunked\r\n\r\n");
+    resp->streaming = true;
+    if (!rst_io_send_all(ctx, resp->head.data, resp->head.len))
+        return -1;
+    return 0;
+}
+
+static int32_t
+resp_chunk(wasm_exec_env_t exec_env,
+           wasm_obj_t refobj,
+           int32_t start,
+           int32_t len) {
+    Context *ctx = (Context *)wasm_runtime_get_user_data(exec_env);
+    HttpResponse *resp = get_response(exec_env, true);
+    bytea *b = DatumGetByteaPP(wasm_externref_obj_get_datum(refobj, BYTEAOID));
+    char size_line[16];
+    struct iovec iov[3];
+
+    if (!resp->streaming)
+        ereport(ERROR, errmsg("resp_chunk: resp_begin_chunked() not called"));
+    if (start < 0 || len < 0 || start + len > VARSIZE_ANY_EXHDR(b))
+        ereport(ERROR, errmsg("resp_chunk: index out of bound"));
+
+    // An empty chunk would terminate the body
+    if (len == 0 || is_head_request(ctx))
+        return 0;
+    if (resp->close_delimited) {
+        iov[0].iov_base = VARDATA_ANY(b) + start;
+        iov[0].iov_len = len;
+        return rst_io_writev_all(ctx, iov, 1) ? 0 : -1;
+    }
+
+    // Frame the chunk around the guest's bytes without copying them
+    iov[0].iov_base = size_line;
+    iov[0].iov_len = snprintf(size_line, sizeof(size_line), "%x\r\n", len);
+    iov[1].iov_base = VARDATA_ANY(b) + start;
+    iov[1].iov_len = len;
+    iov[2].iov_base = "\r\n";
+    iov[2].iov_len = 2;
+    resp->body_len += len;
+    return rst_io_writev_all(ctx, iov, 3) ? 0 : -1;
+}
+
+static int32_t
+resp_finish(wasm_exec_env_t exec_env) {
+    Context *ctx = (Context *)wasm_runtime_get_user_data(exec_env);
+    HttpResponse *resp = get_response(exec_env, true);
+    struct iovec iov[RST_HTTP_MAX_BODY_PARTS + 1];
+    bool ok;
+
+    if (resp->streaming) {
+        // Send the terminating chunk
+        ok = resp->close_delimited || is_head_request(ctx)
+             || rst_io_send_all(ctx, "0\r\n\r\n", 5);
+        reset_response(resp);
+        return ok ? 0 : -1;
+    }
+
+    // 1xx, 204 and 304 responses never carry a body
+    if (!resp->has_content_length && resp->status >= 200 && resp->status != 204
+        && resp->status != 304)
+        appendStringInfo(&resp->head,
+                         "Content-Length: " UINT64_FORMAT "\r\n",
+                         resp->body_len);
+
+    // An HTTP/1.0 client only keeps the connection open if told so
+    if (!resp->has_connection && ctx->keep_alive
+        && ctx->http_parser.http_major == 1 && ctx->http_parser.http_minor == 0
+        && llhttp_should_keep_alive(&ctx->http_parser))
+        appendStringInfoString(&resp->head, "Connection: keep-alive\r\n");
+    appendBinaryStringInfo(&resp->head, "\r\n", 2);
+
+    iov[0].iov_base = resp->head.data;
+    iov[0].iov_len = resp->head.len;
+    if (is_head_request(ctx))
+        ok = rst_io_writev_all(ctx, iov, 1);
+    else {
+        memcpy(&iov[1], resp->parts, sizeof(struct iovec) * resp->nparts);
+        ok = rst_io_writev_all(ctx, iov, resp->nparts + 1);
+    }
+    reset_response(resp);
+    return ok ? 0 : -1;
+}
+
+static int32_t
+req_accept_encoding(wasm_exec_env_t exec_env) {
+    HttpRequestHead *head = get_request_head(exec_env);
+    int idx = rst_http_find_header(head, "Accept-Encoding", 15);
+    if (idx < 0)
+        return RST_HTTP_ENCODING_IDENTITY;
+    HttpSpan *value = &head->headers[idx].value;
+    return rst_http_choose_encoding(rst_http_head_data(head) + value->start,
+                                    value->len);
+}
+
+static NativeSymbol http_symbols[] = {
+    { "req_header_count", req_header_count, "()i" },
+    { "req_url", req_url, "()I" },
+    { "req_header_name", req_header_name, "(i)I" },
+    { "req_header_value", req_header_value, "(i)I" },
+    { "req_find_header", req_find_header, "(rii)i" },
+    { "req_accept_encoding", req_accept_encoding, "()i" },
+    { "resp_status", resp_status, "(i)i" },
+    { "resp_header", resp_header, "(rr)i" },
+    { "resp_body", resp_body, "(rii)i" },
+    { "resp_begin_chunked", resp_begin_chunked, "()i" },
+    { "resp_chunk", resp_chunk, "(rii)i" },
+    { "resp_finish", resp_finish, "()i" },
+};
+
+void
+rst_register_natives_http() {
+    REGISTER_WASM_NATIVES("env", http_symbols);
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2026-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#ifndef RUSTICA_HTTP_H
+#define RUSTICA_HTTP_H
+
+#include <sys/uio.h>
+
+#include "postgres.h"
+#include "lib/stringinfo.h"
+
+#include "wasm_runtime_common.h"
+
+#define RST_HTTP_MAX_HEADERS 64
+#define RST_HTTP_MAX_BODY_PARTS 64
+
+#define RST_HTTP_ENCODING_IDENTITY 0
+#define RST_HTTP_ENCODING_GZIP 1
+#define RST_HTTP_ENCODING_DEFLATE 2
+#define RST_HTTP_ENCODING_ZSTD 3
+
+#define RST_HTTP_URL 0
+#define RST_HTTP_HEADER_FIELD 1
+#define RST_HTTP_HEADER_VALUE 2
+
+// Offset and length of a piece of the request head in the receive buffer
+typedef struct HttpSpan {
+    int32_t start;
+    int32_t len;
+} HttpSpan;
+
+typedef struct HttpHeader {
+    HttpSpan name;
+    HttpSpan value;
+} HttpHeader;
+
+// The request head parsed natively by the host, so that the guest receives it
+// in one on_request() call instead of one call per llhttp event.
+typedef struct HttpRequestHead {
+    wasm_local_obj_ref_t buf_ref; // keeps the receive buffer alive
+    bool buf_ref_pushed;
+    int last_kind;
+    HttpSpan url;
+    int nheaders;
+    HttpHeader headers[RST_HTTP_MAX_HEADERS];
+} HttpRequestHead;
+
+// The response assembled by the resp_*() natives. The status line and headers
+// are serialised into head, while body parts point into the guest's bytes and
+// are written out together with one writev(). Alternatively, the head is sent
+// by resp_begin_chunked() and the body streamed with resp_chunk().
+typedef struct HttpResponse {
+    bool started;
+    bool streaming;       // the head is sent, body follows in resp_chunk()
+    bool close_delimited; // streaming to an HTTP/1.0 client without chunking
+    bool has_content_length;
+    bool has_connection;
+    int status;
+    StringInfoData head;
+    uint64 body_len;
+    int nparts;
+    int nrefs_pushed;
+    struct iovec parts[RST_HTTP_MAX_BODY_PARTS];
+    wasm_local_obj_ref_t part_refs[RST_HTTP_MAX_BODY_PARTS];
+} HttpResponse;
+
+// What the client learns from the response head that was sent, to tell
+// whether the connection can be reused for another request
+typedef struct HttpSentHead {
+    bool complete;   // the blank line was sent, or the head is not HTTP/1.x
+    int status;      // of the final response, 0 before the status line
+    bool framed;     // Content-Length or chunked
+    bool close;      // Connection: close
+    bool keep_alive; // Connection: keep-alive
+    bool line_truncated;
+    int line_len;
+    char line[128];
+} HttpSentHead;
+
+void
+rst_http_head_reset(HttpRequestHead *head);
+
+const char *
+rst_http_head_append(wasm_exec_env_t exec_env,
+                     HttpRequestHead *head,
+                     wasm_obj_t buf,
+                     int kind,
+                     const char *at,
+                     size_t length);
+
+void
+rst_http_head_end_header(HttpRequestHead *head);
+
+int
+rst_http_find_header(HttpRequestHead *head, const char *name, int len);
+
+const char *
+rst_http_head_data(HttpRequestHead *head);
+
+int
+rst_http_choose_encoding(const char *value, int len);
+
+bool
+rst_http_next_directive(const char **p,
+                        const char *end,
+                        const char **name,
+                        int *name_len,
+                        const char **arg,
+                        int *arg_len);
+
+bool
+rst_http_has_directive(const char *value, int len, const char *directive);
+
+void
+rst_http_sent_scan(HttpSentHead *sent, const char *data, int len);
+
+bool
+rst_http_sent_reusable(HttpSentHead *sent, bool head_request, bool http10);
+
+void
+rst_register_natives_http();
+
+#endif /* RUSTICA_HTTP_H */
@@ -0,0 +1,605 @@
+/*
+ * Copyright (c) 2026-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "postgres.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "access/xact.h"
+#include "catalog/pg_type_d.h"
+#include "commands/async.h"
+#include "libpq/libpq.h"
+#include "libpq/pqformat.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "storage/procsignal.h"
+#include "tcop/tcopprot.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+#include "utils/varlena.h"
+
+#include "rustica/datatypes.h"
+#include "rustica/event_set.h"
+#include "rustica/gucs.h"
+#include "rustica/hub.h"
+#include "rustica/io.h"
+#include "rustica/query.h"
+#include "rustica/utils.h"
+
+#define TYPE_UNSET 0
+#define TYPE_LATCH 1
+#define TYPE_LISTEN 2
+#define TYPE_CLIENT 3
+#define TYPE_HANDOVER 4
+
+#define HUB_HEARTBEAT_MS 15000
+#define HUB_HANDOVER_TIMEOUT_MS 1000
+#define HUB_MAX_PENDING (1024 * 1024)
+
+#define SSE_DEFAULT_HEAD                   \
+    "HTTP/1.1 200 OK\r\n"                  \
+    "Content-Type: text/event-stream\r\n" \
+    "Cache-Control: no-cache\r\n"          \
+    "\r\n"
+
+typedef struct Subscriber {
+    char type;
+    pgsocket fd;
+    int pos;
+    int channel;
+    StringInfoData pending; // what the socket didn't take yet
+    TimestampTz deadline;   // of a handover that is not received yet
+} Subscriber;
+
+static WaitEventSetEx *hub_wait_set = NULL;
+static Subscriber *subscribers = NULL;
+static int total_slots = 0;
+static List *channels = NIL;
+static bool shutdown_requested = false;
+
+bool
+rst_hub_enabled() {
+    return rst_hub_channels != NULL && rst_hub_channels[0] != '\0';
+}
+
+BackgroundWorkerHandle *
+rst_hub_register() {
+    BackgroundWorker worker = { .bgw_flags =
+                                    BGWORKER_SHMEM_ACCESS
+                                    | BGWORKER_BACKEND_DATABASE_CONNECTION,
+                                .bgw_start_time = BgWorkerStart_ConsistentState,
+                                .bgw_restart_time = 10,
+                                .bgw_notify_pid = 0 };
+    BackgroundWorkerHandle *handle = NULL;
+
+    snprintf(worker.bgw_name, BGW_MAXLEN, "rustica hub");
+    snprintf(worker.bgw_type, BGW_MAXLEN, "rustica hub");
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, "rustica-engine");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "rustica_hub");
+    if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+        ereport(WARNING, errmsg("could not register rustica hub process"));
+    return handle;
+}
+
+// Runs in the worker: pass the client socket to the hub, which then owns the
+// connection. The hub sends the response head, so a failure here leaves the
+// connection untouched.
+static bool
+handover(Context *ctx, const char *channel, int channel_len, StringInfo head) {
+    struct sockaddr_un addr;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    char sep = '\0';
+    struct iovec iov[3] = {
+        { .iov_base = (void *)channel, .iov_len = channel_len },
+        { .iov_base = &sep, .iov_len = 1 },
+        { .iov_base = head->data, .iov_len = head->len },
+    };
+    struct msghdr msg = { .msg_iov = iov,
+                          .msg_iovlen = 3,
+                          .msg_control = cbuf,
+                          .msg_controllen = sizeof(cbuf) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    *((int *)CMSG_DATA(cmsg)) = ctx->fd;
+
+    pgsocket sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == PGINVALID_SOCKET)
+        return false;
+    rst_make_hub_addr(&addr);
+    bool ok =
+        connect(sock, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) == 0
+        && sendmsg(sock, &msg, 0) == channel_len + 1 + head->len;
+    if (!ok)
+        ereport(WARNING, errmsg("could not hand over to rustica hub: %m"));
+    closesocket(sock);
+    return ok;
+}
+
+// hub_handover(channel) moves the current connection to the hub process, which
+// streams NOTIFY payloads on the channel as server-sent events until the
+// client goes away. Headers set with resp_status()/resp_header() are used for
+// the response head, otherwise a plain text/event-stream head is sent.
+static int32_t
+hub_handover(wasm_exec_env_t exec_env, wasm_obj_t channel) {
+    Context *ctx = (Context *)wasm_runtime_get_user_data(exec_env);
+    text *t = DatumGetTextPP(wasm_externref_obj_get_datum(channel, TEXTOID));
+    int len = VARSIZE_ANY_EXHDR(t);
+    HttpResponse *resp;
+    StringInfoData head;
+
+    if (!ctx)
+        ereport(ERROR, errmsg("no HTTP connection in this context"));
+    if (len == 0 || len >= NAMEDATALEN || memchr(VARDATA_ANY(t), 0, len))
+        ereport(ERROR, errmsg("hub_handover: invalid channel name"));
+    resp = &ctx->response;
+    if (resp->streaming || resp->nparts > 0 || resp->has_content_length)
+        ereport(ERROR, errmsg("hub_handover: response already has a body"));
+
+    initStringInfo(&head);
+    if (resp->started) {
+        appendBinaryStringInfo(&head, resp->head.data, resp->head.len);
+        appendStringInfoString(&head, "\r\n");
+    }
+    else
+        appendStringInfoString(&head, SSE_DEFAULT_HEAD);
+    if (head.len + len + 1 > RST_HUB_HANDOVER_MAXLEN)
+        ereport(ERROR, errmsg("hub_handover: response head too large"));
+
+    // Flush whatever the guest sent so far before another process writes
+    rst_io_uncork(ctx);
+    bool ok = handover(ctx, VARDATA_ANY(t), len, &head);
+    pfree(head.data);
+    if (!ok)
+        return -1;
+
+    rst_io_detach(ctx);
+    resp->started = false;
+    if (ctx->sf_slot >= 0) {
+        // There is no response to share with identical requests
+        rst_singleflight_finish(ctx->sf_slot, false);
+        ctx->sf_slot = -1;
+    }
+    return 0;
+}
+
+static NativeSymbol hub_symbols[] = {
+    { "hub_handover", hub_handover, "(r)i" },
+};
+
+void
+rst_register_natives_hub() {
+    REGISTER_WASM_NATIVES("env", hub_symbols);
+}
+
+static inline Subscriber *
+next_slot() {
+    int pos = NextWaitEventPos(hub_wait_set);
+    return pos == -1 ? NULL : &subscribers[pos];
+}
+
+static void
+drop_subscriber(Subscriber *sub) {
+    ereport(DEBUG1, errmsg("rustica hub: drop subscriber fd=%d", sub->fd));
+    DeleteWaitEventEx(hub_wait_set, sub->pos);
+    StreamClose(sub->fd);
+    if (sub->pending.data)
+        pfree(sub->pending.data);
+    memset(sub, 0, sizeof(Subscriber));
+}
+
+// Write to a subscriber without blocking the hub. Whatever the socket doesn't
+// take is kept and flushed when it becomes writeable; a subscriber that falls
+// too far behind is dropped.
+static void
+subscriber_write(Subscriber *sub, const char *data, int len) {
+    if (sub->pending.len == 0) {
+        ssize_t rv = send(sub->fd, data, len, 0);
+        if (rv < 0 && errno != EAGAIN && errno != EWOULDBLOCK
+            && errno != EINTR) {
+            drop_subscriber(sub);
+            return;
+        }
+        if (rv == len)
+            return;
+        if (rv > 0) {
+            data += rv;
+            len -= (int)rv;
+        }
+        ModifyWaitEventEx(hub_wait_set,
+                          sub->pos,
+                          WL_SOCKET_WRITEABLE | WL_SOCKET_CLOSED,
+                          NULL);
+    }
+    if (sub->pending.len + len > HUB_MAX_PENDING) {
+        ereport(LOG,
+                errmsg("rustica hub: subscriber fd=%d is too slow", sub->fd));
+        drop_subscriber(sub);
+        return;
+    }
+    if (!sub->pending.data) {
+        MemoryContext old = MemoryContextSwitchTo(TopMemoryContext);
+        initStringInfo(&sub->pending);
+        MemoryContextSwitchTo(old);
+    }
+    appendBinaryStringInfo(&sub->pending, data, len);
+}
+
+static void
+on_subscriber(Subscriber *sub, uint32 events) {
+    if (events & WL_SOCKET_CLOSED) {
+        drop_subscriber(sub);
+        return;
+    }
+    if (!(events & WL_SOCKET_WRITEABLE) || sub->pending.len == 0)
+        return;
+    ssize_t rv = send(sub->fd, sub->pending.data, sub->pending.len, 0);
+    if (rv < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            drop_subscriber(sub);
+        return;
+    }
+    if (rv < sub->pending.len) {
+        memmove(sub->pending.data,
+                sub->pending.data + rv,
+                sub->pending.len - rv);
+        sub->pending.len -= (int)rv;
+        return;
+    }
+    resetStringInfo(&sub->pending);
+    ModifyWaitEventEx(hub_wait_set, sub->pos, WL_SOCKET_CLOSED, NULL);
+}
+
+static int
+find_channel(const char *name) {
+    ListCell *cell;
+    foreach (cell, channels) {
+        if (strcmp((char *)lfirst(cell), name) == 0)
+            return foreach_current_index(cell);
+    }
+    return -1;
+}
+
+// Take a handover connection from a worker into the wait set, so that a worker
+// that dies or stalls before sending its message cannot block the hub.
+static void
+on_accept(Subscriber *listener, uint32 events) {
+    if (!(events & WL_SOCKET_ACCEPT))
+        return;
+    pgsocket conn = accept(listener->fd, NULL, NULL);
+    if (conn == PGINVALID_SOCKET) {
+        ereport(LOG,
+                (errcode_for_socket_access(),
+                 errmsg("rustica hub: could not accept handover: %m")));
+        return;
+    }
+    Subscriber *sub = next_slot();
+    if (!sub) {
+        ereport(LOG, errmsg("rustica hub: too many subscribers"));
+        closesocket(conn);
+        return;
+    }
+    sub->type = TYPE_HANDOVER;
+    sub->fd = conn;
+    sub->deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+                                                HUB_HANDOVER_TIMEOUT_MS);
+    sub->pos = AddWaitEventToSetEx(hub_wait_set,
+                                   WL_SOCKET_READABLE,
+                                   conn,
+                                   NULL,
+                                   sub);
+}
+
+static void
+drop_handover(Subscriber *sub) {
+    DeleteWaitEventEx(hub_wait_set, sub->pos);
+    closesocket(sub->fd);
+    memset(sub, 0, sizeof(Subscriber));
+}
+
+// Drop the handovers that are overdue, and return when the next one is due
+static TimestampTz
+expire_handovers(TimestampTz now) {
+    TimestampTz next = DT_NOEND;
+    for (int i = 0; i < total_slots; i++) {
+        Subscriber *sub = &subscribers[i];
+        if (sub->type != TYPE_HANDOVER)
+            continue;
+        if (sub->deadline <= now) {
+            ereport(LOG, errmsg("rustica hub: handover timed out"));
+            drop_handover(sub);
+        }
+        else
+            next = Min(next, sub->deadline);
+    }
+    return next;
+}
+
+static void
+on_handover(Subscriber *handover, uint32 events) {
+    char buf[RST_HUB_HANDOVER_MAXLEN];
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+    struct msghdr msg = { .msg_iov = &iov,
+                          .msg_iovlen = 1,
+                          .msg_control = cbuf,
+                          .msg_controllen = sizeof(cbuf) };
+    pgsocket client = PGINVALID_SOCKET;
+
+    // The worker sends the whole message in one sendmsg() after connecting
+    ssize_t received =
+        recvmsg(handover->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (received < 0
+        && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    struct cmsghdr *cmsg = received > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET
+        && cmsg->cmsg_type == SCM_RIGHTS)
+        client = *((int *)CMSG_DATA(cmsg));
+    drop_handover(handover);
+    if (client == PGINVALID_SOCKET) {
+        ereport(LOG, errmsg("rustica hub: bad handover message"));
+        return;
+    }
+
+    char *channel = buf;
+    int channel_len = strnlen(buf, received);
+    int idx = channel_len < received ? find_channel(channel) : -1;
+    Subscriber *sub = next_slot();
+    if (idx < 0 || !sub) {
+        ereport(LOG,
+                errmsg(idx < 0 ? "rustica hub: not listening on channel"
+                               : "rustica hub: too many subscribers"));
+        StreamClose(client);
+        return;
+    }
+    if (!pg_set_noblock(client)) {
+        StreamClose(client);
+        return;
+    }
+
+    sub->type = TYPE_CLIENT;
+    sub->fd = client;
+    sub->channel = idx;
+    sub->pos = AddWaitEventToSetEx(hub_wait_set,
+                                   WL_SOCKET_CLOSED,
+                                   client,
+                                   NULL,
+                                   sub);
+    ereport(DEBUG1,
+            errmsg("rustica hub: fd=%d subscribed to \"%s\"",
+                   client,
+                   channel));
+    subscriber_write(sub,
+                     buf + channel_len + 1,
+                     (int)(received - channel_len - 1));
+}
+
+static void
+broadcast(int channel, const char *data, int len) {
+    for (int i = 0; i < total_slots; i++) {
+        Subscriber *sub = &subscribers[i];
+        if (sub->type == TYPE_CLIENT && sub->channel == channel)
+            subscriber_write(sub, data, len);
+    }
+}
+
+static int
+mock_comm_putmessage(char msgtype, const char *s, size_t len) {
+    StringInfoData msg = { .data = (char *)s,
+                           .len = (int)len,
+                           .maxlen = (int)len,
+                           .cursor = 0 };
+    if (msgtype == 'A') {
+        pq_getmsgint(&msg, 4); // pid
+        const char *channel = pq_getmsgstring(&msg);
+        const char *payload = pq_getmsgstring(&msg);
+        int idx = find_channel(channel);
+        if (idx < 0)
+            return 0;
+
+        // One "data:" field per line of the payload
+        StringInfoData event;
+        initStringInfo(&event);
+        for (const char *line = payload;;) {
+            const char *eol = strchr(line, '\n');
+            int line_len = eol ? (int)(eol - line) : (int)strlen(line);
+            appendStringInfoString(&event, "data: ");
+            appendBinaryStringInfo(&event, line, line_len);
+            appendStringInfoChar(&event, '\n');
+            if (!eol)
+                break;
+            line = eol + 1;
+        }
+        appendStringInfoChar(&event, '\n');
+        broadcast(idx, event.data, event.len);
+        pfree(event.data);
+    }
+    return 0;
+}
+
+static const PQcommMethods mock_comm_methods = {
+    NULL, NULL, NULL, NULL, mock_comm_putmessage, NULL,
+};
+
+static void
+on_notification_received() {
+    const PQcommMethods *old_methods = PqCommMethods;
+    PqCommMethods = &mock_comm_methods;
+    whereToSendOutput = DestRemote;
+    ProcessNotifyInterrupt(false);
+    whereToSendOutput = DestNone;
+    PqCommMethods = old_methods;
+}
+
+static void
+on_sigterm(SIGNAL_ARGS) {
+    shutdown_requested = true;
+    SetLatch(MyLatch);
+}
+
+static void
+on_sigusr1(SIGNAL_ARGS) {
+    procsignal_sigusr1_handler(postgres_signal_arg);
+    SetLatch(MyLatch);
+}
+
+static void
+startup() {
+    struct sockaddr_un addr;
+    ListCell *cell;
+    Subscriber *sub;
+
+    pqsignal(SIGTERM, on_sigterm);
+    pqsignal(SIGUSR1, on_sigusr1);
+    BackgroundWorkerUnblockSignals();
+
+    if (rst_database == NULL)
+        ereport(FATAL, errmsg("rustica.database is never configured"));
+    BackgroundWorkerInitializeConnection(rst_database, NULL, 0);
+
+    // Listen on the configured channels
+    MemoryContext old = MemoryContextSwitchTo(TopMemoryContext);
+    char *channel_list = pstrdup(rst_hub_channels);
+    if (!SplitGUCList(channel_list, ',', &channels))
+        ereport(FATAL,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("invalid list syntax in parameter \"%s\"",
+                        "rustica.hub_channels")));
+    MemoryContextSwitchTo(old);
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    foreach (cell, channels)
+        Async_Listen((char *)lfirst(cell));
+    CommitTransactionCommand();
+
+    // Accept handovers from workers
+    pgsocket listen_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_sock == PGINVALID_SOCKET)
+        ereport(FATAL, errmsg("rustica hub: could not create socket: %m"));
+    rst_make_hub_addr(&addr);
+    if (bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        ereport(FATAL,
+                errmsg("could not bind %s address \"%s\": %m",
+                       "Unix",
+                       &addr.sun_path[1]));
+    if (listen(listen_sock, max_worker_processes * 2) < 0)
+        ereport(FATAL,
+                errmsg("could not listen on %s address \"%s\": %m",
+                       "Unix",
+                       &addr.sun_path[1]));
+
+    total_slots = rst_hub_max_subscribers + 2;
+    subscribers = (Subscriber *)MemoryContextAllocZero(
+        TopMemoryContext,
+        sizeof(Subscriber) * total_slots);
+    hub_wait_set = CreateWaitEventSetEx(TopMemoryContext, total_slots);
+
+    sub = next_slot();
+    sub->type = TYPE_LATCH;
+    sub->fd = PGINVALID_SOCKET;
+    sub->pos = AddWaitEventToSetEx(hub_wait_set,
+                                   WL_LATCH_SET,
+                                   PGINVALID_SOCKET,
+                                   MyLatch,
+                                   sub);
+
+    sub = next_slot();
+    sub->type = TYPE_LISTEN;
+    sub->fd = listen_sock;
+    sub->pos = AddWaitEventToSetEx(hub_wait_set,
+                                   WL_SOCKET_ACCEPT,
+                                   listen_sock,
+                                   NULL,
+                                   sub);
+    ereport(LOG,
+            errmsg("rustica hub listening on %d channel(s)",
+                   list_length(channels)));
+}
+
+static void
+heartbeat() {
+    // Keep idle streams alive through proxies; comments are ignored by clients
+    for (int i = 0; i < total_slots; i++) {
+        Subscriber *sub = &subscribers[i];
+        if (sub->type == TYPE_CLIENT)
+            subscriber_write(sub, ":\n\n", 3);
+    }
+}
+
+static void
+main_loop() {
+    WaitEvent events[64];
+    TimestampTz next_heartbeat =
+        TimestampTzPlusMilliseconds(GetCurrentTimestamp(), HUB_HEARTBEAT_MS);
+
+    for (;;) {
+        TimestampTz now = GetCurrentTimestamp();
+        long timeout = TimestampDifferenceMilliseconds(
+            now,
+            Min(next_heartbeat, expire_handovers(now)));
+        int nevents = WaitEventSetWaitEx(hub_wait_set,
+                                         timeout,
+                                         events,
+                                         lengthof(events),
+                                         PG_WAIT_EXTENSION);
+        for (int i = 0; i < nevents; i++) {
+            Subscriber *sub = (Subscriber *)events[i].user_data;
+            if (events[i].events & WL_LATCH_SET) {
+                if (shutdown_requested)
+                    return;
+                ResetLatch(MyLatch);
+            }
+            if (sub->type == TYPE_LISTEN)
+                on_accept(sub, events[i].events);
+            else if (sub->type == TYPE_HANDOVER)
+                on_handover(sub, events[i].events);
+            else if (sub->type == TYPE_CLIENT)
+                on_subscriber(sub, events[i].events);
+        }
+
+        if (notifyInterruptPending)
+            on_notification_received();
+
+        if (GetCurrentTimestamp() >= next_heartbeat) {
+            heartbeat();
+            next_heartbeat = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+                                                         HUB_HEARTBEAT_MS);
+        }
+    }
+}
+
+static void
+teardown() {
+    for (int i = 0; i < total_slots; i++) {
+        if (subscribers[i].type == TYPE_CLIENT
+            || subscribers[i].type == TYPE_LISTEN
+            || subscribers[i].type == TYPE_HANDOVER)
+            StreamClose(subscribers[i].fd);
+    }
+    FreeWaitEventSetEx(hub_wait_set);
+    hub_wait_set = NULL;
+}
+
+PGDLLEXPORT void
+rustica_hub(Datum arg) {
+    startup();
+    main_loop();
+    teardown();
+}
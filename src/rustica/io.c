@@ -0,0 +1,476 @@
+/*
+ * Copyright (c) 2026-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "postgres.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "storage/shmem.h"
+#include "utils/memutils.h"
+
+#include "rustica/gucs.h"
+#include "rustica/io.h"
+#include "rustica/query.h"
+#include "rustica/singleflight.h"
+
+typedef struct IoShared {
+    pg_atomic_uint64 counters[RST_IO_NCOUNTERS];
+} IoShared;
+
+static IoShared *shared = NULL;
+
+#define COUNT(ctx, counter, n) ((ctx)->io.counters[counter] += (n))
+
+// Keep a copy of what was sent for singleflight followers and the response
+// cache, and follow the response head for keep-alive.
+static inline void
+capture(Context *ctx, const char *data, int len) {
+    if (!ctx->sent.complete)
+        rst_http_sent_scan(&ctx->sent, data, len);
+    if (ctx->sf_slot >= 0)
+        rst_singleflight_capture(ctx->sf_slot, data, len);
+    if (ctx->rc_key_len > 0) {
+        if (ctx->rc_resp.len + len > rst_response_cache_max_response * 1024)
+            ctx->rc_key_len = -1;
+        else
+            appendBinaryStringInfo(&ctx->rc_resp, data, len);
+    }
+}
+
+void
+rst_io_shmem_request() {
+    RequestAddinShmemSpace(sizeof(IoShared));
+}
+
+void
+rst_io_shmem_startup() {
+    bool found;
+    shared = ShmemInitStruct("rustica io", sizeof(IoShared), &found);
+    if (!found) {
+        for (int i = 0; i < RST_IO_NCOUNTERS; i++)
+            pg_atomic_init_u64(&shared->counters[i], 0);
+    }
+}
+
+void
+rst_io_open(Context *ctx) {
+    int on = 1;
+
+    // recv/send are tried first and we only wait on EAGAIN, so the socket
+    // must never block.
+    if (!pg_set_noblock(ctx->fd))
+        ereport(ERROR, errmsg("failed to set client socket non-blocking: %m"));
+    if (setsockopt(ctx->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+        ereport(DEBUG1, errmsg("setsockopt(TCP_NODELAY) failed: %m"));
+    COUNT(ctx, RST_IO_SOCKOPT_CALLS, 1);
+
+    ctx->io.wait_events = WL_SOCKET_CLOSED;
+    ctx->io.corked = false;
+    ctx->io.eof = false;
+    ctx->io.detached = false;
+    ctx->io.rbuf = NULL;
+    ctx->io.rsize = 0;
+    ctx->io.rpos = 0;
+    ctx->io.rlen = 0;
+    memset(ctx->io.counters, 0, sizeof(ctx->io.counters));
+}
+
+void
+rst_io_close(Context *ctx) {
+    if (ctx->io.rbuf) {
+        pfree(ctx->io.rbuf);
+        ctx->io.rbuf = NULL;
+    }
+    if (shared) {
+        for (int i = 0; i < RST_IO_NCOUNTERS; i++)
+            if (ctx->io.counters[i])
+                pg_atomic_fetch_add_u64(&shared->counters[i],
+                                        (int64)ctx->io.counters[i]);
+    }
+    memset(ctx->io.counters, 0, sizeof(ctx->io.counters));
+}
+
+void
+rst_io_begin_request(Context *ctx) {
+    ctx->io.eof = false;
+    COUNT(ctx, RST_IO_REQUESTS, 1);
+}
+
+// Mark the current request as complete. Bytes the guest has received but the
+// parser didn't consume belong to the next request, so they are put back in
+// front of the read-ahead buffer.
+void
+rst_io_end_request(Context *ctx, const char *leftover, int len) {
+    IoState *io = &ctx->io;
+    io->eof = true;
+    if (len <= 0)
+        return;
+    if (io->rpos >= len) {
+        io->rpos -= len;
+        memcpy(io->rbuf + io->rpos, leftover, len);
+        return;
+    }
+
+    int pending = io->rlen - io->rpos;
+    int size = Max(RST_IO_READAHEAD, len + pending);
+    char *buf = MemoryContextAlloc(TopMemoryContext, size);
+    memcpy(buf, leftover, len);
+    if (pending > 0)
+        memcpy(buf + len, io->rbuf + io->rpos, pending);
+    if (io->rbuf)
+        pfree(io->rbuf);
+    io->rbuf = buf;
+    io->rsize = size;
+    io->rpos = 0;
+    io->rlen = len + pending;
+}
+
+// Wait until the client socket is ready for the given events. The epoll
+// interest set is only modified when the events differ from the last wait,
+// which in practice means once per direction change.
+static uint32
+io_wait(Context *ctx, uint32 events, long timeout, uint32 wait_event_info) {
+    WaitEvent event;
+    events |= WL_SOCKET_CLOSED;
+    if (ctx->io.wait_events != events) {
+        ModifyWaitEvent(ctx->wait_set, 1, events, NULL);
+        ctx->io.wait_events = events;
+        COUNT(ctx, RST_IO_WAIT_MODIFIES, 1);
+    }
+    COUNT(ctx, RST_IO_WAITS, 1);
+    if (WaitEventSetWait(ctx->wait_set, timeout, &event, 1, wait_event_info)
+        == 0)
+        return 0;
+    return event.events;
+}
+
+// Move pending bytes to the front of the read-ahead buffer
+static inline void
+compact(IoState *io) {
+    if (io->rpos == 0)
+        return;
+    memmove(io->rbuf, io->rbuf + io->rpos, io->rlen - io->rpos);
+    io->rlen -= io->rpos;
+    io->rpos = 0;
+}
+
+// Make sure the next request head is in the read-ahead buffer without
+// consuming it. Returns its length including the empty line, or 0 if it
+// doesn't fit in the buffer or the client stops sending before it's complete.
+int
+rst_io_peek_head(Context *ctx, const char **head) {
+    IoState *io = &ctx->io;
+    if (io->detached)
+        return 0;
+    if (!io->rbuf) {
+        io->rbuf = MemoryContextAlloc(TopMemoryContext, RST_IO_READAHEAD);
+        io->rsize = RST_IO_READAHEAD;
+    }
+    for (;;) {
+        const char *end =
+            memmem(io->rbuf + io->rpos, io->rlen - io->rpos, "\r\n\r\n", 4);
+        if (end) {
+            *head = io->rbuf + io->rpos;
+            return (int)(end + 4 - *head);
+        }
+        compact(io);
+        if (io->rlen == io->rsize)
+            return 0;
+
+        ssize_t rv =
+            recv(ctx->fd, io->rbuf + io->rlen, io->rsize - io->rlen, 0);
+        COUNT(ctx, RST_IO_RECV_CALLS, 1);
+        if (rv > 0) {
+            COUNT(ctx, RST_IO_BYTES_RECEIVED, rv);
+            io->rlen += (int)rv;
+            continue;
+        }
+        if (rv == 0)
+            return 0;
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return 0;
+        COUNT(ctx, RST_IO_RECV_EAGAIN, 1);
+
+        uint32 events =
+            io_wait(ctx, WL_SOCKET_READABLE, -1, WAIT_EVENT_CLIENT_READ);
+        if (events & WL_LATCH_SET)
+            return 0;
+        if ((events & WL_SOCKET_CLOSED) && !(events & WL_SOCKET_READABLE))
+            return 0;
+    }
+}
+
+// Drop bytes returned by rst_io_peek_head() after the host answered them
+void
+rst_io_consume(Context *ctx, int len) {
+    ctx->io.rpos += len;
+}
+
+// Tell whether a buffered request is complete: its head and, if any, its
+// Content-Length body. Chunked bodies only need the head.
+static bool
+request_complete(const char *p, int len) {
+    const char *end = memmem(p, len, "\r\n\r\n", 4);
+    if (!end)
+        return false;
+    int head_len = (int)(end + 4 - p);
+    const char *line = (const char *)memmem(p, head_len, "\r\n", 2) + 2;
+    while (line < end + 2) {
+        const char *eol = memmem(line, end + 2 - line, "\r\n", 2);
+        if (eol - line > 15 && pg_strncasecmp(line, "Content-Length:", 15) == 0)
+            return len - head_len >= strtol(line + 15, NULL, 10);
+        line = eol + 2;
+    }
+    return true;
+}
+
+// Pull in what the client has sent so far without waiting. Returns
+// RST_IO_FILL_READY when the next request can run without blocking on the
+// client, because it's complete, fills the buffer or is cut short by EOF;
+// RST_IO_FILL_CLOSED when the client closed the connection between requests.
+int
+rst_io_fill(Context *ctx) {
+    IoState *io = &ctx->io;
+    bool eof = false;
+
+    if (!io->rbuf) {
+        io->rbuf = MemoryContextAlloc(TopMemoryContext, RST_IO_READAHEAD);
+        io->rsize = RST_IO_READAHEAD;
+    }
+    compact(io);
+    while (io->rlen < io->rsize) {
+        ssize_t rv =
+            recv(ctx->fd, io->rbuf + io->rlen, io->rsize - io->rlen, 0);
+        COUNT(ctx, RST_IO_RECV_CALLS, 1);
+        if (rv > 0) {
+            COUNT(ctx, RST_IO_BYTES_RECEIVED, rv);
+            io->rlen += (int)rv;
+            continue;
+        }
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            COUNT(ctx, RST_IO_RECV_EAGAIN, 1);
+            break;
+        }
+        eof = true;
+        break;
+    }
+
+    if (io->rlen == 0)
+        return eof ? RST_IO_FILL_CLOSED : RST_IO_FILL_PENDING;
+    if (eof || io->rlen == io->rsize || request_complete(io->rbuf, io->rlen))
+        return RST_IO_FILL_READY;
+    return RST_IO_FILL_PENDING;
+}
+
+// Receive up to len bytes, serving from the read-ahead buffer first. Returns
+// the number of bytes received, 0 when the client closed the connection, or
+// -1 on error or when the worker latch is set.
+int
+rst_io_recv(Context *ctx, char *buf, int len) {
+    IoState *io = &ctx->io;
+    if (len <= 0 || io->eof || io->detached)
+        return 0;
+
+    // The guest is done sending for now, don't hold back the last frame
+    rst_io_uncork(ctx);
+    if (io->rpos < io->rlen) {
+        int n = Min(len, io->rlen - io->rpos);
+        memcpy(buf, io->rbuf + io->rpos, n);
+        io->rpos += n;
+        return n;
+    }
+
+    // Small reads go through the read-ahead buffer so that a pipelined or
+    // large request doesn't cost one recv() per guest buffer.
+    bool direct = len >= RST_IO_READAHEAD;
+    if (!direct && !io->rbuf) {
+        io->rbuf = MemoryContextAlloc(TopMemoryContext, RST_IO_READAHEAD);
+        io->rsize = RST_IO_READAHEAD;
+    }
+    for (;;) {
+        ssize_t rv = direct ? recv(ctx->fd, buf, len, 0)
+                            : recv(ctx->fd, io->rbuf, io->rsize, 0);
+        COUNT(ctx, RST_IO_RECV_CALLS, 1);
+        if (rv >= 0) {
+            COUNT(ctx, RST_IO_BYTES_RECEIVED, rv);
+            if (direct || rv == 0)
+                return (int)rv;
+            int n = Min(len, (int)rv);
+            memcpy(buf, io->rbuf, n);
+            io->rpos = n;
+            io->rlen = (int)rv;
+            return n;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        COUNT(ctx, RST_IO_RECV_EAGAIN, 1);
+
+        uint32 events =
+            io_wait(ctx, WL_SOCKET_READABLE, -1, WAIT_EVENT_CLIENT_READ);
+        if (events & WL_LATCH_SET)
+            return -1;
+        if ((events & WL_SOCKET_CLOSED) && !(events & WL_SOCKET_READABLE))
+            return 0;
+    }
+}
+
+// Send what the socket accepts right now, waiting only if it accepts nothing.
+// Returns the number of bytes sent, 0 when the client closed the connection,
+// or -1 on error or when the worker latch is set.
+int
+rst_io_send(Context *ctx, const char *data, int len) {
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+    if (ctx->io.detached)
+        return -1;
+    for (;;) {
+        ssize_t rv = writev(ctx->fd, &iov, 1);
+        COUNT(ctx, RST_IO_SEND_CALLS, 1);
+        if (rv >= 0) {
+            COUNT(ctx, RST_IO_BYTES_SENT, rv);
+            if (rv > 0)
+                capture(ctx, data, (int)rv);
+            return (int)rv;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        COUNT(ctx, RST_IO_SEND_EAGAIN, 1);
+
+        uint32 events =
+            io_wait(ctx, WL_SOCKET_WRITEABLE, -1, WAIT_EVENT_CLIENT_WRITE);
+        if (events & WL_LATCH_SET)
+            return -1;
+        if ((events & WL_SOCKET_CLOSED) && !(events & WL_SOCKET_WRITEABLE))
+            return 0;
+    }
+}
+
+bool
+rst_io_send_all(Context *ctx, const char *data, int len) {
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+    return rst_io_writev_all(ctx, &iov, 1);
+}
+
+// Write all segments to the client, resuming after partial writes. The iov
+// array is consumed in place.
+bool
+rst_io_writev_all(Context *ctx, struct iovec *iov, int iovcnt) {
+    if (ctx->io.detached)
+        return false;
+    while (iovcnt > 0) {
+        if (iov->iov_len == 0) {
+            iov++;
+            iovcnt--;
+            continue;
+        }
+        ssize_t rv = writev(ctx->fd, iov, Min(iovcnt, IOV_MAX));
+        COUNT(ctx, RST_IO_SEND_CALLS, 1);
+        if (rv < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return false;
+            COUNT(ctx, RST_IO_SEND_EAGAIN, 1);
+            uint32 events =
+                io_wait(ctx, WL_SOCKET_WRITEABLE, -1, WAIT_EVENT_CLIENT_WRITE);
+            if (events & WL_LATCH_SET)
+                return false;
+            if ((events & WL_SOCKET_CLOSED)
+                && !(events & WL_SOCKET_WRITEABLE))
+                return false;
+            continue;
+        }
+        COUNT(ctx, RST_IO_BYTES_SENT, rv);
+
+        // Skip what was written, capturing it on the way
+        size_t n = (size_t)rv;
+        while (n > 0) {
+            size_t chunk = Min(n, iov->iov_len);
+            capture(ctx, iov->iov_base, (int)chunk);
+            iov->iov_base = (char *)iov->iov_base + chunk;
+            iov->iov_len -= chunk;
+            n -= chunk;
+            if (iov->iov_len == 0) {
+                iov++;
+                iovcnt--;
+            }
+        }
+    }
+    return true;
+}
+
+// Give up the connection after it was passed to another process. The socket
+// is only closed in this process, and nothing is read or written anymore.
+void
+rst_io_detach(Context *ctx) {
+    rst_io_uncork(ctx);
+    ctx->io.detached = true;
+    ctx->io.rpos = ctx->io.rlen = 0;
+}
+
+// Hold back partial frames while the guest sends a response in several
+// pieces; rst_io_uncork() pushes out whatever is left.
+void
+rst_io_cork(Context *ctx) {
+    int on = 1;
+    if (ctx->io.corked)
+        return;
+    if (setsockopt(ctx->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) == 0)
+        ctx->io.corked = true;
+    COUNT(ctx, RST_IO_SOCKOPT_CALLS, 1);
+}
+
+void
+rst_io_uncork(Context *ctx) {
+    int off = 0;
+    if (!ctx->io.corked)
+        return;
+    setsockopt(ctx->fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+    ctx->io.corked = false;
+    COUNT(ctx, RST_IO_SOCKOPT_CALLS, 1);
+}
+
+Datum
+rst_io_stat(PG_FUNCTION_ARGS) {
+    TupleDesc tupdesc;
+    Datum values[RST_IO_NCOUNTERS];
+    bool nulls[RST_IO_NCOUNTERS] = { 0 };
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        ereport(ERROR, errmsg("return type must be a row type"));
+    if (!shared)
+        ereport(ERROR,
+                errmsg("rustica-engine must be loaded via "
+                       "shared_preload_libraries"));
+    for (int i = 0; i < RST_IO_NCOUNTERS; i++)
+        values[i] = Int64GetDatum(
+            (int64)pg_atomic_read_u64(&shared->counters[i]));
+    PG_RETURN_DATUM(
+        HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2026-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#ifndef RUSTICA_IO_H
+#define RUSTICA_IO_H
+
+#include <sys/uio.h>
+
+#include "postgres.h"
+#include "fmgr.h"
+
+// Size of the host-owned read-ahead buffer per connection
+#define RST_IO_READAHEAD 16384
+
+#define RST_IO_REQUESTS 0
+#define RST_IO_RECV_CALLS 1
+#define RST_IO_RECV_EAGAIN 2
+#define RST_IO_SEND_CALLS 3
+#define RST_IO_SEND_EAGAIN 4
+#define RST_IO_WAITS 5
+#define RST_IO_WAIT_MODIFIES 6
+#define RST_IO_SOCKOPT_CALLS 7
+#define RST_IO_BYTES_RECEIVED 8
+#define RST_IO_BYTES_SENT 9
+#define RST_IO_DISCONNECTS 10
+#define RST_IO_TIMEOUTS 11
+#define RST_IO_NCOUNTERS 12
+
+// Results of rst_io_fill()
+#define RST_IO_FILL_PENDING 0
+#define RST_IO_FILL_READY 1
+#define RST_IO_FILL_CLOSED 2
+
+typedef struct Context Context;
+
+// Per-connection I/O state. Counters are kept locally and only added to the
+// shared totals when the connection is closed.
+typedef struct IoState {
+    uint32 wait_events; // events currently registered for the client socket
+    bool corked;
+    bool eof;      // the current request is complete, recv() returns 0
+    bool detached; // the connection was handed over to another process
+    char *rbuf;
+    int rsize;
+    int rpos;
+    int rlen;
+    uint64 counters[RST_IO_NCOUNTERS];
+} IoState;
+
+void
+rst_io_shmem_request();
+
+void
+rst_io_shmem_startup();
+
+void
+rst_io_open(Context *ctx);
+
+void
+rst_io_close(Context *ctx);
+
+void
+rst_io_begin_request(Context *ctx);
+
+void
+rst_io_end_request(Context *ctx, const char *leftover, int len);
+
+int
+rst_io_peek_head(Context *ctx, const char **head);
+
+void
+rst_io_consume(Context *ctx, int len);
+
+int
+rst_io_fill(Context *ctx);
+
+int
+rst_io_recv(Context *ctx, char *buf, int len);
+
+int
+rst_io_send(Context *ctx, const char *data, int len);
+
+bool
+rst_io_send_all(Context *ctx, const char *data, int len);
+
+bool
+rst_io_writev_all(Context *ctx, struct iovec *iov, int iovcnt);
+
+void
+rst_io_detach(Context *ctx);
+
+void
+rst_io_cork(Context *ctx);
+
+void
+rst_io_uncork(Context *ctx);
+
+Datum
+rst_io_stat(PG_FUNCTION_ARGS);
+
+#endif /* RUSTICA_IO_H */
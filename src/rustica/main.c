@@ -15,21 +15,67 @@
  */
 
 #include "postgres.h"
+#include "miscadmin.h"
 #include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
 #include "utils/memutils.h"
 
 #include "rustica/compiler.h"
 #include "rustica/gucs.h"
+#include "rustica/io.h"
+#include "rustica/pgo.h"
+#include "rustica/response_cache.h"
+#include "rustica/singleflight.h"
+#include "rustica/stats.h"
 #include "rustica/wamr.h"
 
 PG_MODULE_MAGIC;
 
 PG_FUNCTION_INFO_V1(compile_wasm);
+PG_FUNCTION_INFO_V1(prepare_wasm);
+PG_FUNCTION_INFO_V1(merge_profiles);
+PG_FUNCTION_INFO_V1(stat_phases);
+PG_FUNCTION_INFO_V1(stat_queries);
+PG_FUNCTION_INFO_V1(stat_reset);
+PG_FUNCTION_INFO_V1(forget_stat_queries);
+PG_FUNCTION_INFO_V1(stat_io);
+PG_FUNCTION_INFO_V1(purge);
+
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+static void
+shmem_request() {
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+    rst_singleflight_shmem_request();
+    rst_io_shmem_request();
+    rst_response_cache_shmem_request();
+    rst_stats_shmem_request();
+}
+
+static void
+shmem_startup() {
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+    rst_singleflight_shmem_startup();
+    rst_io_shmem_startup();
+    rst_response_cache_shmem_startup();
+    rst_stats_shmem_startup();
+    LWLockRelease(AddinShmemInitLock);
+}
 
 void
 _PG_init() {
     rst_init_gucs();
 
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = shmem_request;
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = shmem_startup;
+
     MemoryContext tx_mctx = MemoryContextSwitchTo(TopMemoryContext);
     rst_init_wamr();
     MemoryContextSwitchTo(tx_mctx);
@@ -48,7 +94,47 @@ _PG_init() {
 
 Datum
 compile_wasm(PG_FUNCTION_ARGS) {
-    return rst_compile(fcinfo);
+    return rst_compile(fcinfo, true);
+}
+
+Datum
+prepare_wasm(PG_FUNCTION_ARGS) {
+    return rst_compile(fcinfo, false);
+}
+
+Datum
+merge_profiles(PG_FUNCTION_ARGS) {
+    return rst_pgo_merge(fcinfo);
+}
+
+Datum
+stat_io(PG_FUNCTION_ARGS) {
+    return rst_io_stat(fcinfo);
+}
+
+Datum
+stat_phases(PG_FUNCTION_ARGS) {
+    return rst_stats_phases(fcinfo);
+}
+
+Datum
+stat_queries(PG_FUNCTION_ARGS) {
+    return rst_stats_queries(fcinfo);
+}
+
+Datum
+stat_reset(PG_FUNCTION_ARGS) {
+    return rst_stats_reset(fcinfo);
+}
+
+Datum
+forget_stat_queries(PG_FUNCTION_ARGS) {
+    return rst_stats_forget_queries(fcinfo);
+}
+
+Datum
+purge(PG_FUNCTION_ARGS) {
+    return rst_response_cache_purge_sql(fcinfo);
 }
 
 void
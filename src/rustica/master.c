@@ -14,6 +14,9 @@
  * See the Mulan PSL v2 for more details.
  */
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 
 #include "postgres.h"
@@ -23,9 +26,14 @@
 #include "common/ip.h"
 #include "postmaster/bgworker.h"
 #include "postmaster/postmaster.h"
+#include "utils/timestamp.h"
 
+#include "rustica/assets.h"
+#include "rustica/compile_worker.h"
 #include "rustica/event_set.h"
 #include "rustica/gucs.h"
+#include "rustica/hub.h"
+#include "rustica/uring.h"
 #include "rustica/utils.h"
 
 typedef struct Socket Socket;
@@ -34,8 +42,17 @@ typedef struct Socket Socket;
 #define TYPE_IPC 1
 #define TYPE_FRONTEND 2
 #define TYPE_BACKEND 3
+#define TYPE_STATIC 4
+#define TYPE_URING 5
 #define MAXLISTEN 64
 #define JOB_QLEN 1024
+#define STATIC_QLEN 256
+
+typedef struct Job {
+    pgsocket sock;
+    TimestampTz accepted_at;
+} Job;
+
 static WaitEventSetEx *rm_wait_set = NULL;
 static Socket *sockets;
 static int total_sockets = 0;
@@ -46,10 +63,19 @@ static int idle_qhead = 0, idle_qtail = 0, idle_qsize = 0;
 static int num_workers;
 static BackgroundWorkerHandle **worker_handles;
 static FDMessage fd_msg;
-static pgsocket job_queue[JOB_QLEN];
+static Job job_queue[JOB_QLEN];
 static int job_qhead = 0, job_qtail = 0, job_qsize = 0;
 static bool frontend_paused = false;
 static int worker_id_seq = 0;
+static BackgroundWorkerHandle *hub_handle = NULL;
+static BackgroundWorkerHandle *assets_handle = NULL;
+static BackgroundWorkerHandle **compile_handles = NULL;
+static int num_compile_workers = 0;
+static int num_static = 0;
+#ifdef RUSTICA_IO_URING
+static Socket *uring_socket = NULL;
+static Socket *uring_listeners[MAXLISTEN];
+#endif
 
 typedef struct Socket {
     char type;
@@ -58,6 +84,13 @@ typedef struct Socket {
 
     uint8_t read_offset;
     uint32_t worker_id;
+
+    // TYPE_FRONTEND only, -1 if accepting through the wait set
+    int uring_index;
+
+    // TYPE_STATIC only
+    StaticResponse *response;
+    int head_sent;
 } Socket;
 
 static int
@@ -165,8 +198,8 @@ startup() {
     BackgroundWorkerUnblockSignals();
 
     memset(&fd_msg, 0, sizeof(FDMessage));
-    fd_msg.io.iov_base = &fd_msg.byte;
-    fd_msg.io.iov_len = 1;
+    fd_msg.io.iov_base = &fd_msg.job;
+    fd_msg.io.iov_len = sizeof(JobInfo);
     fd_msg.msg.msg_iov = &fd_msg.io;
     fd_msg.msg.msg_iovlen = 1;
     fd_msg.msg.msg_control = fd_msg.buf;
@@ -178,7 +211,39 @@ startup() {
 
     num_listen_sockets = listen_frontend(listen_sockets);
     ipc_sock = listen_backend();
-    total_sockets = 1 + num_listen_sockets + max_worker_processes;
+    if (rst_hub_enabled())
+        hub_handle = rst_hub_register();
+    if (rst_static_cache && rst_database != NULL)
+        assets_handle = rst_assets_register();
+    if (rst_database != NULL && rst_compile_workers > 0) {
+        compile_handles = (BackgroundWorkerHandle **)MemoryContextAllocZero(
+            CurrentMemoryContext,
+            sizeof(BackgroundWorkerHandle *) * rst_compile_workers);
+        for (int i = 0; i < rst_compile_workers; i++) {
+            compile_handles[i] = rst_compile_worker_register(i);
+            if (compile_handles[i] != NULL)
+                num_compile_workers++;
+        }
+    }
+    total_sockets = 2 + num_listen_sockets + max_worker_processes;
+    if (rst_static_cache) {
+        total_sockets += STATIC_QLEN;
+#ifdef TCP_DEFER_ACCEPT
+        // Wake up only when the request arrives, so that it can be peeked
+        for (int i = 0; i < num_listen_sockets; i++) {
+            int secs = 1;
+            if (setsockopt(listen_sockets[i],
+                           IPPROTO_TCP,
+                           TCP_DEFER_ACCEPT,
+                           &secs,
+                           sizeof(secs))
+                < 0)
+                ereport(LOG,
+                        (errmsg("setsockopt(%s) failed: %m",
+                                "TCP_DEFER_ACCEPT")));
+        }
+#endif
+    }
 
     sockets = (Socket *)MemoryContextAllocZero(CurrentMemoryContext,
                                                sizeof(Socket) * total_sockets);
@@ -209,18 +274,53 @@ startup() {
                                       socket);
     Assert(socket->pos != -1);
 
+    if (rst_io_uring) {
+#ifdef RUSTICA_IO_URING
+        if (rst_uring_init(listen_sockets, num_listen_sockets)) {
+            socket = &sockets[NextWaitEventPos(rm_wait_set)];
+            socket->type = TYPE_URING;
+            socket->fd = rst_uring_fd();
+            socket->pos = AddWaitEventToSetEx(rm_wait_set,
+                                              WL_SOCKET_READABLE,
+                                              socket->fd,
+                                              NULL,
+                                              socket);
+            Assert(socket->pos != -1);
+            uring_socket = socket;
+        }
+#else
+        ereport(LOG,
+                (errmsg("rustica-engine is built without io_uring support, "
+                        "using epoll instead")));
+#endif
+    }
+
     for (int i = 0; i < num_listen_sockets; i++) {
         if (listen_sockets[i] == PGINVALID_SOCKET)
             ereport(FATAL, (errmsg("no socket created for listening")));
         socket = &sockets[NextWaitEventPos(rm_wait_set)];
         socket->type = TYPE_FRONTEND;
         socket->fd = listen_sockets[i];
+        socket->uring_index = -1;
+#ifdef RUSTICA_IO_URING
+        if (uring_socket != NULL) {
+            // Accepted by the ring, the wait set only keeps the bookkeeping
+            socket->uring_index = i;
+            uring_listeners[i] = socket;
+        }
+#endif
         socket->pos = AddWaitEventToSetEx(rm_wait_set,
-                                          WL_SOCKET_ACCEPT,
+                                          socket->uring_index == -1
+                                              ? WL_SOCKET_ACCEPT
+                                              : WL_SOCKET_CLOSED,
                                           socket->fd,
                                           NULL,
                                           socket);
         Assert(socket->pos != -1);
+#ifdef RUSTICA_IO_URING
+        if (socket->uring_index != -1)
+            rst_uring_arm_accept(socket->uring_index);
+#endif
     }
 }
 
@@ -263,70 +363,242 @@ on_backend_connect(Socket *socket, uint32 events) {
 
 static inline void
 close_socket(Socket *socket) {
+#ifdef RUSTICA_IO_URING
+    // Queued sends may still refer to this fd, hand them to the kernel first
+    if (uring_socket != NULL && socket->type == TYPE_BACKEND)
+        rst_uring_submit();
+#endif
     DeleteWaitEventEx(rm_wait_set, socket->pos);
     StreamClose(socket->fd);
     memset(socket, 0, sizeof(Socket));
 }
 
 static inline void
-on_frontend(Socket *socket, uint32 events) {
-    pgsocket sock;
-    SockAddr addr;
-    Socket *backend;
+close_static(Socket *socket) {
+    if (socket->response->file >= 0)
+        close(socket->response->file);
+    pfree(socket->response);
+    num_static--;
+    close_socket(socket);
+}
 
-    if (!(events & WL_SOCKET_ACCEPT))
-        return;
+static inline void
+on_static(Socket *socket, uint32 events) {
+    StaticResponse *resp = socket->response;
+    ssize_t nbytes;
 
-    addr.salen = sizeof(addr.addr);
-    sock = accept(socket->fd, (struct sockaddr *)&addr.addr, &addr.salen);
-    if (sock == PGINVALID_SOCKET) {
-        ereport(LOG,
-                (errcode_for_socket_access(),
-                 errmsg("could not accept new connection: %m")));
-        pg_usleep(100000L); // wait 0.1 sec
+    if (events & WL_SOCKET_CLOSED) {
+        close_static(socket);
         return;
     }
-    ereport(DEBUG1,
-            (errmsg("accepted frontend connection fd=%d from: fd=%d",
-                    sock,
-                    socket->fd)));
-    if (Log_connections) {
-        int ret;
-        char remote_host[NI_MAXHOST];
-        char remote_port[NI_MAXSERV];
-        remote_host[0] = '\0';
-        remote_port[0] = '\0';
-        ret = pg_getnameinfo_all(&addr.addr,
-                                 addr.salen,
-                                 remote_host,
-                                 sizeof(remote_host),
-                                 remote_port,
-                                 sizeof(remote_port),
-                                 (log_hostname ? 0 : NI_NUMERICHOST)
-                                     | NI_NUMERICSERV);
-        if (ret != 0)
-            ereport(WARNING,
-                    (errmsg_internal("pg_getnameinfo_all() failed: %s",
-                                     gai_strerror(ret))));
-        ereport(LOG,
-                (errmsg("connection received: host=%s port=%s",
-                        remote_host,
-                        remote_port)));
+    if (!(events & WL_SOCKET_WRITEABLE))
+        return;
+    while (socket->head_sent < resp->head_len) {
+        nbytes = send(socket->fd,
+                      resp->head + socket->head_sent,
+                      resp->head_len - socket->head_sent,
+                      MSG_NOSIGNAL);
+        if (nbytes < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return;
+            close_static(socket);
+            return;
+        }
+        socket->head_sent += (int)nbytes;
+    }
+    while (resp->remaining > 0) {
+        nbytes = sendfile(socket->fd,
+                          resp->file,
+                          &resp->offset,
+                          Min(resp->remaining, 1 << 30));
+        if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (nbytes <= 0) {
+            ereport(DEBUG1,
+                    (errmsg("failed in sendfile fd=%d: %m", socket->fd)));
+            close_static(socket);
+            return;
+        }
+        resp->remaining -= nbytes;
+    }
+    close_static(socket);
+}
+
+// Answer the request from the static asset cache if the whole request head is
+// already there and matches a cached asset, without involving any worker.
+static bool
+serve_static(pgsocket sock) {
+    char buf[RST_ASSETS_PEEK_SIZE];
+    StaticResponse resp;
+    Socket *socket;
+    ssize_t nbytes;
+
+    if (num_static >= STATIC_QLEN)
+        return false;
+    nbytes = recv(sock, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT);
+    if (nbytes <= 0 || !rst_assets_lookup(buf, (int)nbytes, &resp))
+        return false;
+
+    // Read off the request head, which is already in the receive buffer
+    nbytes = recv(sock, buf, resp.consumed, MSG_DONTWAIT);
+    if (nbytes != resp.consumed || !pg_set_noblock(sock)) {
+        if (resp.file >= 0)
+            close(resp.file);
+        StreamClose(sock);
+        return true;
     }
+
+    socket = &sockets[NextWaitEventPos(rm_wait_set)];
+    socket->type = TYPE_STATIC;
+    socket->fd = sock;
+    socket->response = palloc(sizeof(StaticResponse));
+    memcpy(socket->response, &resp, sizeof(StaticResponse));
+    socket->head_sent = 0;
+    socket->pos = AddWaitEventToSetEx(rm_wait_set,
+                                      WL_SOCKET_WRITEABLE | WL_SOCKET_CLOSED,
+                                      sock,
+                                      NULL,
+                                      socket);
+    if (socket->pos == -1) {
+        if (resp.file >= 0)
+            close(resp.file);
+        pfree(socket->response);
+        memset(socket, 0, sizeof(Socket));
+        StreamClose(sock);
+        return true;
+    }
+    num_static++;
+    ereport(DEBUG1, (errmsg("serving static asset on fd=%d", sock)));
+    on_static(socket, WL_SOCKET_WRITEABLE);
+    return true;
+}
+
+static void
+set_accepting(bool accepting) {
+    for (int i = 0; i < total_sockets; i++) {
+        if (sockets[i].type != TYPE_FRONTEND)
+            continue;
+#ifdef RUSTICA_IO_URING
+        if (sockets[i].uring_index != -1) {
+            if (accepting)
+                rst_uring_arm_accept(sockets[i].uring_index);
+            else
+                rst_uring_cancel_accept(sockets[i].uring_index);
+            continue;
+        }
+#endif
+        ModifyWaitEventEx(rm_wait_set,
+                          sockets[i].pos,
+                          accepting ? WL_SOCKET_ACCEPT : WL_SOCKET_CLOSED,
+                          NULL);
+    }
+}
+
+static void
+dispatch_job(pgsocket sock, TimestampTz accepted_at);
+
+static void
+on_accepted(Socket *socket, pgsocket sock, SockAddr *addr);
+
+#ifdef RUSTICA_IO_URING
+// Submit the sends queued in this round and process all completions. Waits
+// until every send is done, so that failed ones can be dispatched again.
+static void
+flush_uring() {
+    UringEvent ev;
+    Socket *socket;
+
+    rst_uring_submit();
+    while (rst_uring_next_event(&ev, rst_uring_sends_in_flight() > 0)) {
+        if (ev.kind == RST_URING_SEND) {
+            if (ev.res >= 0) {
+                StreamClose(ev.job);
+            }
+            else {
+                errno = -ev.res;
+                ereport(DEBUG1,
+                        (errmsg("socket (fd=%d) is broken: %m",
+                                ev.backend_fd)));
+                socket = &sockets[ev.backend_pos];
+                if (socket->type == TYPE_BACKEND
+                    && socket->fd == ev.backend_fd)
+                    close_socket(socket);
+                dispatch_job(ev.job, ev.accepted_at);
+            }
+        }
+        else if (ev.kind == RST_URING_ACCEPT) {
+            socket = uring_listeners[ev.index];
+            if (ev.res >= 0) {
+                on_accepted(socket, ev.res, NULL);
+            }
+            else if (ev.res == -EINVAL && !ev.more) {
+                // Multishot accept needs Linux 5.19
+                ereport(LOG,
+                        (errmsg("io_uring multishot accept is not supported, "
+                                "using epoll for fd=%d",
+                                socket->fd)));
+                socket->uring_index = -1;
+                if (!frontend_paused)
+                    ModifyWaitEventEx(rm_wait_set,
+                                      socket->pos,
+                                      WL_SOCKET_ACCEPT,
+                                      NULL);
+                continue;
+            }
+            else if (ev.res != -ECANCELED) {
+                errno = -ev.res;
+                ereport(LOG,
+                        (errcode_for_socket_access(),
+                         errmsg("could not accept new connection: %m")));
+                pg_usleep(100000L); // wait 0.1 sec
+            }
+            if (!ev.more && ev.res != -ECANCELED && !frontend_paused)
+                rst_uring_arm_accept(ev.index);
+        }
+        rst_uring_submit();
+    }
+}
+#endif
+
+// Pass the job socket to the worker, which then owns it. The master's copy is
+// closed here, or once the send completes when going through io_uring.
+static bool
+send_job(Socket *backend, pgsocket job, TimestampTz accepted_at) {
+    fd_msg.job.accepted_at = accepted_at;
+    fd_msg.job.dispatched_at = GetCurrentTimestamp();
+#ifdef RUSTICA_IO_URING
+    if (uring_socket != NULL) {
+        while (!rst_uring_queue_send(backend->fd,
+                                     backend->pos,
+                                     job,
+                                     &fd_msg.job))
+            flush_uring();
+        return true;
+    }
+#endif
+    *((int *)CMSG_DATA(fd_msg.cmsg)) = job;
+    if (sendmsg(backend->fd, &fd_msg.msg, 0) < 0) {
+        ereport(DEBUG1, (errmsg("socket (fd=%d) is broken: %m", backend->fd)));
+        return false;
+    }
+    StreamClose(job);
+    return true;
+}
+
+static void
+dispatch_job(pgsocket sock, TimestampTz accepted_at) {
+    Socket *backend;
+
     while (idle_qsize > 0) {
         backend = &sockets[idle_workers[idle_qhead]];
         idle_qhead = (idle_qhead + 1) % total_sockets;
         idle_qsize -= 1;
         if (backend->type == TYPE_BACKEND) {
             Assert(backend->type == TYPE_BACKEND);
-            *((int *)CMSG_DATA(fd_msg.cmsg)) = sock;
-            if (sendmsg(backend->fd, &fd_msg.msg, 0) < 0) {
-                ereport(DEBUG1,
-                        (errmsg("socket (fd=%d) is broken: %m", backend->fd)));
+            if (!send_job(backend, sock, accepted_at)) {
                 close_socket(backend);
             }
             else {
-                StreamClose(sock);
                 ereport(DEBUG1,
                         (errmsg("dispatched job fd=%d to rustica-%d",
                                 sock,
@@ -339,7 +611,9 @@ on_frontend(Socket *socket, uint32 events) {
             }
         }
     }
-    if (idle_qsize == 0 && num_workers < max_worker_processes - 2) {
+    if (idle_qsize == 0
+        && num_workers < max_worker_processes - 2 - (hub_handle ? 1 : 0)
+                             - (assets_handle ? 1 : 0) - num_compile_workers) {
         BackgroundWorker worker;
         BackgroundWorkerHandle **handle;
 
@@ -368,21 +642,15 @@ on_frontend(Socket *socket, uint32 events) {
     }
     if (job_qsize < JOB_QLEN) {
         job_qsize++;
-        job_queue[job_qtail] = sock;
+        job_queue[job_qtail].sock = sock;
+        job_queue[job_qtail].accepted_at = accepted_at;
         job_qtail = (job_qtail + 1) % JOB_QLEN;
         if (job_qsize == JOB_QLEN) {
             ereport(DEBUG1,
                     (errmsg("job queue is full, pause accepting frontend "
                             "connections")));
             frontend_paused = true;
-            for (int i = 0; i < total_sockets; i++) {
-                if (sockets[i].type == TYPE_FRONTEND) {
-                    ModifyWaitEventEx(rm_wait_set,
-                                      sockets[i].pos,
-                                      WL_SOCKET_CLOSED,
-                                      NULL);
-                }
-            }
+            set_accepting(false);
         }
     }
     else {
@@ -391,6 +659,68 @@ on_frontend(Socket *socket, uint32 events) {
     }
 }
 
+static void
+on_accepted(Socket *socket, pgsocket sock, SockAddr *addr) {
+    SockAddr peer;
+
+    ereport(DEBUG1,
+            (errmsg("accepted frontend connection fd=%d from: fd=%d",
+                    sock,
+                    socket->fd)));
+    if (Log_connections) {
+        int ret;
+        char remote_host[NI_MAXHOST];
+        char remote_port[NI_MAXSERV];
+        remote_host[0] = '\0';
+        remote_port[0] = '\0';
+        if (addr == NULL) {
+            // io_uring accepts without the peer address
+            addr = &peer;
+            addr->salen = sizeof(addr->addr);
+            getpeername(sock, (struct sockaddr *)&addr->addr, &addr->salen);
+        }
+        ret = pg_getnameinfo_all(&addr->addr,
+                                 addr->salen,
+                                 remote_host,
+                                 sizeof(remote_host),
+                                 remote_port,
+                                 sizeof(remote_port),
+                                 (log_hostname ? 0 : NI_NUMERICHOST)
+                                     | NI_NUMERICSERV);
+        if (ret != 0)
+            ereport(WARNING,
+                    (errmsg_internal("pg_getnameinfo_all() failed: %s",
+                                     gai_strerror(ret))));
+        ereport(LOG,
+                (errmsg("connection received: host=%s port=%s",
+                        remote_host,
+                        remote_port)));
+    }
+    if (rst_static_cache && serve_static(sock))
+        return;
+    dispatch_job(sock, GetCurrentTimestamp());
+}
+
+static inline void
+on_frontend(Socket *socket, uint32 events) {
+    pgsocket sock;
+    SockAddr addr;
+
+    if (!(events & WL_SOCKET_ACCEPT))
+        return;
+
+    addr.salen = sizeof(addr.addr);
+    sock = accept(socket->fd, (struct sockaddr *)&addr.addr, &addr.salen);
+    if (sock == PGINVALID_SOCKET) {
+        ereport(LOG,
+                (errcode_for_socket_access(),
+                 errmsg("could not accept new connection: %m")));
+        pg_usleep(100000L); // wait 0.1 sec
+        return;
+    }
+    on_accepted(socket, sock, &addr);
+}
+
 static inline void
 on_backend(Socket *socket, uint32 events) {
     pgsocket job;
@@ -430,12 +760,10 @@ on_backend(Socket *socket, uint32 events) {
                 socket->read_offset = 0;
 
                 if (job_qsize > 0) {
-                    job = job_queue[job_qhead];
-                    *((int *)CMSG_DATA(fd_msg.cmsg)) = job_queue[job_qhead];
-                    if (sendmsg(socket->fd, &fd_msg.msg, 0) < 0) {
-                        ereport(DEBUG1,
-                                (errmsg("socket (fd=%d) is broken: %m",
-                                        socket->fd)));
+                    job = job_queue[job_qhead].sock;
+                    if (!send_job(socket,
+                                  job,
+                                  job_queue[job_qhead].accepted_at)) {
                         close_socket(socket);
                     }
                     else {
@@ -450,14 +778,7 @@ on_backend(Socket *socket, uint32 events) {
                                     (errmsg("resume accepting frontend "
                                             "connections")));
                             frontend_paused = false;
-                            for (i = 0; i < total_sockets; i++) {
-                                if (sockets[i].type == TYPE_FRONTEND) {
-                                    ModifyWaitEventEx(rm_wait_set,
-                                                      sockets[i].pos,
-                                                      WL_SOCKET_ACCEPT,
-                                                      NULL);
-                                }
-                            }
+                            set_accepting(true);
                         }
                     }
                 }
@@ -536,19 +857,56 @@ main_loop() {
                 on_frontend(socket, events[i].events);
             if (socket->type == TYPE_BACKEND)
                 on_backend(socket, events[i].events);
+            if (socket->type == TYPE_STATIC)
+                on_static(socket, events[i].events);
+            // TYPE_URING completions are handled below
         }
+#ifdef RUSTICA_IO_URING
+        if (uring_socket != NULL)
+            flush_uring();
+#endif
     }
 }
 
 static void
 teardown() {
     ereport(LOG, (errmsg("rustica master shutting down")));
+    if (hub_handle) {
+        TerminateBackgroundWorker(hub_handle);
+        pfree(hub_handle);
+    }
+    if (assets_handle) {
+        TerminateBackgroundWorker(assets_handle);
+        pfree(assets_handle);
+    }
+    if (compile_handles) {
+        for (int i = 0; i < rst_compile_workers; i++) {
+            if (compile_handles[i]) {
+                TerminateBackgroundWorker(compile_handles[i]);
+                pfree(compile_handles[i]);
+            }
+        }
+        pfree(compile_handles);
+    }
     pfree(worker_handles);
     pfree(idle_workers);
     FreeWaitEventSetEx(rm_wait_set);
     rm_wait_set = NULL;
 
+#ifdef RUSTICA_IO_URING
+    if (uring_socket != NULL) {
+        // The ring owns its fd
+        uring_socket->type = TYPE_UNSET;
+        uring_socket = NULL;
+        rst_uring_exit();
+    }
+#endif
     for (int i = 0; i < total_sockets; i++) {
+        if (sockets[i].type == TYPE_STATIC) {
+            if (sockets[i].response->file >= 0)
+                close(sockets[i].response->file);
+            pfree(sockets[i].response);
+        }
         if (sockets[i].type != TYPE_UNSET) {
             sockets[i].type = TYPE_UNSET;
             StreamClose(sockets[i].fd);
@@ -14,19 +14,31 @@
  * See the Mulan PSL v2 for more details.
  */
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "postgres.h"
+#include "miscadmin.h"
+#include "common/hashfn.h"
 #include "executor/spi.h"
+#include "storage/fd.h"
 #include "tcop/tcopprot.h"
 #include "utils/builtins.h"
 #include "utils/memutils.h"
 
+#include "rustica/compiler.h"
 #include "rustica/module.h"
+#include "rustica/perf_map.h"
 #include "rustica/utils.h"
 
 static SPIPlanPtr load_module_plan = NULL;
 static SPIPlanPtr load_module_queries_plan = NULL;
 static const char *load_module_sql =
-    "SELECT bin_code, heap_types FROM rustica.modules WHERE name = $1";
+    "SELECT coalesce(bin_code, byte_code), heap_types, request_timeout, "
+    "target_cpu, cpu_features, generic_bin_code FROM rustica.modules "
+    "WHERE name = $1";
 static const char *load_module_queries_sql =
     "SELECT * FROM rustica.queries WHERE module = $1 ORDER BY index";
 
@@ -36,8 +48,217 @@ create_module_with_queries(Datum name);
 static void
 load_heap_types(ArrayType *array, CommonHeapTypes *heap_types);
 
-static AOTModule *
-load_aot_module(const char *name, uint8 *bin_code, uint32_t bin_code_len);
+static wasm_module_t
+load_module(const char *name,
+            uint8 *bin_code,
+            uint32_t bin_code_len,
+            bool freeable);
+
+#define XIP_DIR "rustica_aot"
+
+// The XIP file name carries the hash and size of its content, and files are
+// only renamed into place whole; checking the first page of the mapping then
+// catches a hash collision without faulting in the whole binary.
+#define XIP_CHECK_BYTES 4096
+
+// Use the generic build if bin_code was tuned for CPU features we don't have,
+// running it would end in SIGILL.
+static bytea *
+select_bin_code(const char *name, SPITupleTable *tuptable, Datum bin_code) {
+    char *cpu = SPI_getvalue(tuptable->vals[0], tuptable->tupdesc, 4);
+    char *features = SPI_getvalue(tuptable->vals[0], tuptable->tupdesc, 5);
+    bool isnull;
+    Datum generic;
+
+    if (rst_compile_target_supported(cpu, features))
+        return DatumGetByteaPP(bin_code);
+    generic = SPI_getbinval(tuptable->vals[0], tuptable->tupdesc, 6, &isnull);
+    if (isnull)
+        ereport(ERROR,
+                errmsg("module \"%s\" was compiled for CPU \"%s\" (%s), "
+                       "which this server does not support",
+                       name,
+                       cpu ? cpu : "generic",
+                       features ? features : "no extra features"));
+    ereport(DEBUG1,
+            errmsg("module \"%s\" is tuned for another CPU, using the "
+                   "generic build",
+                   name));
+    return DatumGetByteaPP(generic);
+}
+
+static uint64
+xip_hash(const uint8 *code, uint32 size) {
+    return (uint64)hash_bytes_extended(code, size, 0);
+}
+
+static int
+write_xip(const char *file_name, uint8 *code, uint32 size) {
+    char tmp_name[MAXPGPATH];
+    int fd;
+
+    if (MakePGDirectory(XIP_DIR) < 0 && errno != EEXIST)
+        return -1;
+    snprintf(tmp_name, MAXPGPATH, "%s.tmp.%d", file_name, MyProcPid);
+    fd = OpenTransientFile(tmp_name, O_WRONLY | O_CREAT | O_TRUNC);
+    if (fd < 0)
+        return -1;
+    if (write(fd, code, size) != size) {
+        CloseTransientFile(fd);
+        unlink(tmp_name);
+        return -1;
+    }
+    CloseTransientFile(fd);
+    if (rename(tmp_name, file_name) < 0) {
+        unlink(tmp_name);
+        return -1;
+    }
+    return OpenTransientFile(file_name, O_RDONLY);
+}
+
+// XIP binaries run where they are, without relocation, so they must be in
+// executable memory. Map them from a file named after the content, so that
+// all workers share the pages through the page cache. Returns NULL for
+// ordinary binaries, which the loader copies and relocates.
+static uint8 *
+map_xip(bytea *bin_code) {
+    uint8 *code = (uint8 *)VARDATA_ANY(bin_code);
+    uint32 size = VARSIZE_ANY_EXHDR(bin_code);
+    char file_name[MAXPGPATH];
+    struct stat st;
+    void *map;
+    int fd;
+
+    if (!wasm_runtime_is_xip_file(code, size))
+        return NULL;
+
+    // Same flags as iwasm uses for XIP; pages stay shared until written
+    snprintf(file_name,
+             MAXPGPATH,
+             XIP_DIR "/%016llx-%u",
+             (unsigned long long)xip_hash(code, size),
+             size);
+    fd = OpenTransientFile(file_name, O_RDONLY);
+    if (fd >= 0 && (fstat(fd, &st) < 0 || st.st_size != size)) {
+        CloseTransientFile(fd);
+        fd = -1;
+    }
+    if (fd < 0)
+        fd = write_xip(file_name, code, size);
+    if (fd >= 0) {
+        map = mmap(NULL,
+                   size,
+                   PROT_READ | PROT_WRITE | PROT_EXEC,
+                   MAP_PRIVATE | MAP_32BIT,
+                   fd,
+                   0);
+        CloseTransientFile(fd);
+        if (map != MAP_FAILED
+            && memcmp(map, code, Min(size, XIP_CHECK_BYTES)) == 0)
+            return map;
+        if (map != MAP_FAILED)
+            munmap(map, size);
+    }
+
+    // Fall back to a private copy
+    ereport(DEBUG1,
+            errmsg("could not map XIP file \"%s\", copying it", file_name));
+    map = mmap(NULL,
+               size,
+               PROT_READ | PROT_WRITE | PROT_EXEC,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT,
+               -1,
+               0);
+    if (map == MAP_FAILED)
+        ereport(ERROR, errmsg("could not map XIP binary: %m"));
+    memcpy(map, code, size);
+    return map;
+}
+
+static int
+uint64_cmp(const void *a, const void *b) {
+    uint64 x = *(const uint64 *)a, y = *(const uint64 *)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Runs with SPI connected: remove the XIP files of binaries that are neither
+// deployed nor in the AOT cache, left behind by recompiles and dropped
+// modules. Workers that have one mapped keep their pages, and a worker that
+// still loads an old binary writes its file again.
+void
+rst_module_sweep_xip() {
+    DIR *dir = AllocateDir(XIP_DIR);
+    struct dirent *de;
+    Portal portal;
+    uint64 *hashes;
+    uint64 n = 0, capacity = 64;
+    bool isnull;
+    int removed = 0;
+
+    if (dir == NULL && errno == ENOENT)
+        return;
+
+    // One binary at a time, they can be large
+    hashes = palloc(sizeof(uint64) * capacity);
+    portal = SPI_cursor_open_with_args(
+        NULL,
+        "SELECT bin_code FROM rustica.modules "
+        "UNION ALL SELECT generic_bin_code FROM rustica.modules "
+        "UNION ALL SELECT bin_code FROM rustica.aot_cache "
+        "UNION ALL SELECT generic_bin_code FROM rustica.aot_cache",
+        0,
+        NULL,
+        NULL,
+        NULL,
+        true,
+        0);
+    for (;;) {
+        SPI_cursor_fetch(portal, true, 1);
+        if (SPI_processed == 0)
+            break;
+        Datum datum = SPI_getbinval(SPI_tuptable->vals[0],
+                                    SPI_tuptable->tupdesc,
+                                    1,
+                                    &isnull);
+        if (!isnull) {
+            bytea *bin_code = DatumGetByteaPP(datum);
+            uint8 *code = (uint8 *)VARDATA_ANY(bin_code);
+            uint32 size = VARSIZE_ANY_EXHDR(bin_code);
+            if (wasm_runtime_is_xip_file(code, size)) {
+                if (n == capacity) {
+                    capacity *= 2;
+                    hashes = repalloc(hashes, sizeof(uint64) * capacity);
+                }
+                hashes[n++] = xip_hash(code, size);
+            }
+            if ((Pointer)bin_code != DatumGetPointer(datum))
+                pfree(bin_code);
+        }
+        SPI_freetuptable(SPI_tuptable);
+    }
+    SPI_cursor_close(portal);
+    qsort(hashes, n, sizeof(uint64), uint64_cmp);
+
+    // Named <hash>-<size>, or <hash>-<size>.tmp.<pid> while being written
+    while ((de = ReadDir(dir, XIP_DIR)) != NULL) {
+        char *endptr;
+        char file_name[MAXPGPATH];
+        if (strlen(de->d_name) < 18 || de->d_name[16] != '-'
+            || strchr(de->d_name, '.'))
+            continue;
+        uint64 hash = strtoull(de->d_name, &endptr, 16);
+        if (endptr != de->d_name + 16
+            || bsearch(&hash, hashes, n, sizeof(uint64), uint64_cmp))
+            continue;
+        snprintf(file_name, MAXPGPATH, XIP_DIR "/%s", de->d_name);
+        if (unlink(file_name) == 0)
+            removed++;
+    }
+    FreeDir(dir);
+    pfree(hashes);
+    if (removed > 0)
+        ereport(DEBUG1, errmsg("removed %d unused XIP files", removed));
+}
 
 void
 rst_module_worker_startup() {
@@ -109,25 +330,46 @@ rst_prepare_module(const char *name, uint8 **buffer, uint32 *size) {
             Datum datum =
                 SPI_getbinval(tuptable->vals[0], tuptable->tupdesc, 1, &isnull);
             Assert(!isnull);
-            bytea *bin_code = DatumGetByteaPP(datum);
+            bytea *bin_code = select_bin_code(name, tuptable, datum);
             datum =
                 SPI_getbinval(tuptable->vals[0], tuptable->tupdesc, 2, &isnull);
             Assert(!isnull);
             ArrayType *heap_types = DatumGetArrayTypeP(datum);
+            datum =
+                SPI_getbinval(tuptable->vals[0], tuptable->tupdesc, 3, &isnull);
+            pmod->request_timeout = isnull ? -1 : DatumGetInt32(datum);
+            pmod->loaded_at = GetCurrentTimestamp();
             debug_query_string = NULL;
 
             // Load heap_types and the actual WASM module
             load_heap_types(heap_types, &pmod->heap_types);
+            uint8 *code = (uint8 *)VARDATA_ANY(bin_code);
+            uint32 code_size = VARSIZE_ANY_EXHDR(bin_code);
+            if (get_package_type(code, code_size) == Wasm_Module_Bytecode) {
+                // Not compiled yet, so the interpreter runs byte_code, which
+                // it rewrites while loading and executes in place.
+                pmod->interpreted = true;
+                pmod->code = MemoryContextAlloc(TopMemoryContext, code_size);
+                memcpy(pmod->code, code, code_size);
+            }
+            else
+                pmod->code = map_xip(bin_code);
+            if (pmod->code) {
+                code = pmod->code;
+                pmod->code_size = code_size;
+            }
             if (buffer) {
                 Assert(size != NULL);
-                *buffer = (uint8 *)VARDATA_ANY(bin_code);
-                *size = VARSIZE_ANY_EXHDR(bin_code);
+                *buffer = code;
+                *size = code_size;
                 pmod->loading_tuptable = tuptable;
             }
             else {
-                pmod->module = load_aot_module((const char *)pmod,
-                                               (uint8 *)VARDATA_ANY(bin_code),
-                                               VARSIZE_ANY_EXHDR(bin_code));
+                pmod->module = load_module((const char *)pmod,
+                                           code,
+                                           code_size,
+                                           pmod->code == NULL);
+                rst_perf_map_add(pmod);
                 SPI_freetuptable(tuptable);
                 tuptable = NULL;
             }
@@ -166,9 +408,13 @@ rst_free_module(PreparedModule *pmod) {
     for (int i = 0; i < pmod->nqueries; i++)
         rst_free_query_plan(&pmod->queries[i]);
     if (pmod->module) {
-        wasm_runtime_unregister_module((wasm_module_t)pmod->module);
-        aot_unload(pmod->module);
+        rst_perf_map_remove(pmod);
+        wasm_runtime_unregister_and_unload(pmod->module);
     }
+    if (pmod->code && pmod->interpreted)
+        pfree(pmod->code);
+    else if (pmod->code)
+        munmap(pmod->code, pmod->code_size);
     if (pmod->loading_tuptable)
         SPI_freetuptable(pmod->loading_tuptable);
     pfree(pmod);
@@ -182,7 +428,7 @@ rst_module_instantiate(PreparedModule *pmod,
 
     // Instantiate the WASM module
     wasm_module_inst_t instance =
-        wasm_runtime_instantiate((wasm_module_t)pmod->module,
+        wasm_runtime_instantiate(pmod->module,
                                  stack_size,
                                  heap_size,
                                  ERROR_BUF_PARAMS);
@@ -287,33 +533,42 @@ load_heap_types(ArrayType *array, CommonHeapTypes *heap_types) {
     pfree(datums);
 }
 
-static AOTModule *
-load_aot_module(const char *name, uint8 *bin_code, uint32_t bin_code_len) {
+// Preload rtt_types of an AoT or bytecode module, they have the same fields
+#define PRELOAD_RTT_TYPES(m)                                                   \
+    do {                                                                       \
+        for (uint32 i = 0; i < (m)->type_count; i++) {                         \
+            if (!wasm_rtt_type_new((m)->types[i],                              \
+                                   i,                                          \
+                                   (m)->rtt_types,                             \
+                                   (m)->type_count,                            \
+                                   &(m)->rtt_type_lock))                       \
+                ereport(ERROR, errmsg("failed to create rtt object"));         \
+        }                                                                      \
+    } while (0)
+
+static wasm_module_t
+load_module(const char *name,
+            uint8 *bin_code,
+            uint32_t bin_code_len,
+            bool freeable) {
     DECLARE_ERROR_BUF(128);
 
     // Load the WASM module
-    LoadArgs load_args = { .name = (char *)name, .wasm_binary_freeable = true };
-    AOTModule *aot_module = NULL;
+    LoadArgs load_args = { .name = (char *)name,
+                           .wasm_binary_freeable = freeable };
+    wasm_module_t module = NULL;
     MemoryContext tx_mctx = MemoryContextSwitchTo(TopMemoryContext);
     PG_TRY();
     {
-        wasm_module_t module = wasm_runtime_load_ex(bin_code,
-                                                    bin_code_len,
-                                                    &load_args,
-                                                    ERROR_BUF_PARAMS);
+        module = wasm_runtime_load_ex(bin_code,
+                                      bin_code_len,
+                                      &load_args,
+                                      ERROR_BUF_PARAMS);
         if (!module)
             ereport(ERROR,
                     errmsg("bad WASM bin_code of module \"%s\": %s",
                            name,
                            ERROR_BUF));
-        if (module->module_type == Wasm_Module_Bytecode) {
-            wasm_unload((WASMModule *)module);
-            ereport(ERROR,
-                    errmsg("WASM bin_code of module \"%s\" is not AoT-compiled",
-                           name));
-        }
-        Assert(module->module_type == Wasm_Module_AoT);
-        aot_module = (AOTModule *)module;
 
         PG_TRY(2);
         {
@@ -322,14 +577,10 @@ load_aot_module(const char *name, uint8 *bin_code, uint32_t bin_code_len) {
             // popping transactional memory context, potential crashes can
             // occur. To resolve this issue, we preload all rtt_type objects
             // within the TopMemoryContext.
-            for (uint32 i = 0; i < aot_module->type_count; i++) {
-                if (!wasm_rtt_type_new(aot_module->types[i],
-                                       i,
-                                       aot_module->rtt_types,
-                                       aot_module->type_count,
-                                       &aot_module->rtt_type_lock))
-                    ereport(ERROR, errmsg("failed to create rtt object"));
-            }
+            if (module->module_type == Wasm_Module_AoT)
+                PRELOAD_RTT_TYPES((AOTModule *)module);
+            else
+                PRELOAD_RTT_TYPES((WASMModule *)module);
             if (!wasm_runtime_register_module(name, module, ERROR_BUF_PARAMS))
                 ereport(ERROR,
                         errmsg("cannot register module \"%s\": %s",
@@ -338,7 +589,7 @@ load_aot_module(const char *name, uint8 *bin_code, uint32_t bin_code_len) {
         }
         PG_CATCH(2);
         {
-            aot_unload(aot_module);
+            wasm_runtime_unregister_and_unload(module);
             PG_RE_THROW();
         }
         PG_END_TRY(2);
@@ -349,5 +600,5 @@ load_aot_module(const char *name, uint8 *bin_code, uint32_t bin_code_len) {
     }
     PG_END_TRY();
 
-    return aot_module;
+    return module;
 }
@@ -19,6 +19,7 @@
 
 #include "postgres.h"
 #include "executor/spi.h"
+#include "utils/timestamp.h"
 
 #include "aot_runtime.h"
 
@@ -29,9 +30,15 @@
 
 typedef struct PreparedModule {
     char name[RST_MODULE_NAME_MAXLEN + 1];
-    AOTModule *module;
+    wasm_module_t module;
+    bool interpreted; // running byte_code until bin_code is compiled
+    uint8 *code; // XIP mapping or bytecode copy, NULL if the loader has a copy
+    uint32 code_size;
     SPITupleTable *loading_tuptable;
     CommonHeapTypes heap_types;
+    int request_timeout; // ms, or -1 to use rustica.request_timeout
+    TimestampTz loaded_at;
+    int pgo_requests; // since the profile was saved, -1 if not instrumented
     int nqueries;
     QueryPlan queries[];
 } PreparedModule;
@@ -42,6 +49,9 @@ rst_module_worker_startup();
 void
 rst_module_worker_teardown();
 
+void
+rst_module_sweep_xip();
+
 PreparedModule *
 rst_prepare_module(const char *name, uint8 **buffer, uint32 *size);
 
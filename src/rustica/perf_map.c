@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2026-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "postgres.h"
+#include "miscadmin.h"
+#include "lib/stringinfo.h"
+#include "nodes/pg_list.h"
+#include "storage/fd.h"
+#include "utils/memutils.h"
+
+#include "rustica/gucs.h"
+#include "rustica/perf_map.h"
+
+typedef struct FuncAddr {
+    uintptr_t addr;
+    uint32 index;
+} FuncAddr;
+
+// AoT modules in the perf map of this worker
+static List *mapped_modules = NIL;
+
+static int
+compare_func_addr(const void *a, const void *b) {
+    uintptr_t x = ((const FuncAddr *)a)->addr;
+    uintptr_t y = ((const FuncAddr *)b)->addr;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// The names from the module's name section, sorted by function index
+static const char *
+func_name(AOTModule *module, uint32 func_index) {
+    uint32 low = 0, high = module->aux_func_name_count;
+
+    while (low < high) {
+        uint32 mid = low + (high - low) / 2;
+        if (module->aux_func_indexes[mid] == func_index)
+            return module->aux_func_names[mid];
+        if (module->aux_func_indexes[mid] < func_index)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return NULL;
+}
+
+// One "START SIZE symbol" line per function, in hex. The sizes follow from
+// where the next function starts, the last one ends with the text section.
+static void
+write_module(StringInfo buf, PreparedModule *pmod) {
+    AOTModule *module = (AOTModule *)pmod->module;
+    uintptr_t end = (uintptr_t)module->code + module->code_size;
+    FuncAddr *funcs = palloc(sizeof(FuncAddr) * module->func_count);
+
+    for (uint32 i = 0; i < module->func_count; i++) {
+        funcs[i].addr = (uintptr_t)module->func_ptrs[i];
+        funcs[i].index = i + module->import_func_count;
+    }
+    qsort(funcs, module->func_count, sizeof(FuncAddr), compare_func_addr);
+    for (uint32 i = 0; i < module->func_count; i++) {
+        uintptr_t next = i + 1 < module->func_count ? funcs[i + 1].addr : end;
+        const char *name = func_name(module, funcs[i].index);
+        if (name)
+            appendStringInfo(buf,
+                             "%lx %lx %s::%s\n",
+                             (unsigned long)funcs[i].addr,
+                             (unsigned long)(next - funcs[i].addr),
+                             pmod->name,
+                             name);
+        else
+            appendStringInfo(buf,
+                             "%lx %lx %s::func[%u]\n",
+                             (unsigned long)funcs[i].addr,
+                             (unsigned long)(next - funcs[i].addr),
+                             pmod->name,
+                             funcs[i].index);
+    }
+    pfree(funcs);
+}
+
+// perf reads /tmp/perf-<pid>.map when it reports, so the file always lists
+// the modules that are loaded right now. Code of an unloaded module is gone,
+// and its addresses may be reused by the next one. /tmp is shared with other
+// users, so the map is written to a fresh file that no symlink can redirect,
+// and renamed over the old one; perf never sees a partial map either.
+static void
+rewrite_map() {
+    char path[MAXPGPATH];
+    char tmp_path[MAXPGPATH];
+    StringInfoData buf;
+    ListCell *lc;
+    int fd;
+
+    snprintf(path, MAXPGPATH, "/tmp/perf-%d.map", MyProcPid);
+    if (mapped_modules == NIL) {
+        unlink(path);
+        return;
+    }
+    initStringInfo(&buf);
+    foreach (lc, mapped_modules)
+        write_module(&buf, (PreparedModule *)lfirst(lc));
+
+    snprintf(tmp_path, MAXPGPATH, "%s.tmp", path);
+    unlink(tmp_path);
+    fd = OpenTransientFilePerm(tmp_path,
+                               O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW,
+                               0644);
+    if (fd < 0) {
+        ereport(WARNING,
+                errcode_for_file_access(),
+                errmsg("could not create perf map \"%s\": %m", tmp_path));
+        pfree(buf.data);
+        return;
+    }
+    if (write(fd, buf.data, buf.len) != buf.len) {
+        ereport(WARNING,
+                errcode_for_file_access(),
+                errmsg("could not write perf map \"%s\": %m", tmp_path));
+        CloseTransientFile(fd);
+        unlink(tmp_path);
+    }
+    else if (CloseTransientFile(fd) != 0 || rename(tmp_path, path) != 0) {
+        ereport(WARNING,
+                errcode_for_file_access(),
+                errmsg("could not write perf map \"%s\": %m", path));
+        unlink(tmp_path);
+    }
+    pfree(buf.data);
+}
+
+void
+rst_perf_map_add(PreparedModule *pmod) {
+    MemoryContext mctx;
+
+    if (!rst_perf_map || pmod->module->module_type != Wasm_Module_AoT)
+        return;
+    mctx = MemoryContextSwitchTo(TopMemoryContext);
+    mapped_modules = lappend(mapped_modules, pmod);
+    MemoryContextSwitchTo(mctx);
+    rewrite_map();
+}
+
+void
+rst_perf_map_remove(PreparedModule *pmod) {
+    if (!list_member_ptr(mapped_modules, pmod))
+        return;
+    mapped_modules = list_delete_ptr(mapped_modules, pmod);
+    rewrite_map();
+}
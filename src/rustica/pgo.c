@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2026-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "postgres.h"
+#include "miscadmin.h"
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "catalog/pg_type_d.h"
+#include "executor/spi.h"
+#include "storage/fd.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+
+#include "rustica/gucs.h"
+#include "rustica/pgo.h"
+
+// PostgreSQL removes leftovers in there at startup
+#define PGO_TEMP_DIR "base/" PG_TEMP_FILES_DIR
+
+static char *
+temp_path(const char *name) {
+    return psprintf(PGO_TEMP_DIR "/" PG_TEMP_FILE_PREFIX "_rustica_%d_%s",
+                    MyProcPid,
+                    name);
+}
+
+char *
+rst_pgo_write_temp_file(const char *name, const char *data, int size) {
+    char *path = temp_path(name);
+    int fd;
+
+    if (MakePGDirectory(PGO_TEMP_DIR) < 0 && errno != EEXIST)
+        ereport(ERROR,
+                errcode_for_file_access(),
+                errmsg("could not create directory \"%s\": %m",
+                       PGO_TEMP_DIR));
+    fd = OpenTransientFile(path, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY);
+    if (fd < 0)
+        ereport(ERROR,
+                errcode_for_file_access(),
+                errmsg("could not create file \"%s\": %m", path));
+    if (write(fd, data, size) != size) {
+        CloseTransientFile(fd);
+        unlink(path);
+        ereport(ERROR,
+                errcode_for_file_access(),
+                errmsg("could not write file \"%s\": %m", path));
+    }
+    if (CloseTransientFile(fd) != 0)
+        ereport(ERROR,
+                errcode_for_file_access(),
+                errmsg("could not close file \"%s\": %m", path));
+    return path;
+}
+
+static bytea *
+read_file(const char *path) {
+    struct stat st;
+    bytea *rv;
+    int fd = OpenTransientFile(path, O_RDONLY | PG_BINARY);
+
+    if (fd < 0)
+        ereport(ERROR,
+                errcode_for_file_access(),
+                errmsg("could not open file \"%s\": %m", path));
+    if (fstat(fd, &st) < 0)
+        ereport(ERROR,
+                errcode_for_file_access(),
+                errmsg("could not stat file \"%s\": %m", path));
+    rv = (bytea *)palloc(VARHDRSZ + st.st_size);
+    if (read(fd, VARDATA(rv), st.st_size) != st.st_size)
+        ereport(ERROR,
+                errcode_for_file_access(),
+                errmsg("could not read file \"%s\": %m", path));
+    SET_VARSIZE(rv, VARHDRSZ + st.st_size);
+    CloseTransientFile(fd);
+    return rv;
+}
+
+// Merge the raw profiles the workers saved for a module into the indexed
+// profile that LLVM reads. There is no C API for it, so llvm-profdata does it.
+Datum
+rst_pgo_merge(PG_FUNCTION_ARGS) {
+    Datum name = PG_GETARG_DATUM(0);
+    MemoryContext mctx = CurrentMemoryContext;
+    List *volatile files = NIL;
+    char *volatile output = NULL;
+    StringInfoData cmd;
+    ListCell *lc;
+    bytea *rv;
+    bool isnull;
+    int rc;
+
+    PG_TRY();
+    {
+        SPI_connect();
+        SPI_execute_with_args("SELECT raw_profile FROM rustica.aot_profiles "
+                              "WHERE module = $1",
+                              1,
+                              (Oid[1]){ TEXTOID },
+                              &name,
+                              NULL,
+                              true,
+                              0);
+        if (SPI_processed == 0)
+            ereport(ERROR,
+                    errcode(ERRCODE_NO_DATA_FOUND),
+                    errmsg("no profile was collected for module \"%s\"",
+                           TextDatumGetCString(name)));
+        MemoryContextSwitchTo(mctx);
+        for (uint64 i = 0; i < SPI_processed; i++) {
+            bytea *raw = DatumGetByteaPP(SPI_getbinval(SPI_tuptable->vals[i],
+                                                       SPI_tuptable->tupdesc,
+                                                       1,
+                                                       &isnull));
+            char *file_name =
+                psprintf("%llu.profraw", (unsigned long long)i);
+            files = lappend(files,
+                            rst_pgo_write_temp_file(file_name,
+                                                    VARDATA_ANY(raw),
+                                                    VARSIZE_ANY_EXHDR(raw)));
+        }
+        SPI_finish();
+
+        output = temp_path("merged.profdata");
+        initStringInfo(&cmd);
+        appendStringInfo(&cmd,
+                         "\"%s\" merge --output=\"%s\"",
+                         rst_llvm_profdata,
+                         output);
+        foreach (lc, files)
+            appendStringInfo(&cmd, " \"%s\"", (char *)lfirst(lc));
+        fflush(NULL);
+        rc = system(cmd.data);
+        if (rc != 0)
+            ereport(ERROR,
+                    errmsg("could not merge profiles of module \"%s\": %s",
+                           TextDatumGetCString(name),
+                           wait_result_to_str(rc)),
+                    errdetail("The failed command was: %s", cmd.data));
+        rv = read_file(output);
+    }
+    PG_FINALLY();
+    {
+        foreach (lc, files)
+            unlink((char *)lfirst(lc));
+        if (output)
+            unlink(output);
+    }
+    PG_END_TRY();
+
+    PG_RETURN_BYTEA_P(rv);
+}
+
+#if WASM_ENABLE_AOT_PGO != 0
+// Modules compiled with rustica.pgo_instrument have profile counters in a data
+// section of the module, shared by all its instances.
+static bool
+is_instrumented(wasm_module_t module) {
+    AOTModule *aot_module = (AOTModule *)module;
+
+    if (module->module_type != Wasm_Module_AoT)
+        return false;
+    for (uint32 i = 0; i < aot_module->data_section_count; i++)
+        if (strncmp(aot_module->data_sections[i].name, "__llvm_prf_cnts", 15)
+            == 0)
+            return true;
+    return false;
+}
+
+// The profile dumped by the last request, saved once that request commits
+static char *pending_module = NULL;
+static TimestampTz pending_loaded_at;
+static bytea *pending_profile = NULL;
+
+static void
+discard_pending_profile() {
+    if (pending_module)
+        pfree(pending_module);
+    if (pending_profile)
+        pfree(pending_profile);
+    pending_module = NULL;
+    pending_profile = NULL;
+}
+
+// Dump the counters of an instrumented module every
+// rustica.pgo_flush_requests requests, for rst_pgo_flush() to save after the
+// request. They add up since the module was loaded, so each worker overwrites
+// one row per module load.
+void
+rst_pgo_collect(PreparedModule *pmod, wasm_module_inst_t instance) {
+    uint32 size;
+    bytea *raw;
+
+    if (pmod->pgo_requests < 0)
+        return;
+    if (pmod->pgo_requests == 0 && !is_instrumented(pmod->module)) {
+        pmod->pgo_requests = -1;
+        return;
+    }
+    if (++pmod->pgo_requests < rst_pgo_flush_requests || RecoveryInProgress())
+        return;
+    pmod->pgo_requests = 0;
+
+    discard_pending_profile();
+    size = wasm_runtime_get_pgo_prof_data_size(instance);
+    raw = (bytea *)MemoryContextAlloc(TopMemoryContext, VARHDRSZ + size);
+    size = wasm_runtime_dump_pgo_prof_data_to_buf(instance, VARDATA(raw), size);
+    if (size == 0) {
+        pfree(raw);
+        return;
+    }
+    SET_VARSIZE(raw, VARHDRSZ + size);
+    pending_module = MemoryContextStrdup(TopMemoryContext, pmod->name);
+    pending_loaded_at = pmod->loaded_at;
+    pending_profile = raw;
+}
+
+// Save the profile dumped by rst_pgo_collect() in a transaction of its own,
+// called once the request committed. Profiles are best effort: a failure is
+// logged and never reaches the request or the worker.
+void
+rst_pgo_flush() {
+    MemoryContext mctx = CurrentMemoryContext;
+    ErrorData *edata;
+
+    if (pending_profile == NULL)
+        return;
+    PG_TRY();
+    {
+        SetCurrentStatementStartTimestamp();
+        StartTransactionCommand();
+        SPI_connect();
+        PushActiveSnapshot(GetTransactionSnapshot());
+        SPI_execute_with_args(
+            "INSERT INTO rustica.aot_profiles "
+            "    (module, worker_pid, loaded_at, raw_profile) "
+            "VALUES ($1, pg_backend_pid(), $2, $3) "
+            "ON CONFLICT (module, worker_pid, loaded_at) DO UPDATE SET "
+            "    raw_profile = EXCLUDED.raw_profile, "
+            "    updated_at = now()",
+            3,
+            (Oid[3]){ TEXTOID, TIMESTAMPTZOID, BYTEAOID },
+            (Datum[3]){ CStringGetTextDatum(pending_module),
+                        TimestampTzGetDatum(pending_loaded_at),
+                        PointerGetDatum(pending_profile) },
+            NULL,
+            false,
+            0);
+        SPI_finish();
+        PopActiveSnapshot();
+        CommitTransactionCommand();
+    }
+    PG_CATCH();
+    {
+        MemoryContextSwitchTo(mctx);
+        edata = CopyErrorData();
+        FlushErrorState();
+        AbortCurrentTransaction();
+        ereport(LOG,
+                errmsg("could not save profile of module \"%s\": %s",
+                       pending_module,
+                       edata->message));
+        FreeErrorData(edata);
+    }
+    PG_END_TRY();
+    discard_pending_profile();
+}
+#endif
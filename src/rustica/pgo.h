@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2026-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#ifndef RUSTICA_PGO_H
+#define RUSTICA_PGO_H
+
+#include "postgres.h"
+#include "fmgr.h"
+
+#include "rustica/module.h"
+
+char *
+rst_pgo_write_temp_file(const char *name, const char *data, int size);
+
+Datum
+rst_pgo_merge(PG_FUNCTION_ARGS);
+
+#if WASM_ENABLE_AOT_PGO != 0
+void
+rst_pgo_collect(PreparedModule *pmod, wasm_module_inst_t instance);
+
+void
+rst_pgo_flush();
+#endif
+
+#endif /* RUSTICA_PGO_H */
@@ -19,6 +19,7 @@
 #include "utils/builtins.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
+#include "utils/timestamp.h"
 #include "tcop/utility.h"
 
 #include "wasm_runtime_common.h"
@@ -26,6 +27,7 @@
 #include "rustica/datatypes.h"
 #include "rustica/module.h"
 #include "rustica/query.h"
+#include "rustica/stats.h"
 
 static RST_WASM_TO_PG_RET
 wasm_i32_to_pg_bool(RST_WASM_TO_PG_ARGS) {
@@ -491,6 +493,7 @@ env_execute_statement(wasm_exec_env_t exec_env, int32_t idx) {
     ereport(DEBUG1, (errmsg("execute sql: #%d", idx)));
 
     // Take out the QueryPlan
+    TimestampTz start = GetCurrentTimestamp();
     Context *ctx = (Context *)wasm_runtime_get_user_data(exec_env);
     if (idx < 0 || idx >= ctx->module->nqueries)
         ereport(ERROR, errmsg("no such query: #%d", idx));
@@ -509,7 +512,10 @@ env_execute_statement(wasm_exec_env_t exec_env, int32_t idx) {
         wasm_struct_obj_get_field(args, i, false, &val);
         values[i] = plan->wasm_to_pg_funcs[i](exec_env, plan->argtypes[i], val);
     }
+    TimestampTz args_done = GetCurrentTimestamp();
     SPI_execute_plan(plan->plan, values, NULL, false, 0);
+    TimestampTz executed = GetCurrentTimestamp();
+    uint64 rows = SPI_processed;
 
     if (plan->nattrs) {
         obj_t obj = rst_obj_new(exec_env, OBJ_TUPLE_TABLE, NULL, 0);
@@ -568,5 +574,14 @@ env_execute_statement(wasm_exec_env_t exec_env, int32_t idx) {
         wasm_runtime_remove_local_obj_ref(exec_env, &local_ref);
     }
 
+    TimestampTz end = GetCurrentTimestamp();
+    rst_stats_record(ctx->module->name, RST_PHASE_STATEMENT, start, end);
+    rst_stats_record_query(ctx->module,
+                           idx,
+                           rows,
+                           start,
+                           args_done,
+                           executed,
+                           end);
     return 1;
 }
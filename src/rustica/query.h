@@ -18,6 +18,7 @@
 #define RUSTICA_QUERY_H
 
 #include "postgres.h"
+#include "datatype/timestamp.h"
 #include "executor/spi.h"
 #include "storage/latch.h"
 
@@ -25,6 +26,11 @@
 
 #include "wasm_runtime_common.h"
 
+#include "rustica/http.h"
+#include "rustica/io.h"
+#include "rustica/response_cache.h"
+#include "rustica/singleflight.h"
+
 #define RST_WASM_TO_PG_ARGS \
     wasm_exec_env_t exec_env, Oid oid, const wasm_value_t value
 #define RST_WASM_TO_PG_RET Datum
@@ -35,9 +41,19 @@
 
 typedef struct PreparedModule PreparedModule;
 
+// Timing of the requests on a connection for rustica.stat_phases
+typedef struct RequestTiming {
+    TimestampTz accepted_at; // by the master, 0 after the first request
+    TimestampTz dispatched_at;
+    TimestampTz received_at;
+    const char *module; // of the last request
+} RequestTiming;
+
 typedef struct Context {
     WaitEventSet *wait_set;
     pgsocket fd;
+    IoState io;
+    RequestTiming timing;
 
     llhttp_t http_parser;
     llhttp_settings_t http_settings;
@@ -58,6 +74,21 @@ typedef struct Context {
     wasm_function_inst_t on_body;
     wasm_function_inst_t on_message_complete;
     wasm_function_inst_t on_error;
+    wasm_function_inst_t on_request;
+    HttpRequestHead request;
+    HttpResponse response;
+    HttpSentHead sent;
+    bool keep_alive;
+    bool message_complete;
+    const char *volatile abort_reason; // set by the watchdog timers
+    int abort_counter;
+    TimestampTz aborted_at;
+
+    int sf_slot;
+
+    int rc_key_len;
+    StringInfoData rc_resp;
+    char rc_key[RST_RESPONSE_CACHE_KEY_MAXLEN];
 
     PreparedModule *module;
     wasm_struct_obj_t queries;
@@ -88,6 +119,7 @@ typedef struct QueryPlan {
     wasm_ref_type_t *ret_field_types;
     WASM2PGFunc *wasm_to_pg_funcs;
     PG2WASMFunc *pg_to_wasm_funcs;
+    struct QueryEntry *stat_entry; // cached by rst_stats_record_query()
 } QueryPlan;
 
 void
@@ -0,0 +1,446 @@
+/*
+ * Copyright (c) 2026-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#include "postgres.h"
+#include "commands/async.h"
+#include "common/hashfn.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/timestamp.h"
+
+#include "rustica/gucs.h"
+#include "rustica/http.h"
+#include "rustica/response_cache.h"
+
+// An entry is looked up in this many slots following its hash position, and
+// the one expiring first is replaced when they are all taken.
+#define RC_PROBES 8
+#define RC_TAGS_MAXLEN 256
+
+typedef struct CacheEntry {
+    uint32 hash;
+    int key_len; // 0 when the entry is free
+    TimestampTz expires;
+    int tags_len;
+    int resp_len;
+    char key[RST_RESPONSE_CACHE_KEY_MAXLEN];
+    char tags[RC_TAGS_MAXLEN]; // space-separated, with surrounding spaces
+    char resp[FLEXIBLE_ARRAY_MEMBER];
+} CacheEntry;
+
+typedef struct CacheShared {
+    LWLock *lock;
+    int nslots;
+    Size slot_size;
+    char slots[FLEXIBLE_ARRAY_MEMBER];
+} CacheShared;
+
+static CacheShared *shared = NULL;
+
+#define ENTRY(i) ((CacheEntry *)(shared->slots + (i) * shared->slot_size))
+#define ENTRY_CAPACITY (shared->slot_size - offsetof(CacheEntry, resp))
+#define HEADER_IS(name, len, lit) \
+    ((len) == sizeof(lit) - 1 && pg_strncasecmp(name, lit, len) == 0)
+
+static Size
+slot_size() {
+    return MAXALIGN(offsetof(CacheEntry, resp)
+                    + (Size)rst_response_cache_max_response * 1024);
+}
+
+static Size
+shmem_size() {
+    return add_size(offsetof(CacheShared, slots),
+                    mul_size(slot_size(), rst_response_cache_slots));
+}
+
+void
+rst_response_cache_shmem_request() {
+    if (rst_response_cache_slots == 0)
+        return;
+    RequestAddinShmemSpace(shmem_size());
+    RequestNamedLWLockTranche("rustica_response_cache", 1);
+}
+
+void
+rst_response_cache_shmem_startup() {
+    bool found;
+    if (rst_response_cache_slots == 0)
+        return;
+    shared = ShmemInitStruct("rustica response cache", shmem_size(), &found);
+    if (!found) {
+        shared->lock =
+            &(GetNamedLWLockTranche("rustica_response_cache"))->lock;
+        shared->nslots = rst_response_cache_slots;
+        shared->slot_size = slot_size();
+        for (int i = 0; i < shared->nslots; i++) {
+            ENTRY(i)->key_len = 0;
+            ENTRY(i)->expires = 0;
+        }
+    }
+}
+
+bool
+rst_response_cache_enabled() {
+    return shared != NULL;
+}
+
+typedef struct HeadIter {
+    const char *p;
+    const char *end;
+} HeadIter;
+
+// Start iterating over the header lines of a message head, skipping the
+// request or status line. Returns false if the head is incomplete.
+static bool
+head_begin(HeadIter *it, const char *head, int len) {
+    const char *eol = memmem(head, len, "\r\n", 2);
+    if (!eol)
+        return false;
+    it->p = eol + 2;
+    it->end = head + len;
+    return true;
+}
+
+static bool
+head_next(HeadIter *it,
+          const char **name,
+          int *name_len,
+          const char **value,
+          int *value_len) {
+    for (;;) {
+        const char *line = it->p;
+        const char *eol = memmem(line, it->end - line, "\r\n", 2);
+        if (!eol || eol == line)
+            return false;
+        it->p = eol + 2;
+        const char *colon = memchr(line, ':', eol - line);
+        if (!colon)
+            continue;
+        const char *v = colon + 1, *v_end = eol;
+        while (v < v_end && (*v == ' ' || *v == '\t'))
+            v++;
+        while (v_end > v && (v_end[-1] == ' ' || v_end[-1] == '\t'))
+            v_end--;
+        *name = line;
+        *name_len = (int)(colon - line);
+        *value = v;
+        *value_len = (int)(v_end - v);
+        return true;
+    }
+}
+
+static long
+parse_seconds(const char *p, int len) {
+    long n = 0;
+    if (len >= 2 && p[0] == '"' && p[len - 1] == '"') {
+        p++;
+        len -= 2;
+    }
+    if (len == 0)
+        return -1;
+    for (int i = 0; i < len; i++) {
+        if (p[i] < '0' || p[i] > '9')
+            return -1;
+        n = Min(n * 10 + (p[i] - '0'), (long)INT_MAX);
+    }
+    return n;
+}
+
+// Build the cache key of a request head as module, Host, URL and the chosen
+// content coding. Returns the key length, or -1 if the request is not a GET
+// without body, carries credentials that the response may depend on, or is
+// conditional or partial, so that its response is not meant for others. Only
+// HTTP/1.1 requests get a key, as responses may be chunked.
+// lookup is cleared when the client asks to bypass caches.
+int
+rst_response_cache_key(const char *head,
+                       int len,
+                       const char *module,
+                       char *key,
+                       bool *lookup,
+                       bool *keep_alive) {
+    const char *eol = memmem(head, len, "\r\n", 2);
+    const char *url, *url_end;
+    const char *host = "", *name, *value;
+    int host_len = 0, name_len, value_len;
+    int encoding = RST_HTTP_ENCODING_IDENTITY;
+    HeadIter it;
+
+    if (!eol || eol - head < 4 || memcmp(head, "GET ", 4) != 0)
+        return -1;
+    url = head + 4;
+    url_end = memchr(url, ' ', eol - url);
+    if (!url_end || !head_begin(&it, head, len))
+        return -1;
+    if (eol - url_end != 9 || memcmp(url_end, " HTTP/1.1", 9) != 0)
+        return -1;
+    *keep_alive = true;
+    *lookup = true;
+
+    while (head_next(&it, &name, &name_len, &value, &value_len)) {
+        if (HEADER_IS(name, name_len, "Host")) {
+            host = value;
+            host_len = value_len;
+        }
+        else if (HEADER_IS(name, name_len, "Accept-Encoding"))
+            encoding = rst_http_choose_encoding(value, value_len);
+        else if (HEADER_IS(name, name_len, "Content-Length")
+                 || HEADER_IS(name, name_len, "Transfer-Encoding")
+                 || HEADER_IS(name, name_len, "Authorization")
+                 || HEADER_IS(name, name_len, "Cookie")
+                 || HEADER_IS(name, name_len, "Range")
+                 || HEADER_IS(name, name_len, "If-Range")
+                 || HEADER_IS(name, name_len, "If-Match")
+                 || HEADER_IS(name, name_len, "If-None-Match")
+                 || HEADER_IS(name, name_len, "If-Modified-Since")
+                 || HEADER_IS(name, name_len, "If-Unmodified-Since"))
+            return -1;
+        else if (HEADER_IS(name, name_len, "Connection")) {
+            if (rst_http_has_directive(value, value_len, "close"))
+                *keep_alive = false;
+        }
+        else if (HEADER_IS(name, name_len, "Cache-Control")) {
+            if (rst_http_has_directive(value, value_len, "no-cache"))
+                *lookup = false;
+        }
+    }
+
+    int module_len = (int)strlen(module);
+    int key_len = module_len + host_len + (int)(url_end - url) + 4;
+    if (key_len > RST_RESPONSE_CACHE_KEY_MAXLEN)
+        return -1;
+    char *p = key;
+    memcpy(p, module, module_len + 1);
+    p += module_len + 1;
+    memcpy(p, host, host_len);
+    p += host_len;
+    *p++ = '\0';
+    memcpy(p, url, url_end - url);
+    p += url_end - url;
+    *p++ = '\0';
+    *p++ = (char)('0' + encoding);
+    return key_len;
+}
+
+// Decide from the response head whether it may be sent to other clients of
+// the same key, and for how long it may be cached; collect its Cache-Tag
+// values for purging. Only framed 200 responses without cookies are shared,
+// and only if they vary on nothing but the content coding, which is in the
+// key. Of those, only the ones marked public with a max-age are cached, or
+// *ttl is 0.
+static bool
+check_response(const char *resp,
+               int len,
+               char *tags,
+               int *tags_len,
+               long *ttl) {
+    const char *end = memmem(resp, len, "\r\n\r\n", 4);
+    const char *name, *value, *p, *dir, *arg;
+    int name_len, value_len, dir_len, arg_len;
+    bool public = false, framed = false;
+    long max_age = -1, s_maxage = -1;
+    HeadIter it;
+
+    *ttl = 0;
+    if (!end || end - resp < 12 || memcmp(resp, "HTTP/1.", 7) != 0
+        || memcmp(resp + 8, " 200", 4) != 0)
+        return false;
+    head_begin(&it, resp, (int)(end + 4 - resp));
+    tags[0] = ' ';
+    *tags_len = 1;
+    while (head_next(&it, &name, &name_len, &value, &value_len)) {
+        if (HEADER_IS(name, name_len, "Cache-Control")) {
+            p = value;
+            while (rst_http_next_directive(&p,
+                                           value + value_len,
+                                           &dir,
+                                           &dir_len,
+                                           &arg,
+                                           &arg_len)) {
+                if (HEADER_IS(dir, dir_len, "public"))
+                    public = true;
+                else if (HEADER_IS(dir, dir_len, "private")
+                         || HEADER_IS(dir, dir_len, "no-store")
+                         || HEADER_IS(dir, dir_len, "no-cache"))
+                    return false;
+                else if (HEADER_IS(dir, dir_len, "max-age"))
+                    max_age = parse_seconds(arg, arg_len);
+                else if (HEADER_IS(dir, dir_len, "s-maxage"))
+                    s_maxage = parse_seconds(arg, arg_len);
+            }
+        }
+        else if (HEADER_IS(name, name_len, "Set-Cookie"))
+            return false;
+        else if (HEADER_IS(name, name_len, "Vary")) {
+            p = value;
+            while (rst_http_next_directive(&p,
+                                           value + value_len,
+                                           &dir,
+                                           &dir_len,
+                                           &arg,
+                                           &arg_len))
+                if (!HEADER_IS(dir, dir_len, "Accept-Encoding"))
+                    return false;
+        }
+        else if (HEADER_IS(name, name_len, "Connection")) {
+            if (rst_http_has_directive(value, value_len, "close"))
+                return false;
+        }
+        else if (HEADER_IS(name, name_len, "Content-Length"))
+            framed = true;
+        else if (HEADER_IS(name, name_len, "Transfer-Encoding"))
+            framed = rst_http_has_directive(value, value_len, "chunked");
+        else if (HEADER_IS(name, name_len, "Cache-Tag")) {
+            for (int i = 0; i < value_len; i++) {
+                char c = value[i] == ',' || value[i] == '\t' ? ' ' : value[i];
+                if (c == ' ' && tags[*tags_len - 1] == ' ')
+                    continue;
+                if (*tags_len + 2 > RC_TAGS_MAXLEN) {
+                    public = false; // could not be purged
+                    break;
+                }
+                tags[(*tags_len)++] = c;
+            }
+            if (tags[*tags_len - 1] != ' ')
+                tags[(*tags_len)++] = ' ';
+        }
+    }
+    if (!framed)
+        return false;
+    if (public)
+        *ttl = Max(s_maxage >= 0 ? s_maxage : max_age, 0);
+    return true;
+}
+
+// Whether a response produced for one request may be replayed to the others
+// with the same key, see check_response()
+bool
+rst_response_shareable(const char *resp, int len) {
+    char tags[RC_TAGS_MAXLEN];
+    int tags_len;
+    long ttl;
+
+    return check_response(resp, len, tags, &tags_len, &ttl);
+}
+
+bool
+rst_response_cache_lookup(const char *key, int key_len, StringInfo resp) {
+    uint32 hash = hash_bytes((const unsigned char *)key, key_len);
+    TimestampTz now = GetCurrentTimestamp();
+    bool found = false;
+
+    if (!shared)
+        return false;
+    LWLockAcquire(shared->lock, LW_SHARED);
+    for (int i = 0; i < RC_PROBES; i++) {
+        CacheEntry *entry = ENTRY((hash + i) % shared->nslots);
+        if (entry->key_len == key_len && entry->hash == hash
+            && entry->expires > now
+            && memcmp(entry->key, key, key_len) == 0) {
+            appendBinaryStringInfo(resp, entry->resp, entry->resp_len);
+            found = true;
+            break;
+        }
+    }
+    LWLockRelease(shared->lock);
+    return found;
+}
+
+void
+rst_response_cache_store(const char *key,
+                         int key_len,
+                         const char *resp,
+                         int len) {
+    char tags[RC_TAGS_MAXLEN];
+    int tags_len;
+    CacheEntry *victim = NULL;
+
+    if (!shared || key_len <= 0 || len > ENTRY_CAPACITY)
+        return;
+    long ttl;
+    if (!check_response(resp, len, tags, &tags_len, &ttl) || ttl <= 0)
+        return;
+
+    uint32 hash = hash_bytes((const unsigned char *)key, key_len);
+    TimestampTz expires =
+        TimestampTzPlusMilliseconds(GetCurrentTimestamp(), ttl * 1000);
+    LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+    for (int i = 0; i < RC_PROBES; i++) {
+        CacheEntry *entry = ENTRY((hash + i) % shared->nslots);
+        if (entry->key_len == key_len && entry->hash == hash
+            && memcmp(entry->key, key, key_len) == 0) {
+            victim = entry;
+            break;
+        }
+        if (!victim || entry->expires < victim->expires)
+            victim = entry;
+    }
+    victim->hash = hash;
+    victim->key_len = key_len;
+    victim->expires = expires;
+    victim->tags_len = tags_len;
+    victim->resp_len = len;
+    memcpy(victim->key, key, key_len);
+    memcpy(victim->tags, tags, tags_len);
+    memcpy(victim->resp, resp, len);
+    LWLockRelease(shared->lock);
+
+    ereport(DEBUG1,
+            errmsg("response cache: stored %d bytes for %lds", len, ttl));
+}
+
+// Drop all responses carrying the given Cache-Tag. Returns how many.
+int
+rst_response_cache_purge(const char *tag) {
+    char needle[RC_TAGS_MAXLEN + 2];
+    int needle_len = snprintf(needle, sizeof(needle), " %s ", tag);
+    int purged = 0;
+
+    if (!shared || needle_len <= 2 || needle_len >= sizeof(needle))
+        return 0;
+    LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+    for (int i = 0; i < shared->nslots; i++) {
+        CacheEntry *entry = ENTRY(i);
+        if (entry->key_len > 0
+            && memmem(entry->tags, entry->tags_len, needle, needle_len)) {
+            entry->key_len = 0;
+            entry->expires = 0;
+            purged++;
+        }
+    }
+    LWLockRelease(shared->lock);
+    return purged;
+}
+
+Datum
+rst_response_cache_purge_sql(PG_FUNCTION_ARGS) {
+    char *tag = text_to_cstring(PG_GETARG_TEXT_PP(0));
+
+    if (strlen(tag) == 0 || strlen(tag) >= RC_TAGS_MAXLEN
+        || strpbrk(tag, " \t,\r\n"))
+        ereport(ERROR,
+                errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("invalid cache tag \"%s\"", tag));
+
+    // Workers purge again once this transaction commits, so that responses
+    // rendered from data it changes don't survive either.
+    int purged = rst_response_cache_purge(tag);
+    Async_Notify(RST_RESPONSE_CACHE_CHANNEL, tag);
+    PG_RETURN_INT32(purged);
+}
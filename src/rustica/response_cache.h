@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2026-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#ifndef RUSTICA_RESPONSE_CACHE_H
+#define RUSTICA_RESPONSE_CACHE_H
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "lib/stringinfo.h"
+
+#define RST_RESPONSE_CACHE_KEY_MAXLEN 512
+#define RST_RESPONSE_CACHE_CHANNEL "rustica_response_cache_purge"
+
+void
+rst_response_cache_shmem_request();
+
+void
+rst_response_cache_shmem_startup();
+
+bool
+rst_response_cache_enabled();
+
+int
+rst_response_cache_key(const char *head,
+                       int len,
+                       const char *module,
+                       char *key,
+                       bool *lookup,
+                       bool *keep_alive);
+
+bool
+rst_response_cache_lookup(const char *key, int key_len, StringInfo resp);
+
+bool
+rst_response_shareable(const char *resp, int len);
+
+void
+rst_response_cache_store(const char *key,
+                         int key_len,
+                         const char *resp,
+                         int len);
+
+int
+rst_response_cache_purge(const char *tag);
+
+Datum
+rst_response_cache_purge_sql(PG_FUNCTION_ARGS);
+
+#endif /* RUSTICA_RESPONSE_CACHE_H */
@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2026-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#include "postgres.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/condition_variable.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/timestamp.h"
+
+#include "rustica/gucs.h"
+#include "rustica/response_cache.h"
+#include "rustica/singleflight.h"
+
+#define SLOT_FREE 0
+#define SLOT_RUNNING 1
+#define SLOT_DONE 2
+#define SLOT_ABANDONED 3
+
+typedef struct SingleflightSlot {
+    int state;
+    int waiters;
+    pid_t leader;
+    int key_len;
+    int resp_len; // -1 when the response doesn't fit in the slot
+    ConditionVariable cv;
+    char key[RST_SINGLEFLIGHT_KEY_MAXLEN];
+    char resp[FLEXIBLE_ARRAY_MEMBER];
+} SingleflightSlot;
+
+typedef struct SingleflightShared {
+    LWLock *lock;
+    int nslots;
+    Size slot_size;
+    char slots[FLEXIBLE_ARRAY_MEMBER];
+} SingleflightShared;
+
+static SingleflightShared *shared = NULL;
+static int leading_slot = -1;
+static bool exit_callback_registered = false;
+
+#define SLOT(i) ((SingleflightSlot *)(shared->slots + (i) * shared->slot_size))
+#define SLOT_CAPACITY (shared->slot_size - offsetof(SingleflightSlot, resp))
+
+static Size
+slot_size() {
+    return MAXALIGN(offsetof(SingleflightSlot, resp)
+                    + (Size)rst_singleflight_max_response * 1024);
+}
+
+static Size
+shmem_size() {
+    return add_size(offsetof(SingleflightShared, slots),
+                    mul_size(slot_size(), rst_singleflight_slots));
+}
+
+void
+rst_singleflight_shmem_request() {
+    if (!rst_singleflight || rst_singleflight_slots == 0)
+        return;
+    RequestAddinShmemSpace(shmem_size());
+    RequestNamedLWLockTranche("rustica_singleflight", 1);
+}
+
+void
+rst_singleflight_shmem_startup() {
+    bool found;
+    if (!rst_singleflight || rst_singleflight_slots == 0)
+        return;
+    shared = ShmemInitStruct("rustica singleflight", shmem_size(), &found);
+    if (!found) {
+        shared->lock = &(GetNamedLWLockTranche("rustica_singleflight"))->lock;
+        shared->nslots = rst_singleflight_slots;
+        shared->slot_size = slot_size();
+        for (int i = 0; i < shared->nslots; i++) {
+            SingleflightSlot *slot = SLOT(i);
+            slot->state = SLOT_FREE;
+            slot->waiters = 0;
+            ConditionVariableInit(&slot->cv);
+        }
+    }
+}
+
+bool
+rst_singleflight_enabled() {
+    return rst_singleflight && shared != NULL;
+}
+
+static void
+release_leading_slot(int code, Datum arg) {
+    // A leader that exits abnormally must not leave its followers hanging
+    if (leading_slot >= 0)
+        rst_singleflight_finish(leading_slot, false);
+}
+
+static int
+wait_for_leader(int idx, StringInfo resp) {
+    SingleflightSlot *slot = SLOT(idx);
+    TimestampTz deadline =
+        TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+                                    rst_singleflight_timeout);
+    int rv = SF_BYPASS;
+
+    PG_TRY();
+    {
+        ConditionVariablePrepareToSleep(&slot->cv);
+        for (;;) {
+            LWLockAcquire(shared->lock, LW_SHARED);
+            int state = slot->state;
+            LWLockRelease(shared->lock);
+            if (state != SLOT_RUNNING)
+                break;
+            long timeout =
+                TimestampDifferenceMilliseconds(GetCurrentTimestamp(),
+                                                deadline);
+            if (timeout <= 0
+                || ConditionVariableTimedSleep(&slot->cv,
+                                               timeout,
+                                               PG_WAIT_EXTENSION))
+                break;
+        }
+        ConditionVariableCancelSleep();
+
+        // The slot is not recycled before all waiters are gone
+        LWLockAcquire(shared->lock, LW_SHARED);
+        if (slot->state == SLOT_DONE) {
+            appendBinaryStringInfo(resp, slot->resp, slot->resp_len);
+            rv = SF_FOLLOWER;
+        }
+        LWLockRelease(shared->lock);
+    }
+    PG_FINALLY();
+    {
+        LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+        slot->waiters--;
+        if (slot->waiters == 0 && slot->state != SLOT_RUNNING)
+            slot->state = SLOT_FREE;
+        LWLockRelease(shared->lock);
+    }
+    PG_END_TRY();
+
+    return rv;
+}
+
+int
+rst_singleflight_begin(const char *key,
+                       int key_len,
+                       int *slot_out,
+                       StringInfo resp) {
+    int idx = -1, free_idx = -1;
+
+    if (!rst_singleflight || shared == NULL
+        || key_len > RST_SINGLEFLIGHT_KEY_MAXLEN)
+        return SF_BYPASS;
+
+    LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+    for (int i = 0; i < shared->nslots; i++) {
+        SingleflightSlot *slot = SLOT(i);
+        if (slot->state == SLOT_FREE) {
+            if (free_idx < 0)
+                free_idx = i;
+        }
+        else if (slot->state == SLOT_RUNNING && slot->key_len == key_len
+                 && memcmp(slot->key, key, key_len) == 0) {
+            idx = i;
+            break;
+        }
+    }
+
+    // Join an identical request in flight
+    if (idx >= 0) {
+        SLOT(idx)->waiters++;
+        LWLockRelease(shared->lock);
+        ereport(DEBUG1,
+                errmsg("singleflight: wait for pid %d", SLOT(idx)->leader));
+        return wait_for_leader(idx, resp);
+    }
+
+    // Or lead a new one if there is room
+    if (free_idx < 0) {
+        LWLockRelease(shared->lock);
+        return SF_BYPASS;
+    }
+    SingleflightSlot *slot = SLOT(free_idx);
+    slot->state = SLOT_RUNNING;
+    slot->waiters = 0;
+    slot->leader = MyProcPid;
+    slot->key_len = key_len;
+    slot->resp_len = 0;
+    memcpy(slot->key, key, key_len);
+    LWLockRelease(shared->lock);
+
+    if (!exit_callback_registered) {
+        before_shmem_exit(release_leading_slot, 0);
+        exit_callback_registered = true;
+    }
+    leading_slot = free_idx;
+    *slot_out = free_idx;
+    return SF_LEADER;
+}
+
+void
+rst_singleflight_capture(int idx, const char *data, int len) {
+    // Only the leader writes to the slot while it's RUNNING
+    SingleflightSlot *slot = SLOT(idx);
+    if (slot->resp_len < 0)
+        return;
+    if (slot->resp_len + len > SLOT_CAPACITY) {
+        slot->resp_len = -1;
+        return;
+    }
+    memcpy(slot->resp + slot->resp_len, data, len);
+    slot->resp_len += len;
+}
+
+// Followers only get a response that any of them could have got, the others
+// are abandoned and followers run the request themselves.
+void
+rst_singleflight_finish(int idx, bool success) {
+    SingleflightSlot *slot = SLOT(idx);
+
+    // Only the leader writes to the slot while it's RUNNING
+    success = success && slot->resp_len > 0
+              && rst_response_shareable(slot->resp, slot->resp_len);
+    LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+    if (slot->waiters == 0)
+        slot->state = SLOT_FREE;
+    else if (success)
+        slot->state = SLOT_DONE;
+    else
+        slot->state = SLOT_ABANDONED;
+    LWLockRelease(shared->lock);
+
+    leading_slot = -1;
+    ConditionVariableBroadcast(&slot->cv);
+}
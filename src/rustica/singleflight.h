@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2026-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#ifndef RUSTICA_SINGLEFLIGHT_H
+#define RUSTICA_SINGLEFLIGHT_H
+
+#include "postgres.h"
+#include "lib/stringinfo.h"
+
+#define RST_SINGLEFLIGHT_KEY_MAXLEN 512
+
+#define SF_BYPASS 0
+#define SF_LEADER 1
+#define SF_FOLLOWER 2
+
+void
+rst_singleflight_shmem_request();
+
+void
+rst_singleflight_shmem_startup();
+
+bool
+rst_singleflight_enabled();
+
+int
+rst_singleflight_begin(const char *key,
+                       int key_len,
+                       int *slot,
+                       StringInfo resp);
+
+void
+rst_singleflight_capture(int slot, const char *data, int len);
+
+void
+rst_singleflight_finish(int slot, bool success);
+
+#endif /* RUSTICA_SINGLEFLIGHT_H */
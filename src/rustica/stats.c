@@ -0,0 +1,489 @@
+/*
+ * Copyright (c) 2026-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#include <math.h>
+
+#include "postgres.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "port/pg_bitutils.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+
+#include "rustica/gucs.h"
+#include "rustica/module.h"
+#include "rustica/stats.h"
+
+// Log-linear buckets of microseconds, like an HDR histogram with 3 significant
+// bits: exact below 16us, then 8 buckets per power of two up to 2^40us.
+#define HIST_LINEAR 16
+#define HIST_SUB_BUCKETS 8
+#define HIST_MAX_EXP 40
+#define HIST_NBUCKETS (HIST_LINEAR + (HIST_MAX_EXP - 4) * HIST_SUB_BUCKETS)
+
+typedef struct PhaseKey {
+    char module[RST_MODULE_NAME_MAXLEN + 1];
+    int phase;
+} PhaseKey;
+
+typedef struct PhaseEntry {
+    PhaseKey key;
+    pg_atomic_uint64 total_us;
+    pg_atomic_uint64 max_us;
+    pg_atomic_uint64 buckets[HIST_NBUCKETS];
+} PhaseEntry;
+
+typedef struct QueryKey {
+    char module[RST_MODULE_NAME_MAXLEN + 1];
+    int index;
+} QueryKey;
+
+// Times of env_execute_statement(), split into the wasm -> pg argument
+// conversion, the executor, and the pg -> wasm result conversion
+typedef struct QueryEntry {
+    QueryKey key;
+    pg_atomic_uint64 calls;
+    pg_atomic_uint64 rows;
+    pg_atomic_uint64 total_us;
+    pg_atomic_uint64 max_us;
+    pg_atomic_uint64 args_us;
+    pg_atomic_uint64 exec_us;
+    pg_atomic_uint64 results_us;
+} QueryEntry;
+
+typedef struct StatsShared {
+    LWLock *lock;
+} StatsShared;
+
+static const char *phase_names[RST_NPHASES] = {
+    "request",      "queue", "dispatch",  "prepare", "instantiate",
+    "init_context", "start", "statement", "commit",  "close",
+};
+
+typedef struct LocalPhaseEntry {
+    PhaseKey key;
+    PhaseEntry *entry;
+} LocalPhaseEntry;
+
+static StatsShared *shared = NULL;
+static HTAB *phases = NULL;
+static HTAB *queries = NULL;
+
+// The phase entries this process found already, so that recording a phase
+// takes no lock after the first time
+static HTAB *local_phases = NULL;
+
+static int
+max_phase_entries() {
+    return rst_stat_max_modules * RST_NPHASES;
+}
+
+void
+rst_stats_shmem_request() {
+    Size size = MAXALIGN(sizeof(StatsShared));
+
+    if (rst_stat_max_modules == 0 && rst_stat_max_queries == 0)
+        return;
+    if (rst_stat_max_modules > 0)
+        size = add_size(
+            size,
+            hash_estimate_size(max_phase_entries(), sizeof(PhaseEntry)));
+    if (rst_stat_max_queries > 0)
+        size = add_size(
+            size,
+            hash_estimate_size(rst_stat_max_queries, sizeof(QueryEntry)));
+    RequestAddinShmemSpace(size);
+    RequestNamedLWLockTranche("rustica_stats", 1);
+}
+
+void
+rst_stats_shmem_startup() {
+    HASHCTL info;
+    bool found;
+
+    if (rst_stat_max_modules == 0 && rst_stat_max_queries == 0)
+        return;
+    shared = ShmemInitStruct("rustica stats", sizeof(StatsShared), &found);
+    if (!found)
+        shared->lock = &(GetNamedLWLockTranche("rustica_stats"))->lock;
+    if (rst_stat_max_modules > 0) {
+        info.keysize = sizeof(PhaseKey);
+        info.entrysize = sizeof(PhaseEntry);
+        phases = ShmemInitHash("rustica stat phases",
+                               max_phase_entries(),
+                               max_phase_entries(),
+                               &info,
+                               HASH_ELEM | HASH_BLOBS);
+    }
+    if (rst_stat_max_queries > 0) {
+        info.keysize = sizeof(QueryKey);
+        info.entrysize = sizeof(QueryEntry);
+        queries = ShmemInitHash("rustica stat queries",
+                                rst_stat_max_queries,
+                                rst_stat_max_queries,
+                                &info,
+                                HASH_ELEM | HASH_BLOBS);
+    }
+}
+
+static int
+bucket_of(uint64 us) {
+    int exp;
+
+    if (us < HIST_LINEAR)
+        return (int)us;
+    exp = pg_leftmost_one_pos64(us);
+    if (exp >= HIST_MAX_EXP)
+        return HIST_NBUCKETS - 1;
+    return HIST_LINEAR + (exp - 4) * HIST_SUB_BUCKETS
+           + (int)((us >> (exp - 3)) & (HIST_SUB_BUCKETS - 1));
+}
+
+// The highest value that falls into the bucket
+static uint64
+bucket_max(int bucket) {
+    int exp, sub;
+
+    if (bucket < HIST_LINEAR)
+        return bucket;
+    exp = (bucket - HIST_LINEAR) / HIST_SUB_BUCKETS + 4;
+    sub = (bucket - HIST_LINEAR) % HIST_SUB_BUCKETS;
+    return ((uint64)(HIST_SUB_BUCKETS + sub + 1) << (exp - 3)) - 1;
+}
+
+static uint64
+elapsed_us(TimestampTz start, TimestampTz end) {
+    return end > start ? (uint64)(end - start) : 0;
+}
+
+static void
+update_max(pg_atomic_uint64 *max_us, uint64 us) {
+    uint64 max = pg_atomic_read_u64(max_us);
+
+    while (us > max && !pg_atomic_compare_exchange_u64(max_us, &max, us))
+        ;
+}
+
+// Entries are never removed, rustica.stat_reset() zeroes them instead. So once
+// found, they are cached and updated without the lock.
+static PhaseEntry *
+find_entry(const char *module, int phase) {
+    PhaseKey key;
+    PhaseEntry *entry;
+    LocalPhaseEntry *local;
+    HASHCTL info;
+    bool found;
+
+    memset(&key, 0, sizeof(PhaseKey));
+    strlcpy(key.module, module, sizeof(key.module));
+    key.phase = phase;
+
+    if (local_phases == NULL) {
+        info.keysize = sizeof(PhaseKey);
+        info.entrysize = sizeof(LocalPhaseEntry);
+        local_phases = hash_create("rustica local stat phases",
+                                   RST_NPHASES * 4,
+                                   &info,
+                                   HASH_ELEM | HASH_BLOBS);
+    }
+    local = hash_search(local_phases, &key, HASH_FIND, NULL);
+    if (local)
+        return local->entry;
+
+    LWLockAcquire(shared->lock, LW_SHARED);
+    entry = hash_search(phases, &key, HASH_FIND, NULL);
+    LWLockRelease(shared->lock);
+
+    if (entry == NULL) {
+        LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+        entry = hash_search(phases, &key, HASH_ENTER_NULL, &found);
+        if (entry && !found) {
+            pg_atomic_init_u64(&entry->total_us, 0);
+            pg_atomic_init_u64(&entry->max_us, 0);
+            for (int i = 0; i < HIST_NBUCKETS; i++)
+                pg_atomic_init_u64(&entry->buckets[i], 0);
+        }
+        LWLockRelease(shared->lock);
+        if (entry == NULL)
+            return NULL; // rustica.stat_max_modules is reached
+    }
+
+    local = hash_search(local_phases, &key, HASH_ENTER, NULL);
+    local->entry = entry;
+    return entry;
+}
+
+void
+rst_stats_record(const char *module,
+                 int phase,
+                 TimestampTz start,
+                 TimestampTz end) {
+    PhaseEntry *entry;
+    uint64 us;
+
+    if (phases == NULL || start == 0)
+        return;
+    entry = find_entry(module, phase);
+    if (entry == NULL)
+        return;
+    us = elapsed_us(start, end);
+    pg_atomic_fetch_add_u64(&entry->total_us, us);
+    pg_atomic_fetch_add_u64(&entry->buckets[bucket_of(us)], 1);
+    update_max(&entry->max_us, us);
+}
+
+// Like find_entry(), for rustica.stat_queries. The caller caches the entry.
+static QueryEntry *
+find_query_entry(const char *module, int index) {
+    QueryKey key;
+    QueryEntry *entry;
+    bool found;
+
+    memset(&key, 0, sizeof(QueryKey));
+    strlcpy(key.module, module, sizeof(key.module));
+    key.index = index;
+
+    LWLockAcquire(shared->lock, LW_SHARED);
+    entry = hash_search(queries, &key, HASH_FIND, NULL);
+    LWLockRelease(shared->lock);
+    if (entry)
+        return entry;
+
+    LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+    entry = hash_search(queries, &key, HASH_ENTER_NULL, &found);
+    if (entry && !found) {
+        pg_atomic_init_u64(&entry->calls, 0);
+        pg_atomic_init_u64(&entry->rows, 0);
+        pg_atomic_init_u64(&entry->total_us, 0);
+        pg_atomic_init_u64(&entry->max_us, 0);
+        pg_atomic_init_u64(&entry->args_us, 0);
+        pg_atomic_init_u64(&entry->exec_us, 0);
+        pg_atomic_init_u64(&entry->results_us, 0);
+    }
+    LWLockRelease(shared->lock);
+    return entry; // NULL once rustica.stat_max_queries is reached
+}
+
+// The entry is cached in the query plan, for as long as the module is loaded
+void
+rst_stats_record_query(PreparedModule *pmod,
+                       int index,
+                       uint64 rows,
+                       TimestampTz start,
+                       TimestampTz args_done,
+                       TimestampTz executed,
+                       TimestampTz end) {
+    QueryPlan *plan = &pmod->queries[index];
+    QueryEntry *entry;
+    uint64 us;
+
+    if (queries == NULL)
+        return;
+    if (plan->stat_entry == NULL)
+        plan->stat_entry = find_query_entry(pmod->name, index);
+    entry = plan->stat_entry;
+    if (entry == NULL)
+        return;
+    us = elapsed_us(start, end);
+    pg_atomic_fetch_add_u64(&entry->calls, 1);
+    pg_atomic_fetch_add_u64(&entry->rows, rows);
+    pg_atomic_fetch_add_u64(&entry->total_us, us);
+    pg_atomic_fetch_add_u64(&entry->args_us, elapsed_us(start, args_done));
+    pg_atomic_fetch_add_u64(&entry->exec_us, elapsed_us(args_done, executed));
+    pg_atomic_fetch_add_u64(&entry->results_us, elapsed_us(executed, end));
+    update_max(&entry->max_us, us);
+}
+
+// In milliseconds, the smallest bucket maximum below which at least the
+// fraction q of the samples fall
+static double
+percentile(uint64 *buckets, uint64 count, uint64 max, double q) {
+    uint64 rank = (uint64)ceil(q * count), seen = 0;
+
+    for (int i = 0; i < HIST_NBUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank)
+            return Min(bucket_max(i), max) / 1000.0;
+    }
+    return max / 1000.0;
+}
+
+Datum
+rst_stats_phases(PG_FUNCTION_ARGS) {
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+    HASH_SEQ_STATUS status;
+    PhaseEntry *entry;
+    uint64 buckets[HIST_NBUCKETS];
+
+    if (!phases)
+        ereport(ERROR,
+                errmsg("rustica-engine must be loaded via "
+                       "shared_preload_libraries, with "
+                       "rustica.stat_max_modules > 0"));
+    InitMaterializedSRF(fcinfo, 0);
+
+    LWLockAcquire(shared->lock, LW_SHARED);
+    hash_seq_init(&status, phases);
+    while ((entry = hash_seq_search(&status)) != NULL) {
+        Datum values[8];
+        bool nulls[8] = { 0 };
+        uint64 count = 0, total, max;
+
+        for (int i = 0; i < HIST_NBUCKETS; i++) {
+            buckets[i] = pg_atomic_read_u64(&entry->buckets[i]);
+            count += buckets[i];
+        }
+        if (count == 0)
+            continue;
+        total = pg_atomic_read_u64(&entry->total_us);
+        max = pg_atomic_read_u64(&entry->max_us);
+
+        values[0] = CStringGetTextDatum(entry->key.module);
+        values[1] = CStringGetTextDatum(phase_names[entry->key.phase]);
+        values[2] = Int64GetDatum((int64)count);
+        values[3] = Float8GetDatum(total / 1000.0 / count);
+        values[4] = Float8GetDatum(percentile(buckets, count, max, 0.5));
+        values[5] = Float8GetDatum(percentile(buckets, count, max, 0.99));
+        values[6] = Float8GetDatum(percentile(buckets, count, max, 0.999));
+        values[7] = Float8GetDatum(max / 1000.0);
+        tuplestore_putvalues(rsinfo->setResult,
+                             rsinfo->setDesc,
+                             values,
+                             nulls);
+    }
+    LWLockRelease(shared->lock);
+
+    return (Datum)0;
+}
+
+Datum
+rst_stats_queries(PG_FUNCTION_ARGS) {
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+    HASH_SEQ_STATUS status;
+    QueryEntry *entry;
+
+    if (!queries)
+        ereport(ERROR,
+                errmsg("rustica-engine must be loaded via "
+                       "shared_preload_libraries, with "
+                       "rustica.stat_max_queries > 0"));
+    InitMaterializedSRF(fcinfo, 0);
+
+    LWLockAcquire(shared->lock, LW_SHARED);
+    hash_seq_init(&status, queries);
+    while ((entry = hash_seq_search(&status)) != NULL) {
+        Datum values[9];
+        bool nulls[9] = { 0 };
+        uint64 calls = pg_atomic_read_u64(&entry->calls);
+
+        if (calls == 0)
+            continue;
+        values[0] = CStringGetTextDatum(entry->key.module);
+        values[1] = Int32GetDatum(entry->key.index);
+        values[2] = Int64GetDatum((int64)calls);
+        values[3] = Int64GetDatum((int64)pg_atomic_read_u64(&entry->rows));
+        values[4] =
+            Float8GetDatum(pg_atomic_read_u64(&entry->total_us) / 1000.0);
+        values[5] = Float8GetDatum(pg_atomic_read_u64(&entry->max_us) / 1000.0);
+        values[6] =
+            Float8GetDatum(pg_atomic_read_u64(&entry->args_us) / 1000.0);
+        values[7] =
+            Float8GetDatum(pg_atomic_read_u64(&entry->exec_us) / 1000.0);
+        values[8] =
+            Float8GetDatum(pg_atomic_read_u64(&entry->results_us) / 1000.0);
+        tuplestore_putvalues(rsinfo->setResult,
+                             rsinfo->setDesc,
+                             values,
+                             nulls);
+    }
+    LWLockRelease(shared->lock);
+
+    return (Datum)0;
+}
+
+static void
+reset_phase_entry(PhaseEntry *entry) {
+    pg_atomic_write_u64(&entry->total_us, 0);
+    pg_atomic_write_u64(&entry->max_us, 0);
+    for (int i = 0; i < HIST_NBUCKETS; i++)
+        pg_atomic_write_u64(&entry->buckets[i], 0);
+}
+
+static void
+reset_query_entry(QueryEntry *entry) {
+    pg_atomic_write_u64(&entry->calls, 0);
+    pg_atomic_write_u64(&entry->rows, 0);
+    pg_atomic_write_u64(&entry->total_us, 0);
+    pg_atomic_write_u64(&entry->max_us, 0);
+    pg_atomic_write_u64(&entry->args_us, 0);
+    pg_atomic_write_u64(&entry->exec_us, 0);
+    pg_atomic_write_u64(&entry->results_us, 0);
+}
+
+// Zero the query entries of a module, or of all modules if module is NULL.
+// Workers keep pointers to the entries, so they stay in place.
+static void
+reset_queries(const char *module) {
+    HASH_SEQ_STATUS status;
+    QueryEntry *entry;
+
+    LWLockAcquire(shared->lock, LW_SHARED);
+    hash_seq_init(&status, queries);
+    while ((entry = hash_seq_search(&status)) != NULL)
+        if (module == NULL || strcmp(entry->key.module, module) == 0)
+            reset_query_entry(entry);
+    LWLockRelease(shared->lock);
+}
+
+// rustica.stat_reset([module]): forget the times of one module or all of them
+Datum
+rst_stats_reset(PG_FUNCTION_ARGS) {
+    char *module = NULL;
+    HASH_SEQ_STATUS status;
+    PhaseEntry *entry;
+
+    if (!shared)
+        ereport(ERROR,
+                errmsg("rustica-engine must be loaded via "
+                       "shared_preload_libraries, with "
+                       "rustica.stat_max_modules or rustica.stat_max_queries "
+                       "> 0"));
+    if (!PG_ARGISNULL(0))
+        module = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    if (phases) {
+        LWLockAcquire(shared->lock, LW_SHARED);
+        hash_seq_init(&status, phases);
+        while ((entry = hash_seq_search(&status)) != NULL)
+            if (module == NULL || strcmp(entry->key.module, module) == 0)
+                reset_phase_entry(entry);
+        LWLockRelease(shared->lock);
+    }
+    if (queries)
+        reset_queries(module);
+    PG_RETURN_VOID();
+}
+
+// The query indexes of a redeployed module point to different SQL, so the
+// module_change trigger drops what was recorded under the old ones.
+Datum
+rst_stats_forget_queries(PG_FUNCTION_ARGS) {
+    if (queries)
+        reset_queries(text_to_cstring(PG_GETARG_TEXT_PP(0)));
+    PG_RETURN_VOID();
+}
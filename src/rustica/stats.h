@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2026-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#ifndef RUSTICA_STATS_H
+#define RUSTICA_STATS_H
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "datatype/timestamp.h"
+
+#include "rustica/module.h"
+
+// Phases of a request, timed per module for rustica.stat_phases
+#define RST_PHASE_REQUEST 0 // accepted or previous request done, until done
+#define RST_PHASE_QUEUE 1 // accepted by the master, until sent to a worker
+#define RST_PHASE_DISPATCH 2 // sent by the master, until received
+#define RST_PHASE_PREPARE 3
+#define RST_PHASE_INSTANTIATE 4
+#define RST_PHASE_INIT_CONTEXT 5
+#define RST_PHASE_START 6
+#define RST_PHASE_STATEMENT 7
+#define RST_PHASE_COMMIT 8
+#define RST_PHASE_CLOSE 9
+#define RST_NPHASES 10
+
+void
+rst_stats_shmem_request();
+
+void
+rst_stats_shmem_startup();
+
+void
+rst_stats_record(const char *module,
+                 int phase,
+                 TimestampTz start,
+                 TimestampTz end);
+
+void
+rst_stats_record_query(PreparedModule *pmod,
+                       int index,
+                       uint64 rows,
+                       TimestampTz start,
+                       TimestampTz args_done,
+                       TimestampTz executed,
+                       TimestampTz end);
+
+Datum
+rst_stats_phases(PG_FUNCTION_ARGS);
+
+Datum
+rst_stats_queries(PG_FUNCTION_ARGS);
+
+Datum
+rst_stats_reset(PG_FUNCTION_ARGS);
+
+Datum
+rst_stats_forget_queries(PG_FUNCTION_ARGS);
+
+#endif /* RUSTICA_STATS_H */
@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2026-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#ifdef RUSTICA_IO_URING
+
+#include <liburing.h>
+#include <sys/socket.h>
+
+#include "postgres.h"
+
+#include "rustica/uring.h"
+
+#define URING_ENTRIES 256
+#define URING_MAX_SENDS 128
+#define URING_DATA(kind, index) (((uint64)(index) << 8) | (kind))
+
+typedef struct PendingSend {
+    struct msghdr msg;
+    struct iovec io;
+    char buf[CMSG_SPACE(sizeof(int))];
+    JobInfo info;
+
+    pgsocket job;
+    pgsocket backend_fd;
+    int backend_pos;
+} PendingSend;
+
+static struct io_uring ring;
+static PendingSend sends[URING_MAX_SENDS];
+static int nsends = 0;
+static int in_flight = 0;
+
+static struct io_uring_sqe *
+get_sqe() {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    if (sqe == NULL) {
+        // Submission queue is full, push what we have to the kernel
+        io_uring_submit(&ring);
+        sqe = io_uring_get_sqe(&ring);
+    }
+    return sqe;
+}
+
+bool
+rst_uring_init(pgsocket *listen_sockets, int nsockets) {
+    int rc;
+
+    rc = io_uring_queue_init(URING_ENTRIES, &ring, 0);
+    if (rc < 0) {
+        errno = -rc;
+        ereport(LOG,
+                (errmsg("could not set up io_uring, using epoll instead: %m")));
+        return false;
+    }
+
+    // Accept on the listen sockets through fixed files, saving the fd lookup
+    rc = io_uring_register_files(&ring, listen_sockets, nsockets);
+    if (rc < 0) {
+        errno = -rc;
+        ereport(LOG,
+                (errmsg("could not register listen sockets with io_uring, "
+                        "using epoll instead: %m")));
+        io_uring_queue_exit(&ring);
+        return false;
+    }
+
+    // Optional, only saves the ring fd lookup on each io_uring_enter()
+    io_uring_register_ring_fd(&ring);
+    ereport(DEBUG1, (errmsg("master is using io_uring")));
+    return true;
+}
+
+pgsocket
+rst_uring_fd() {
+    return ring.ring_fd;
+}
+
+void
+rst_uring_arm_accept(int index) {
+    struct io_uring_sqe *sqe = get_sqe();
+
+    // The address is not needed here, and would be shared by all completions
+    io_uring_prep_multishot_accept(sqe, index, NULL, NULL, 0);
+    sqe->flags |= IOSQE_FIXED_FILE;
+    io_uring_sqe_set_data64(sqe, URING_DATA(RST_URING_ACCEPT, index));
+    io_uring_submit(&ring);
+}
+
+void
+rst_uring_cancel_accept(int index) {
+    struct io_uring_sqe *sqe = get_sqe();
+
+    io_uring_prep_cancel64(sqe, URING_DATA(RST_URING_ACCEPT, index), 0);
+    io_uring_sqe_set_data64(sqe, URING_DATA(RST_URING_CANCEL, index));
+    io_uring_submit(&ring);
+}
+
+// Queue passing the job socket to a worker. Nothing is sent until the next
+// rst_uring_submit(), so that all jobs dispatched in one round of the master
+// loop go to the kernel in a single system call.
+bool
+rst_uring_queue_send(pgsocket backend_fd,
+                     int backend_pos,
+                     pgsocket job,
+                     const JobInfo *info) {
+    struct io_uring_sqe *sqe;
+    struct cmsghdr *cmsg;
+    PendingSend *send;
+
+    if (nsends == URING_MAX_SENDS)
+        return false;
+    sqe = get_sqe();
+    if (sqe == NULL)
+        return false;
+
+    send = &sends[nsends];
+    memset(send, 0, sizeof(PendingSend));
+    send->info = *info;
+    send->io.iov_base = &send->info;
+    send->io.iov_len = sizeof(JobInfo);
+    send->msg.msg_iov = &send->io;
+    send->msg.msg_iovlen = 1;
+    send->msg.msg_control = send->buf;
+    send->msg.msg_controllen = sizeof(send->buf);
+    cmsg = CMSG_FIRSTHDR(&send->msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    *((int *)CMSG_DATA(cmsg)) = job;
+    send->job = job;
+    send->backend_fd = backend_fd;
+    send->backend_pos = backend_pos;
+
+    io_uring_prep_sendmsg(sqe, backend_fd, &send->msg, MSG_NOSIGNAL);
+    io_uring_sqe_set_data64(sqe, URING_DATA(RST_URING_SEND, nsends));
+    nsends++;
+    in_flight++;
+    return true;
+}
+
+void
+rst_uring_submit() {
+    if (io_uring_sq_ready(&ring) > 0)
+        io_uring_submit(&ring);
+}
+
+int
+rst_uring_sends_in_flight() {
+    return in_flight;
+}
+
+bool
+rst_uring_next_event(UringEvent *ev, bool wait) {
+    struct io_uring_cqe *cqe;
+    uint64 data;
+    int rc;
+
+    for (;;) {
+        if (wait)
+            rc = io_uring_wait_cqe(&ring, &cqe);
+        else
+            rc = io_uring_peek_cqe(&ring, &cqe);
+        if (rc == -EINTR)
+            continue;
+        if (rc < 0)
+            return false;
+
+        data = io_uring_cqe_get_data64(cqe);
+        ev->kind = (int)(data & 0xff);
+        ev->index = (int)(data >> 8);
+        ev->res = cqe->res;
+        ev->more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+        io_uring_cqe_seen(&ring, cqe);
+
+        if (ev->kind == RST_URING_CANCEL)
+            continue;
+        if (ev->kind == RST_URING_SEND) {
+            PendingSend *send = &sends[ev->index];
+            ev->job = send->job;
+            ev->accepted_at = send->info.accepted_at;
+            ev->backend_fd = send->backend_fd;
+            ev->backend_pos = send->backend_pos;
+            // Slots are reused only after every queued send has completed
+            if (--in_flight == 0)
+                nsends = 0;
+        }
+        return true;
+    }
+}
+
+void
+rst_uring_exit() {
+    io_uring_queue_exit(&ring);
+}
+
+#endif /* RUSTICA_IO_URING */
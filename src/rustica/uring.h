@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2026-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#ifndef RUSTICA_URING_H
+#define RUSTICA_URING_H
+
+#ifdef RUSTICA_IO_URING
+
+#include "postgres.h"
+
+#include "rustica/utils.h"
+
+#define RST_URING_ACCEPT 1
+#define RST_URING_SEND 2
+#define RST_URING_CANCEL 3
+
+typedef struct UringEvent {
+    int kind;
+    int index; // listen socket index for RST_URING_ACCEPT
+    int res;
+    bool more;
+
+    // RST_URING_SEND only
+    pgsocket job;
+    TimestampTz accepted_at;
+    pgsocket backend_fd;
+    int backend_pos;
+} UringEvent;
+
+bool
+rst_uring_init(pgsocket *listen_sockets, int nsockets);
+
+pgsocket
+rst_uring_fd();
+
+void
+rst_uring_arm_accept(int index);
+
+void
+rst_uring_cancel_accept(int index);
+
+bool
+rst_uring_queue_send(pgsocket backend_fd,
+                     int backend_pos,
+                     pgsocket job,
+                     const JobInfo *info);
+
+void
+rst_uring_submit();
+
+int
+rst_uring_sends_in_flight();
+
+bool
+rst_uring_next_event(UringEvent *ev, bool wait);
+
+void
+rst_uring_exit();
+
+#endif /* RUSTICA_IO_URING */
+
+#endif /* RUSTICA_URING_H */
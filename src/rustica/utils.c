@@ -26,3 +26,11 @@ rst_make_ipc_addr(struct sockaddr_un *addr) {
     addr->sun_path[0] = '\0';
     snprintf(&addr->sun_path[1], sizeof(addr->sun_path) - 1, "rustica-ipc");
 }
+
+void
+rst_make_hub_addr(struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    addr->sun_path[0] = '\0';
+    snprintf(&addr->sun_path[1], sizeof(addr->sun_path) - 1, "rustica-hub");
+}
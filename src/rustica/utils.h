@@ -19,6 +19,9 @@
 
 #include <sys/socket.h>
 
+#include "postgres.h"
+#include "datatype/timestamp.h"
+
 #define BACKEND_HELLO "RUSTICA!"
 
 #define ERROR_BUF error_buf
@@ -27,15 +30,24 @@
     char ERROR_BUF[size];       \
     uint32 ERROR_BUF##_size = size;
 
+// Sent by the master along with a client socket
+typedef struct JobInfo {
+    TimestampTz accepted_at;
+    TimestampTz dispatched_at;
+} JobInfo;
+
 typedef struct FDMessage {
     struct msghdr msg;
     struct cmsghdr *cmsg;
     char buf[CMSG_SPACE(sizeof(int))];
     struct iovec io;
-    char byte;
+    JobInfo job;
 } FDMessage;
 
 void
 rst_make_ipc_addr(struct sockaddr_un *addr);
 
+void
+rst_make_hub_addr(struct sockaddr_un *addr);
+
 #endif /* RUSTICA_UTILS_H */
@@ -22,6 +22,8 @@
 #include "aot_runtime.h"
 
 #include "rustica/datatypes.h"
+#include "rustica/http.h"
+#include "rustica/hub.h"
 #include "rustica/wamr.h"
 
 static void
@@ -99,6 +101,8 @@ rst_init_wamr() {
     REGISTER_WASM_NATIVES("env", rst_noop_native_env);
     rst_register_natives_bytea();
     rst_register_natives_date();
+    rst_register_natives_http();
+    rst_register_natives_hub();
     rst_register_natives_jsonb();
     rst_register_natives_json();
     rst_register_natives_primitives();
@@ -14,17 +14,22 @@
  * See the Mulan PSL v2 for more details.
  */
 
+#include <poll.h>
 #include <sys/un.h>
+#include <unistd.h>
 
 #include "postgres.h"
 #include "miscadmin.h"
 #include "postmaster/bgworker.h"
 #include "libpq/libpq.h"
+#include "libpq/pqsignal.h"
 #include "libpq/pqformat.h"
 #include "access/xact.h"
 #include "commands/async.h"
 #include "tcop/utility.h"
 #include "utils/snapmgr.h"
+#include "utils/timeout.h"
+#include "utils/timestamp.h"
 #ifdef RUSTICA_SQL_BACKDOOR
 #include "utils/builtins.h"
 #include "utils/jsonb.h"
@@ -33,47 +38,66 @@
 
 #include "llhttp.h"
 
+#include "rustica/assets.h"
 #include "rustica/datatypes.h"
+#include "rustica/event_set.h"
 #include "rustica/gucs.h"
+#include "rustica/http.h"
+#include "rustica/io.h"
 #include "rustica/module.h"
+#include "rustica/perf_map.h"
+#include "rustica/pgo.h"
 #include "rustica/query.h"
+#include "rustica/response_cache.h"
+#include "rustica/singleflight.h"
+#include "rustica/stats.h"
 #include "rustica/utils.h"
 #include "rustica/wamr.h"
 
 #define WAIT_WRITE 0
-#define WAIT_READ 0
+#define WAIT_READ 1
+#define WAIT_FULL 2 // as many connections as allowed, not asking for jobs
+
+// A client connection owned by this worker
+typedef struct Connection {
+    Context *ctx; // NULL when the slot is free
+    int pos;      // position in wait_set
+    int nrequests;
+    TimestampTz idle_deadline; // keep-alive timeout, 0 before the first request
+} Connection;
+
 static int worker_id;
 static pgsocket sock;
 static char hello[12];
-static WaitEventSet *wait_set = NULL;
+static WaitEventSetEx *wait_set = NULL;
+static Connection *connections = NULL;
+static int nconnections = 0;
 static bool shutdown_requested = false;
 static char state = WAIT_WRITE;
 static int sent = 0;
 static FDMessage fd_msg;
+static TimeoutId watchdog_timeout = MAX_TIMEOUTS;
+static TimeoutId deadline_timeout = MAX_TIMEOUTS;
+static TimeoutId grace_timeout = MAX_TIMEOUTS;
+static Context *volatile watched_ctx = NULL;
+static volatile wasm_module_inst_t watched_instance = NULL;
+
+static void
+on_watchdog_timeout();
+static void
+on_deadline_timeout();
+static void
+on_grace_timeout();
 
 static int32_t
 env_recv(wasm_exec_env_t exec_env,
          wasm_obj_t refobj,
          int32_t start,
          int32_t len) {
-    WaitEvent events[1];
     Context *ctx = wasm_runtime_get_user_data(exec_env);
     Datum bytes = wasm_externref_obj_get_datum(refobj, BYTEAOID);
     char *view = VARDATA_ANY(DatumGetPointer(bytes));
-    ModifyWaitEvent(ctx->wait_set,
-                    1,
-                    WL_SOCKET_READABLE | WL_SOCKET_CLOSED,
-                    NULL);
-    WaitEventSetWait(ctx->wait_set, -1, events, 1, WAIT_EVENT_CLIENT_READ);
-    if (events[0].events & WL_LATCH_SET) {
-        return -1;
-    }
-    else if (events[0].events & WL_SOCKET_CLOSED) {
-        return 0;
-    }
-    else {
-        return recv(ctx->fd, view + start, len, 0);
-    }
+    return rst_io_recv(ctx, view + start, len);
 }
 
 static int32_t
@@ -81,24 +105,14 @@ env_send(wasm_exec_env_t exec_env,
          wasm_obj_t refobj,
          int32_t start,
          int32_t len) {
-    WaitEvent events[1];
     Context *ctx = wasm_runtime_get_user_data(exec_env);
     Datum bytes = wasm_externref_obj_get_datum(refobj, BYTEAOID);
     char *view = VARDATA_ANY(DatumGetPointer(bytes));
-    ModifyWaitEvent(ctx->wait_set,
-                    1,
-                    WL_SOCKET_WRITEABLE | WL_SOCKET_CLOSED,
-                    NULL);
-    WaitEventSetWait(ctx->wait_set, -1, events, 1, WAIT_EVENT_CLIENT_WRITE);
-    if (events[0].events & WL_LATCH_SET) {
-        return -1;
-    }
-    else if (events[0].events & WL_SOCKET_CLOSED) {
-        return 0;
-    }
-    else {
-        return send(ctx->fd, view + start, len, 0);
-    }
+
+    // A response sent in several pieces is coalesced by the kernel until the
+    // guest reads again or the connection is done.
+    rst_io_cork(ctx);
+    return rst_io_send(ctx, view + start, len);
 }
 
 static void
@@ -136,6 +150,12 @@ env_llhttp_execute(wasm_exec_env_t exec_env,
     ctx->current_buf = buf;
     rv = llhttp_execute(&ctx->http_parser, view + start, len);
     ctx->current_buf = NULL;
+    if (rv == HPE_PAUSED && ctx->message_complete) {
+        const char *pos = llhttp_get_error_pos(&ctx->http_parser);
+        rst_io_end_request(ctx, pos, (int)(view + start + len - pos));
+        llhttp_resume(&ctx->http_parser);
+        return HPE_OK;
+    }
     maybe_call_on_error(exec_env, rv);
     return rv;
 }
@@ -281,6 +301,19 @@ static NativeSymbol native_env[] = {
 #endif
 };
 
+static inline int
+llhttp_cb_result(int32_t rv) {
+    switch (rv) {
+        case 0:
+            return HPE_OK;
+        case 1:
+            return -1;
+        case 2:
+            return HPE_PAUSED;
+    }
+    return -1;
+}
+
 static int
 llhttp_data_cb_impl(wasm_exec_env_t exec_env,
                     wasm_function_inst_t func,
@@ -310,15 +343,7 @@ llhttp_data_cb_impl(wasm_exec_env_t exec_env,
     if (!wasm_runtime_call_wasm_a(exec_env, func, 1, results, 1, args)) {
         return -1;
     }
-    switch (results[0].of.i32) {
-        case 0:
-            return HPE_OK;
-        case 1:
-            return -1;
-        case 2:
-            return HPE_PAUSED;
-    }
-    return -1;
+    return llhttp_cb_result(results[0].of.i32);
 }
 
 static int
@@ -327,15 +352,7 @@ llhttp_cb_impl(wasm_exec_env_t exec_env, wasm_function_inst_t func) {
     if (!wasm_runtime_call_wasm_a(exec_env, func, 1, results, 0, NULL)) {
         return -1;
     }
-    switch (results[0].of.i32) {
-        case 0:
-            return HPE_OK;
-        case 1:
-            return -1;
-        case 2:
-            return HPE_PAUSED;
-    }
-    return -1;
+    return llhttp_cb_result(results[0].of.i32);
 }
 
 static int
@@ -433,7 +450,86 @@ static int
 on_message_complete(llhttp_t *p) {
     wasm_exec_env_t exec_env = p->data;
     Context *ctx = wasm_runtime_get_user_data(exec_env);
-    return llhttp_cb_impl(exec_env, ctx->on_message_complete);
+    int rv = HPE_OK;
+    if (ctx->on_message_complete)
+        rv = llhttp_cb_impl(exec_env, ctx->on_message_complete);
+    if (rv == -1 || !ctx->keep_alive)
+        return rv;
+
+    // Stop right after this message, so that env_llhttp_execute() can hand
+    // the rest of the buffer to the next request.
+    ctx->message_complete = true;
+    return HPE_PAUSED;
+}
+
+static int
+on_request_message_begin(llhttp_t *p) {
+    wasm_exec_env_t exec_env = p->data;
+    Context *ctx = wasm_runtime_get_user_data(exec_env);
+    rst_http_head_reset(&ctx->request);
+    if (!ctx->on_message_begin)
+        return HPE_OK;
+    return llhttp_cb_impl(exec_env, ctx->on_message_begin);
+}
+
+static inline int
+on_request_data(llhttp_t *p, int kind, const char *at, size_t length) {
+    wasm_exec_env_t exec_env = p->data;
+    Context *ctx = wasm_runtime_get_user_data(exec_env);
+    const char *err = rst_http_head_append(exec_env,
+                                           &ctx->request,
+                                           ctx->current_buf,
+                                           kind,
+                                           at,
+                                           length);
+    if (err) {
+        llhttp_set_error_reason(p, err);
+        return -1;
+    }
+    return HPE_OK;
+}
+
+static int
+on_request_url(llhttp_t *p, const char *at, size_t length) {
+    return on_request_data(p, RST_HTTP_URL, at, length);
+}
+
+static int
+on_request_header_field(llhttp_t *p, const char *at, size_t length) {
+    return on_request_data(p, RST_HTTP_HEADER_FIELD, at, length);
+}
+
+static int
+on_request_header_value(llhttp_t *p, const char *at, size_t length) {
+    return on_request_data(p, RST_HTTP_HEADER_VALUE, at, length);
+}
+
+static int
+on_request_header_value_complete(llhttp_t *p) {
+    Context *ctx = wasm_runtime_get_user_data(p->data);
+    rst_http_head_end_header(&ctx->request);
+    return HPE_OK;
+}
+
+static int
+on_request_headers_complete(llhttp_t *p) {
+    wasm_exec_env_t exec_env = p->data;
+    Context *ctx = wasm_runtime_get_user_data(exec_env);
+
+    // Hand over the whole request head in one call
+    wasm_val_t results[1];
+    wasm_val_t args[1] = {
+        { .kind = WASM_EXTERNREF, .of.foreign = (uintptr_t)ctx->current_buf },
+    };
+    if (!wasm_runtime_call_wasm_a(exec_env,
+                                  ctx->on_request,
+                                  1,
+                                  results,
+                                  1,
+                                  args)) {
+        return -1;
+    }
+    return llhttp_cb_result(results[0].of.i32);
 }
 
 static bool
@@ -451,7 +547,8 @@ wasm_module_reader_callback(package_type_t module_type,
     {
         load_args->name =
             (char *)rst_prepare_module(load_args->name, p_buffer, p_size);
-        load_args->wasm_binary_freeable = true;
+        load_args->wasm_binary_freeable =
+            ((PreparedModule *)load_args->name)->code == NULL;
         rv = true;
     }
     PG_CATCH();
@@ -467,7 +564,8 @@ static bool
 wasm_module_completer_callback(wasm_module_t module) {
     PreparedModule *pmod =
         (PreparedModule *)wasm_runtime_get_module_name(module);
-    pmod->module = (AOTModule *)module;
+    pmod->module = module;
+    rst_perf_map_add(pmod);
     SPI_freetuptable(pmod->loading_tuptable);
     pmod->loading_tuptable = NULL;
     return true;
@@ -481,16 +579,25 @@ startup() {
     struct sockaddr_un addr;
 
     memset(&fd_msg, 0, sizeof(FDMessage));
-    fd_msg.io.iov_base = &fd_msg.byte;
-    fd_msg.io.iov_len = 1;
+    fd_msg.io.iov_base = &fd_msg.job;
+    fd_msg.io.iov_len = sizeof(JobInfo);
     fd_msg.msg.msg_iov = &fd_msg.io;
     fd_msg.msg.msg_iovlen = 1;
     fd_msg.msg.msg_control = fd_msg.buf;
     fd_msg.msg.msg_controllen = sizeof(fd_msg.buf);
     fd_msg.cmsg = CMSG_FIRSTHDR(&fd_msg.msg);
 
-    wait_set = CreateWaitEventSet(CurrentMemoryContext, 2);
-    AddWaitEventToSet(wait_set, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
+    // The latch, the FD channel and the client connections
+    wait_set = CreateWaitEventSetEx(CurrentMemoryContext,
+                                    2 + rst_worker_max_connections);
+    AddWaitEventToSetEx(wait_set,
+                        WL_LATCH_SET,
+                        PGINVALID_SOCKET,
+                        MyLatch,
+                        NULL);
+    connections = MemoryContextAllocZero(
+        CurrentMemoryContext,
+        sizeof(Connection) * rst_worker_max_connections);
 
     snprintf(hello, 12, BACKEND_HELLO);
     *((int *)&hello[8]) = worker_id;
@@ -505,11 +612,11 @@ startup() {
         ereport(FATAL,
                 (errmsg("rustica-%d: could not connect Unix socket: %m",
                         worker_id)));
-    AddWaitEventToSet(wait_set,
-                      WL_SOCKET_WRITEABLE | WL_SOCKET_CLOSED,
-                      sock,
-                      NULL,
-                      NULL);
+    AddWaitEventToSetEx(wait_set,
+                        WL_SOCKET_WRITEABLE | WL_SOCKET_CLOSED,
+                        sock,
+                        NULL,
+                        NULL);
     if (rst_database != NULL) {
         BackgroundWorkerInitializeConnection(rst_database, NULL, 0);
 
@@ -520,6 +627,12 @@ startup() {
         Async_Listen("rustica_module_cache_invalidation");
 
         rst_module_worker_startup();
+        watchdog_timeout = RegisterTimeout(USER_TIMEOUT, on_watchdog_timeout);
+        deadline_timeout = RegisterTimeout(USER_TIMEOUT, on_deadline_timeout);
+        grace_timeout = RegisterTimeout(USER_TIMEOUT, on_grace_timeout);
+
+        if (rst_response_cache_enabled())
+            Async_Listen(RST_RESPONSE_CACHE_CHANNEL);
 
         SPI_finish();
         CommitTransactionCommand();
@@ -554,10 +667,10 @@ on_writeable() {
                         worker_id)));
         state = WAIT_READ;
         sent = 0;
-        ModifyWaitEvent(wait_set,
-                        1,
-                        WL_SOCKET_READABLE | WL_SOCKET_CLOSED,
-                        NULL);
+        ModifyWaitEventEx(wait_set,
+                          1,
+                          WL_SOCKET_READABLE | WL_SOCKET_CLOSED,
+                          NULL);
     }
 }
 
@@ -567,12 +680,40 @@ init_llhttp(Context *ctx, wasm_module_inst_t instance) {
 
     llhttp_init(&ctx->http_parser, HTTP_REQUEST, &ctx->http_settings);
     ctx->bytes_view = -1;
+    if (ctx->keep_alive)
+        ctx->http_settings.on_message_complete = on_message_complete;
 
     if ((func = wasm_runtime_lookup_function(instance, "on_message_begin"))) {
         ctx->on_message_begin = func;
         ctx->http_settings.on_message_begin = on_message_begin;
     }
 
+    // If the guest takes the whole request head at once, parse it natively
+    // and only dispatch body and completion events to the guest.
+    if ((func = wasm_runtime_lookup_function(instance, "on_request"))) {
+        ctx->on_request = func;
+        rst_http_head_reset(&ctx->request);
+        ctx->http_settings.on_message_begin = on_request_message_begin;
+        ctx->http_settings.on_url = on_request_url;
+        ctx->http_settings.on_header_field = on_request_header_field;
+        ctx->http_settings.on_header_value = on_request_header_value;
+        ctx->http_settings.on_header_value_complete =
+            on_request_header_value_complete;
+        ctx->http_settings.on_headers_complete = on_request_headers_complete;
+        if ((func = wasm_runtime_lookup_function(instance, "on_body"))) {
+            ctx->on_body = func;
+            ctx->http_settings.on_body = on_body;
+        }
+        if ((func = wasm_runtime_lookup_function(instance,
+                                                 "on_message_complete"))) {
+            ctx->on_message_complete = func;
+            ctx->http_settings.on_message_complete = on_message_complete;
+        }
+        if ((func = wasm_runtime_lookup_function(instance, "on_error")))
+            ctx->on_error = func;
+        return;
+    }
+
     if ((func = wasm_runtime_lookup_function(instance, "on_method"))) {
         ctx->on_method = func;
         ctx->http_settings.on_method = on_method;
@@ -648,20 +789,263 @@ init_llhttp(Context *ctx, wasm_module_inst_t instance) {
     }
 }
 
+// Clear the per-request state, keeping what belongs to the connection
 static void
-on_readable() {
-    // Take a job from the FD channel
-    if (recvmsg(sock, &fd_msg.msg, 0) < 0) {
-        ereport(FATAL, errmsg("rustica-%d: failed to recvmsg: %m", worker_id));
+reset_context(Context *ctx, bool keep_alive) {
+    WaitEventSet *wait_set = ctx->wait_set;
+    pgsocket fd = ctx->fd;
+    IoState io = ctx->io;
+    RequestTiming timing = ctx->timing;
+
+    // Left behind if the previous request failed to commit
+    if (ctx->rc_resp.data)
+        pfree(ctx->rc_resp.data);
+    memset(ctx, 0, sizeof(Context));
+    ctx->wait_set = wait_set;
+    ctx->fd = fd;
+    ctx->io = io;
+    ctx->timing = timing;
+    ctx->sf_slot = -1;
+    ctx->rc_key_len = -1;
+    ctx->keep_alive = keep_alive;
+}
+
+// Check whether the client hung up, the same way as pq_check_connection()
+static bool
+client_closed(pgsocket fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int save_errno = errno;
+#ifdef POLLRDHUP
+    pfd.events |= POLLRDHUP;
+#endif
+    int rc = poll(&pfd, 1, 0);
+    errno = save_errno;
+    if (rc <= 0)
+        return false;
+#ifdef POLLRDHUP
+    if (pfd.revents & POLLRDHUP)
+        return true;
+#endif
+    return (pfd.revents & (POLLHUP | POLLERR)) != 0;
+}
+
+// Stop the running request: the guest traps at its next host call or return,
+// and SQL in progress is cancelled at the next CHECK_FOR_INTERRUPTS(). A guest
+// looping without host calls never notices, see give_up_request().
+// Called from the SIGALRM handler.
+static void
+abort_request(Context *ctx, const char *reason, int counter) {
+    ctx->abort_counter = counter;
+    ctx->aborted_at = GetCurrentTimestamp();
+    ctx->abort_reason = reason;
+    if (watched_instance)
+        wasm_runtime_terminate(watched_instance);
+    QueryCancelPending = true;
+    InterruptPending = true;
+    SetLatch(MyLatch);
+}
+
+// The request ignored its abort for the whole grace period: end the worker
+// like bgworker_die() does, the postmaster starts a new one. Called from the
+// SIGALRM handler.
+static void
+give_up_request(Context *ctx) {
+    sigprocmask(SIG_SETMASK, &BlockSig, NULL);
+    ereport(FATAL,
+            (errcode(ERRCODE_QUERY_CANCELED),
+             errmsg("rustica-%d: request still running %d ms after it was "
+                    "aborted (%s), terminating worker",
+                    worker_id,
+                    rst_abort_grace_period,
+                    ctx->abort_reason)));
+}
+
+static void
+on_watchdog_timeout() {
+    Context *ctx = watched_ctx;
+    if (ctx == NULL)
+        return;
+    if (ctx->abort_reason != NULL) {
+        if (rst_abort_grace_period > 0
+            && TimestampDifferenceExceeds(ctx->aborted_at,
+                                          GetCurrentTimestamp(),
+                                          rst_abort_grace_period))
+            give_up_request(ctx);
+        return;
     }
-    pgsocket client = *((int *)CMSG_DATA(fd_msg.cmsg));
+    if (client_closed(ctx->fd))
+        abort_request(ctx,
+                      "client closed the connection",
+                      RST_IO_DISCONNECTS);
+}
+
+static void
+on_deadline_timeout() {
+    Context *ctx = watched_ctx;
+    if (ctx == NULL || ctx->abort_reason != NULL)
+        return;
+    abort_request(ctx, "request timeout exceeded", RST_IO_TIMEOUTS);
+}
+
+static void
+on_grace_timeout() {
+    Context *ctx = watched_ctx;
+    if (ctx == NULL || ctx->abort_reason == NULL)
+        return;
+    give_up_request(ctx);
+}
+
+// Start the timers of a request. The deadline counts from the start of the
+// transaction, so module loading and instantiation are part of the budget.
+static void
+watch_request(Context *ctx, wasm_module_inst_t instance, int timeout) {
+    TimestampTz now = GetCurrentTimestamp();
+    TimestampTz deadline;
+
+    watched_ctx = ctx;
+    watched_instance = instance;
+    if (watchdog_timeout != MAX_TIMEOUTS && rst_client_check_interval > 0)
+        enable_timeout_every(
+            watchdog_timeout,
+            TimestampTzPlusMilliseconds(now, rst_client_check_interval),
+            rst_client_check_interval);
+    if (deadline_timeout != MAX_TIMEOUTS && timeout > 0) {
+        deadline = TimestampTzPlusMilliseconds(
+            GetCurrentStatementStartTimestamp(), timeout);
+        enable_timeout_at(deadline_timeout, deadline);
+        if (grace_timeout != MAX_TIMEOUTS && rst_abort_grace_period > 0)
+            enable_timeout_at(
+                grace_timeout,
+                TimestampTzPlusMilliseconds(deadline, rst_abort_grace_period));
+    }
+}
+
+static void
+unwatch_request() {
+    if (watchdog_timeout != MAX_TIMEOUTS)
+        disable_timeout(watchdog_timeout, false);
+    if (deadline_timeout != MAX_TIMEOUTS)
+        disable_timeout(deadline_timeout, false);
+    if (grace_timeout != MAX_TIMEOUTS)
+        disable_timeout(grace_timeout, false);
+    watched_ctx = NULL;
+    watched_instance = NULL;
+
+    // A cancel raised after the last CHECK_FOR_INTERRUPTS() of the request
+    // must not hit the next one.
+    QueryCancelPending = false;
+}
+
+// Answer the request from the shared response cache, or with the response of
+// an identical request in flight, without running WASM or SPI. Requests that
+// neither caches nor singleflight may share get no key. On a cache miss, the
+// key is kept so that the response can be stored, and on a singleflight miss,
+// this request leads the identical ones that come after it.
+static bool
+serve_shared_response(Context *ctx, const char *module, bool *keep_alive) {
+    const char *head;
+    const char *source;
+    bool lookup;
+    StringInfoData resp;
+
+    int len = rst_io_peek_head(ctx, &head);
+    if (len == 0)
+        return false;
+    ctx->rc_key_len = rst_response_cache_key(head,
+                                             len,
+                                             module,
+                                             ctx->rc_key,
+                                             &lookup,
+                                             keep_alive);
+    if (ctx->rc_key_len < 0)
+        return false;
+    initStringInfo(&resp);
+    if (lookup
+        && rst_response_cache_lookup(ctx->rc_key, ctx->rc_key_len, &resp))
+        source = "response cache";
+    else if (rst_singleflight_begin(ctx->rc_key,
+                                    ctx->rc_key_len,
+                                    &ctx->sf_slot,
+                                    &resp)
+             == SF_FOLLOWER)
+        source = "singleflight";
+    else {
+        pfree(resp.data);
+        if (!rst_response_cache_enabled())
+            ctx->rc_key_len = -1;
+        return false;
+    }
+
     ereport(DEBUG1,
-            errmsg("rustica-%d: received job: fd=%d", worker_id, client));
+            errmsg("rustica-%d: serve %d bytes from %s",
+                   worker_id,
+                   resp.len,
+                   source));
+    rst_io_consume(ctx, len);
+    ctx->rc_key_len = -1;
+    if (!rst_io_send_all(ctx, resp.data, resp.len))
+        *keep_alive = false;
+    pfree(resp.data);
+    return true;
+}
+
+// The master only answers the first request of a connection from the static
+// asset files, and only if its head was there on accept. Later requests on
+// the connection, or late ones, are answered here from the same files, so
+// that a path is never an asset one time and the guest's answer the next.
+static bool
+serve_static_asset(Context *ctx) {
+    const char *head;
+    StaticResponse resp;
+    char buf[BLCKSZ];
+    bool ok;
+
+    int len = rst_io_peek_head(ctx, &head);
+    if (len == 0 || !rst_assets_lookup(head, len, &resp))
+        return false;
+    rst_io_consume(ctx, resp.consumed);
+    ok = rst_io_send_all(ctx, resp.head, resp.head_len);
+    while (ok && resp.remaining > 0) {
+        ssize_t nbytes = pread(resp.file,
+                               buf,
+                               Min(resp.remaining, (off_t)sizeof(buf)),
+                               resp.offset);
+        if (nbytes <= 0)
+            break;
+        ok = rst_io_send_all(ctx, buf, (int)nbytes);
+        resp.offset += nbytes;
+        resp.remaining -= nbytes;
+    }
+    if (resp.file >= 0)
+        close(resp.file);
+    return true;
+}
 
-    // Prepare to handle the connection
+// Run one request on the connection in its own transaction and WASM instance.
+// Returns true if the connection can be reused for another request.
+static bool
+handle_request(Context *ctx, bool keep_alive) {
     bool spi_connected = false;
     wasm_exec_env_t exec_env = NULL;
     bool success = false;
+    bool cached_keep_alive;
+    const char *name = "main";
+    TimestampTz start = GetCurrentTimestamp(), phase_start;
+
+    reset_context(ctx, keep_alive);
+    rst_io_begin_request(ctx);
+    if (rst_static_cache && serve_static_asset(ctx)) {
+        // Static responses close the connection, like the master's
+        ctx->timing.accepted_at = 0;
+        return false;
+    }
+    if ((rst_response_cache_enabled() || rst_singleflight_enabled())
+        && rst_database != NULL
+        && serve_shared_response(ctx, name, &cached_keep_alive)) {
+        ctx->timing.accepted_at = 0;
+        return keep_alive && cached_keep_alive
+               && rst_http_sent_reusable(&ctx->sent, false, false);
+    }
 
     PG_TRY();
     {
@@ -673,55 +1057,87 @@ on_readable() {
         // Connect to SPI
         SetCurrentStatementStartTimestamp();
         StartTransactionCommand();
+        if (ctx->rc_key_len > 0) {
+            // The response is only stored once the transaction committed
+            MemoryContext mctx = MemoryContextSwitchTo(TopMemoryContext);
+            initStringInfo(&ctx->rc_resp);
+            MemoryContextSwitchTo(mctx);
+        }
         SPI_connect();
         PushActiveSnapshot(GetTransactionSnapshot());
         spi_connected = true;
 
         // Load module if it's not loaded already
-        const char *name = "main";
         PreparedModule *pmod = rst_lookup_module(name);
+        ctx->timing.module = name;
         if (!pmod) {
             pgstat_report_activity(STATE_RUNNING, "loading WASM application");
             ereport(DEBUG1,
                     errmsg("rustica-%d: load module \"%s\"", worker_id, name));
+            phase_start = GetCurrentTimestamp();
             pmod = rst_prepare_module(name, NULL, NULL);
+            rst_stats_record(name,
+                             RST_PHASE_PREPARE,
+                             phase_start,
+                             GetCurrentTimestamp());
         }
 
         // Instantiate the WASM module
         pgstat_report_activity(STATE_RUNNING, "running WASM application");
+        phase_start = GetCurrentTimestamp();
         exec_env = rst_module_instantiate(pmod, 256 * 1024, 1024 * 1024);
+        rst_stats_record(name,
+                         RST_PHASE_INSTANTIATE,
+                         phase_start,
+                         GetCurrentTimestamp());
+        phase_start = GetCurrentTimestamp();
 
         // Prepare context for execution
-        Context context = { .fd = client, .module = pmod };
-        wasm_runtime_set_user_data(exec_env, &context);
-        context.wait_set = CreateWaitEventSet(CurrentMemoryContext, 2);
-        AddWaitEventToSet(context.wait_set,
-                          WL_LATCH_SET,
-                          PGINVALID_SOCKET,
-                          MyLatch,
-                          NULL);
-        AddWaitEventToSet(context.wait_set,
-                          WL_SOCKET_CLOSED,
-                          client,
-                          NULL,
-                          NULL);
+        ctx->module = pmod;
+        wasm_runtime_set_user_data(exec_env, ctx);
 
         // Initialize context
         rst_init_instance_context(exec_env);
         rst_init_context_for_jsonb(exec_env);
         wasm_module_inst_t instance = wasm_exec_env_get_module_inst(exec_env);
-        init_llhttp(&context, instance);
-        context.http_parser.data = exec_env;
+        init_llhttp(ctx, instance);
+        ctx->http_parser.data = exec_env;
+        rst_stats_record(name,
+                         RST_PHASE_INIT_CONTEXT,
+                         phase_start,
+                         GetCurrentTimestamp());
 
         // Run the WASM module instance
         wasm_function_inst_t start_func =
             wasm_runtime_lookup_function(instance, "_start");
         if (!start_func)
             ereport(ERROR, errmsg("cannot find WASM entrypoint"));
+        watch_request(ctx,
+                      instance,
+                      pmod->request_timeout >= 0 ? pmod->request_timeout
+                                                 : rst_request_timeout);
+        phase_start = GetCurrentTimestamp();
         success = wasm_runtime_call_wasm(exec_env, start_func, 0, NULL);
+        rst_stats_record(name,
+                         RST_PHASE_START,
+                         phase_start,
+                         GetCurrentTimestamp());
+#if WASM_ENABLE_AOT_PGO != 0
+        if (success)
+            rst_pgo_collect(pmod, instance);
+#endif
     }
     PG_FINALLY();
     {
+        unwatch_request();
+        if (ctx->abort_reason) {
+            ereport(LOG,
+                    errmsg("rustica-%d: request aborted: %s",
+                           worker_id,
+                           ctx->abort_reason));
+            ctx->io.counters[ctx->abort_counter]++;
+            success = false;
+        }
         if (exec_env) {
             wasm_module_inst_t instance =
                 wasm_exec_env_get_module_inst(exec_env);
@@ -730,25 +1146,235 @@ on_readable() {
             wasm_runtime_destroy_exec_env(exec_env);
         }
 
+        if (ctx->sf_slot >= 0)
+            rst_singleflight_finish(ctx->sf_slot, success && !_do_rethrow);
+
         if (spi_connected) {
             SPI_finish();
             PopActiveSnapshot();
-            if (success && !_do_rethrow)
+            if (success && !_do_rethrow) {
+                phase_start = GetCurrentTimestamp();
                 CommitTransactionCommand();
+                rst_stats_record(name,
+                                 RST_PHASE_COMMIT,
+                                 phase_start,
+                                 GetCurrentTimestamp());
+                if (ctx->rc_key_len > 0 && !ctx->io.detached)
+                    rst_response_cache_store(ctx->rc_key,
+                                             ctx->rc_key_len,
+                                             ctx->rc_resp.data,
+                                             ctx->rc_resp.len);
+#if WASM_ENABLE_AOT_PGO != 0
+                rst_pgo_flush();
+#endif
+            }
             else
                 AbortCurrentTransaction();
             pgstat_report_stat(true);
             pgstat_report_activity(STATE_IDLE, NULL);
         }
+        if (ctx->rc_resp.data) {
+            pfree(ctx->rc_resp.data);
+            ctx->rc_resp.data = NULL;
+        }
 
-        StreamClose(client);
-        state = WAIT_WRITE;
-        ModifyWaitEvent(wait_set,
-                        1,
-                        WL_SOCKET_WRITEABLE | WL_SOCKET_CLOSED,
-                        NULL);
+        // The first request on a connection was also queued by the master
+        if (ctx->timing.accepted_at) {
+            rst_stats_record(name,
+                             RST_PHASE_QUEUE,
+                             ctx->timing.accepted_at,
+                             ctx->timing.dispatched_at);
+            rst_stats_record(name,
+                             RST_PHASE_DISPATCH,
+                             ctx->timing.dispatched_at,
+                             ctx->timing.received_at);
+            start = ctx->timing.accepted_at;
+            ctx->timing.accepted_at = 0;
+        }
+        rst_stats_record(name, RST_PHASE_REQUEST, start, GetCurrentTimestamp());
+    }
+    PG_END_TRY();
+
+    return success && ctx->message_complete && !ctx->io.detached
+           && llhttp_should_keep_alive(&ctx->http_parser)
+           && rst_http_sent_reusable(
+               &ctx->sent,
+               llhttp_get_method(&ctx->http_parser) == HTTP_HEAD,
+               ctx->http_parser.http_major == 1
+                   && ctx->http_parser.http_minor == 0);
+}
+
+// Serve one request like handle_request(), except that the error raised by the
+// watchdog aborting it is swallowed: the client is gone, the worker is not.
+static bool
+serve_request(Context *ctx, bool keep_alive) {
+    volatile bool rv = false;
+    MemoryContext mcxt = CurrentMemoryContext;
+
+    PG_TRY();
+    {
+        rv = handle_request(ctx, keep_alive);
+    }
+    PG_CATCH();
+    {
+        if (ctx->abort_reason == NULL)
+            PG_RE_THROW();
+        MemoryContextSwitchTo(mcxt);
+        FlushErrorState();
     }
     PG_END_TRY();
+    return rv;
+}
+
+static void
+on_notification_received();
+
+static void
+open_connection(Connection *conn, pgsocket client) {
+    Context *ctx = MemoryContextAllocZero(TopMemoryContext, sizeof(Context));
+    ctx->fd = client;
+
+    // The wait set outlives the per-request transactions
+    ctx->wait_set = CreateWaitEventSet(TopMemoryContext, 2);
+    AddWaitEventToSet(ctx->wait_set,
+                      WL_LATCH_SET,
+                      PGINVALID_SOCKET,
+                      MyLatch,
+                      NULL);
+    AddWaitEventToSet(ctx->wait_set, WL_SOCKET_CLOSED, client, NULL, NULL);
+    rst_io_open(ctx);
+
+    conn->ctx = ctx;
+    conn->nrequests = 0;
+    conn->idle_deadline = 0;
+    conn->pos = AddWaitEventToSetEx(wait_set,
+                                    WL_SOCKET_READABLE | WL_SOCKET_CLOSED,
+                                    client,
+                                    NULL,
+                                    conn);
+    Assert(conn->pos != -1);
+    nconnections++;
+}
+
+static void
+close_connection(Connection *conn) {
+    Context *ctx = conn->ctx;
+    TimestampTz start = GetCurrentTimestamp();
+
+    DeleteWaitEventEx(wait_set, conn->pos);
+    rst_io_uncork(ctx);
+    rst_io_close(ctx);
+    FreeWaitEventSet(ctx->wait_set);
+    StreamClose(ctx->fd);
+    if (ctx->timing.module)
+        rst_stats_record(ctx->timing.module,
+                         RST_PHASE_CLOSE,
+                         start,
+                         GetCurrentTimestamp());
+    pfree(ctx);
+    conn->ctx = NULL;
+    nconnections--;
+
+    // There is room for another job now
+    if (state == WAIT_FULL) {
+        state = WAIT_WRITE;
+        ModifyWaitEventEx(wait_set,
+                          1,
+                          WL_SOCKET_WRITEABLE | WL_SOCKET_CLOSED,
+                          NULL);
+    }
+}
+
+// Run the requests buffered on a connection. Requests only start once they
+// have fully arrived, so a slow client holds neither a transaction nor the
+// worker; keep-alive connections go back to waiting in the main loop.
+static void
+on_connection_readable(Connection *conn) {
+    Context *ctx = conn->ctx;
+
+    for (;;) {
+        int status = rst_io_fill(ctx);
+        if (status == RST_IO_FILL_PENDING)
+            return;
+        if (status == RST_IO_FILL_CLOSED || shutdown_requested)
+            break;
+        if (!serve_request(ctx,
+                           ++conn->nrequests
+                               < rst_max_requests_per_connection))
+            break;
+        conn->idle_deadline =
+            TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+                                        rst_keepalive_timeout);
+        if (notifyInterruptPending)
+            on_notification_received();
+    }
+    close_connection(conn);
+}
+
+// Close keep-alive connections that stayed idle for too long, and return the
+// milliseconds until the next one expires, or -1.
+static long
+expire_connections() {
+    TimestampTz now = GetCurrentTimestamp();
+    TimestampTz next = 0;
+
+    for (int i = 0; i < rst_worker_max_connections; i++) {
+        Connection *conn = &connections[i];
+        if (conn->ctx == NULL || conn->idle_deadline == 0)
+            continue;
+        if (conn->idle_deadline <= now) {
+            ereport(DEBUG1,
+                    errmsg("rustica-%d: keep-alive timeout on fd=%d",
+                           worker_id,
+                           conn->ctx->fd));
+            close_connection(conn);
+        }
+        else if (next == 0 || conn->idle_deadline < next)
+            next = conn->idle_deadline;
+    }
+    return next == 0 ? -1 : TimestampDifferenceMilliseconds(now, next);
+}
+
+static void
+on_readable() {
+    Connection *conn = NULL;
+
+    // Take a job from the FD channel, with its JobInfo in one piece
+    if (recvmsg(sock, &fd_msg.msg, MSG_WAITALL) < 0) {
+        ereport(FATAL, errmsg("rustica-%d: failed to recvmsg: %m", worker_id));
+    }
+    pgsocket client = *((int *)CMSG_DATA(fd_msg.cmsg));
+    ereport(DEBUG1,
+            errmsg("rustica-%d: received job: fd=%d", worker_id, client));
+
+    // A job is only asked for when there is room for it
+    for (int i = 0; i < rst_worker_max_connections; i++) {
+        if (connections[i].ctx == NULL) {
+            conn = &connections[i];
+            break;
+        }
+    }
+    Assert(conn != NULL);
+    open_connection(conn, client);
+    conn->ctx->timing.accepted_at = fd_msg.job.accepted_at;
+    conn->ctx->timing.dispatched_at = fd_msg.job.dispatched_at;
+    conn->ctx->timing.received_at = GetCurrentTimestamp();
+
+    // Ask for another job right away if there is still room
+    if (nconnections < rst_worker_max_connections) {
+        state = WAIT_WRITE;
+        ModifyWaitEventEx(wait_set,
+                          1,
+                          WL_SOCKET_WRITEABLE | WL_SOCKET_CLOSED,
+                          NULL);
+    }
+    else {
+        state = WAIT_FULL;
+        ModifyWaitEventEx(wait_set, 1, WL_SOCKET_CLOSED, NULL);
+    }
+
+    // The request has usually arrived together with the connection
+    on_connection_readable(conn);
 }
 
 static void
@@ -774,6 +1400,10 @@ mock_comm_putmessage(char msgtype, const char *s, size_t len) {
             const char *payload = pq_getmsgstring(&msg);
             invalidate_cached_module(payload);
         }
+        else if (strcmp(channel, RST_RESPONSE_CACHE_CHANNEL) == 0) {
+            const char *payload = pq_getmsgstring(&msg);
+            rst_response_cache_purge(payload);
+        }
     }
     return 0;
 }
@@ -799,35 +1429,45 @@ on_notification_received() {
 
 static void
 main_loop() {
-    WaitEvent events[2];
+    int max_events = 2 + rst_worker_max_connections;
+    WaitEvent events[max_events];
     int nevents;
     long timeout;
 
-    if (rst_worker_idle_timeout == 0)
-        timeout = -1;
-    else
-        timeout = rst_worker_idle_timeout * 1000;
     for (;;) {
-        nevents = WaitEventSetWait(wait_set, timeout, events, 2, 0);
-
-        if (nevents == 0 && state == WAIT_READ) {
+        // Idle keep-alive connections bound the wait, and the worker only
+        // times out by itself when it has no connection at all.
+        timeout = expire_connections();
+        if (nconnections == 0 && rst_worker_idle_timeout > 0)
+            timeout = rst_worker_idle_timeout * 1000L;
+        nevents = WaitEventSetWaitEx(wait_set, timeout, events, max_events, 0);
+
+        if (nevents == 0 && nconnections == 0 && state == WAIT_READ) {
             ereport(DEBUG1, (errmsg("rustica-%d: idle timeout", worker_id)));
             return;
         }
         for (int i = 0; i < nevents; i++) {
+            Connection *conn = (Connection *)events[i].user_data;
             if (events[i].events & WL_LATCH_SET) {
                 if (shutdown_requested)
                     return;
                 ResetLatch(MyLatch);
             }
-            if (events[i].events & WL_SOCKET_CLOSED) {
+            else if (conn != NULL) {
+                // Skip events of connections closed earlier in this round
+                if (conn->ctx != NULL)
+                    on_connection_readable(conn);
+            }
+            else if (events[i].events & WL_SOCKET_CLOSED) {
                 ereport(DEBUG1,
                         (errmsg("rustica-%d: Unix socket closed", worker_id)));
                 return;
             }
-            if (state == WAIT_WRITE && events[i].events & WL_SOCKET_WRITEABLE)
+            else if (state == WAIT_WRITE
+                     && events[i].events & WL_SOCKET_WRITEABLE)
                 on_writeable();
-            if (state == WAIT_READ && events[i].events & WL_SOCKET_READABLE)
+            else if (state == WAIT_READ
+                     && events[i].events & WL_SOCKET_READABLE)
                 on_readable();
         }
 
@@ -839,8 +1479,12 @@ main_loop() {
 
 static void
 teardown() {
+    for (int i = 0; i < rst_worker_max_connections; i++)
+        if (connections[i].ctx != NULL)
+            close_connection(&connections[i]);
+    pfree(connections);
     rst_module_worker_teardown();
-    FreeWaitEventSet(wait_set);
+    FreeWaitEventSetEx(wait_set);
     StreamClose(sock);
     sock = PGINVALID_SOCKET;
 }